@@ -1,4 +1,5 @@
 #! /usr/bin/python
+# Not needed when scdaq moves the files itself (mover_destination in scdaq.conf)
 
 if __name__ == "__main__":
     from os import listdir
@@ -6,6 +7,9 @@ if __name__ == "__main__":
     import time
     import os
 
+    # Checks a file against the size and CRC32C in its metadata (<file>.json) without compressing it
+    scdaq = join(os.path.dirname(os.path.abspath(__file__)), '../src/scdaq')
+
     while True:
         try:
             onlyfiles = [f for f in listdir('/fff/ramdisk/scdaq') if isfile(join('/fff/ramdisk/scdaq', f)) and f.endswith('.dat')]
@@ -15,13 +19,21 @@ if __name__ == "__main__":
             print onlyfiles
             for f in onlyfiles:
                 full_filename = join('/fff/ramdisk/scdaq', f)
+                meta_filename = full_filename+'.json'
+                command = scdaq+" --verify "+full_filename
+                print "verifying "+full_filename
+                retval = os.system(command)
+                if retval!=0:
+                    print "corrupted "+full_filename+", keeping it as .corrupted"
+                    os.rename(full_filename, full_filename+'.corrupted')
+                    continue
                 outfile = f+'.bz2'
                 dest_name = join('/fff/output/scdaq',outfile)
                 command = "lbzip2 "+full_filename+" -c > "+dest_name
                 print "compressing "+full_filename
                 retval = os.system(command)
                 if retval==0:
-                    command = "rm "+full_filename
+                    command = "cp "+meta_filename+" /fff/output/scdaq/ && rm "+full_filename+" "+meta_filename
                     print "deleting "+full_filename
                     retval = os.system(command)
         except OSError as err:
@@ -7,7 +7,9 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "DmaInputFilter.h"
 #include "log.h"
@@ -22,10 +24,20 @@ DmaInputFilter::DmaInputFilter( const std::string& deviceFileName, size_t packet
     throw std::system_error(errno, std::system_category(), "Cannot open DMA device: " + deviceFileName);
   }
 
+  wakeup_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if ( wakeup_fd < 0 ) {
+    int err = errno;
+    close( dma_fd );
+    throw std::system_error(err, std::system_category(), "Cannot create eventfd");
+  }
+  control.add_wakeup( wakeup_fd );
+
   LOG(TRACE) << "Created DMA input filter"; 
 }
 
 DmaInputFilter::~DmaInputFilter() {
+  control().remove_wakeup( wakeup_fd );
+  close( wakeup_fd );
   close( dma_fd );
   LOG(TRACE) << "Destroyed DMA input filter";
 }
@@ -64,12 +76,31 @@ ssize_t DmaInputFilter::readPacketFromDMA(char **buffer, size_t bufferSize)
 
   ssize_t bytesRead = 0;
   int skip = 0;
+  bool afterWait = false;
 
   while (true) {
     // Read from DMA
     bytesRead = read_axi_packet_to_buffer(dma_fd, *buffer, bufferSize);
 
     if (bytesRead < 0) {
+      // No data, the device is opened non-blocking
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (afterWait && !pollBroken_) {
+          // The device said there is data, but there is none
+          stats.nbSpuriousWakeups++;
+          if (++spuriousInRow_ >= 10) {
+            pollBroken_ = true;
+            LOG(WARNING) << "#" << nbReads() << ": DMA device does not support poll, falling back to checking it every millisecond";
+          }
+        }
+        afterWait = true;
+        if (!waitForData()) {
+          // The run state changed, an empty packet lets the output react, shutdown ends the input
+          return control().shutdown ? 0 : IDLE;
+        }
+        continue;
+      }
+
       skip++;
       // Check for errors and then skip
       if (errno == EIO || errno == EMSGSIZE) {
@@ -90,6 +121,7 @@ ssize_t DmaInputFilter::readPacketFromDMA(char **buffer, size_t bufferSize)
     }
 
     // We have some data
+    spuriousInRow_ = 0;
     break;
   }
 
@@ -97,6 +129,50 @@ ssize_t DmaInputFilter::readPacketFromDMA(char **buffer, size_t bufferSize)
 }
 
 
+bool DmaInputFilter::waitForData()
+{
+  // Wake up from time to time anyway, so a missed notification cannot block the shutdown
+  static constexpr int timeout_ms = 1000;
+  // Without a working poll, the device is checked this often
+  static constexpr int broken_poll_interval_ms = 1;
+
+  struct pollfd fds[2];
+  fds[0].fd = wakeup_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = dma_fd;
+  fds[1].events = POLLIN;
+
+  stats.nbWaits++;
+  tbb::tick_count t0 = tbb::tick_count::now();
+
+  while (true) {
+    if (control().shutdown) {
+      stats.idleSeconds += (tbb::tick_count::now() - t0).seconds();
+      return false;
+    }
+
+    int ret = poll( fds, pollBroken_ ? 1 : 2, pollBroken_ ? broken_poll_interval_ms : timeout_ms );
+    if (ret < 0 && errno != EINTR) {
+      throw std::system_error(errno, std::system_category(), "Cannot poll DMA device");
+    }
+
+    if (ret > 0 && (fds[0].revents & POLLIN)) {
+      uint64_t count;
+      ssize_t n = read( wakeup_fd, &count, sizeof(count) );
+      (void)(n);
+      stats.nbWakeups++;
+      stats.idleSeconds += (tbb::tick_count::now() - t0).seconds();
+      return false;
+    }
+
+    if ((ret > 0 && (fds[1].revents & (POLLIN | POLLERR))) || (ret == 0 && pollBroken_)) {
+      stats.idleSeconds += (tbb::tick_count::now() - t0).seconds();
+      return true;
+    }
+  }
+}
+
+
 /**************************************************************************
  * Entry points are here
  * Overriding virtual functions
@@ -108,7 +184,9 @@ void DmaInputFilter::print(std::ostream& out) const
 {
     out 
       << ", DMA errors " << stats.nbDmaErrors
-      << ", oversized " << stats.nbDmaOversizedPackets;
+      << ", oversized " << stats.nbDmaOversizedPackets
+      << ", idle " << stats.idleSeconds << " sec in " << stats.nbWaits << " wait(s)"
+      << ", wakeups " << stats.nbWakeups << " (spurious " << stats.nbSpuriousWakeups << ")";
 }
 
 
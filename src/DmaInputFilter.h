@@ -20,13 +20,26 @@ protected:
 
 private:
   int dma_fd;
+  // Signalled by the run control, wakes up waitForData
+  int wakeup_fd;
 
   ssize_t readPacketFromDMA(char **buffer, size_t bufferSize);
 
+  // Wait until the device has data or the run state changed, returns false in the latter case
+  bool waitForData();
+
   struct Statistics {
     uint64_t nbDmaErrors = 0;
     uint64_t nbDmaOversizedPackets = 0;
+    uint64_t nbWaits = 0;
+    uint64_t nbWakeups = 0;
+    uint64_t nbSpuriousWakeups = 0;
+    double idleSeconds = 0;
   } stats;
+
+  // The device reported data but the read returned EAGAIN, e.g. if it does not implement poll
+  bool pollBroken_ = false;
+  unsigned spuriousInRow_ = 0;
 };
 
 
@@ -1,44 +1,142 @@
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <cmath>
+#include <cstring>
 #include <system_error>
 #include <sstream>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "FileDmaInputFilter.h"
+#include "format.h"
 #include "log.h"
+#include "trailer.h"
 
 
-FileDmaInputFilter::FileDmaInputFilter( const std::string& fileName, size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control ) : 
-  InputFilter( packetBufferSize, nbPacketBuffers, control )
+// A larger jump in the source time is not replayed, the pacing starts again
+static constexpr double max_replay_gap_seconds = 60;
+
+// A packet released later than this is counted as late
+static constexpr double late_seconds = 1e-3;
+
+// Longest sleep, the shutdown is checked in between
+static constexpr int64_t max_sleep_ns = 100000000;
+
+static inline int64_t monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+
+FileDmaInputFilter::FileDmaInputFilter( const std::string& fileName, size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control,
+                                        const ReplayConfig& replay ) : 
+  InputFilter( packetBufferSize, nbPacketBuffers, control ),
+  fileName_(fileName),
+  nbPacketsInPass_(0),
+  replay_(replay),
+  timestampFile_(NULL),
+  nbTimestampsInPass_(0),
+  lastTimestamp_(0),
+  timestampCountWarned_(false),
+  paced_(false),
+  baseSourceTime_(0),
+  baseNs_(0),
+  lastSourceTime_(0)
 { 
+  if ( replay_.speedup <= 0 ) {
+    throw std::invalid_argument( "Configuration error: The replay speedup has to be positive" );
+  }
+
   inputFile = fopen( fileName.c_str(), "r" );
   if ( !inputFile ) {
     throw std::invalid_argument( "Invalid input file name: " + fileName );
   }
+
+  if ( replay_.pacing == ReplayConfig::Pacing::TIMESTAMPS ) {
+    timestampFile_ = fopen( replay_.timestampFile.c_str(), "r" );
+    if ( !timestampFile_ ) {
+      fclose( inputFile );
+      throw std::invalid_argument( "Invalid replay timestamp file name: " + replay_.timestampFile );
+    }
+  }
+
+  if ( replay_.pacing != ReplayConfig::Pacing::NONE ) {
+    LOG(INFO) << "Replay paced by " << (replay_.pacing == ReplayConfig::Pacing::ORBIT ? "orbit numbers" : "timestamps")
+              << ", speedup " << replay_.speedup;
+  }
   LOG(TRACE) << "Created file input filter"; 
 }
 
 FileDmaInputFilter::~FileDmaInputFilter() {
+  if ( timestampFile_ ) {
+    fclose( timestampFile_ );
+  }
   fclose( inputFile );
   LOG(TRACE) << "Destroyed file input filter";
 }
 
+/*
+ * Skip the input up to and including the next orbit trailer, which is searched at any
+ * 32-bit word, so the reading is aligned again after corrupted data.
+ * The buffer is used as scratch space. Returns the number of bytes skipped.
+ */
+static uint64_t skip_to_next_trailer(FILE *inputFile, char *buffer, size_t size)
+{
+  uint64_t skipped = 0;
+  // Bytes kept from the previous read, a trailer can span two reads
+  size_t kept = 0;
+
+  while (true) {
+    size_t rc = fread( buffer + kept, 1, size - kept, inputFile );
+    if (ferror(inputFile)) {
+      throw std::system_error(errno, std::system_category(), "File error");
+    }
+
+    char *end = buffer + kept + rc;
+    char *found = trailer::find( buffer, end );
+    if (found != end) {
+      // Continue reading after the trailer
+      char *next = found + constants::orbit_trailer_size;
+      fseek( inputFile, -(long)(end - next), SEEK_CUR );
+      return skipped + (next - buffer);
+    }
+
+    if (rc == 0) {
+      // No trailer up to the end of the file
+      return skipped + kept;
+    }
+
+    kept = std::min( (size_t)(end - buffer), (size_t)constants::orbit_trailer_size - sizeof(uint32_t) );
+    skipped += (end - buffer) - kept;
+    memmove( buffer, end - kept, kept );
+  }
+}
+
+
 /*
  * This function reads packet by packet from a file
  * in order to simulate DMA reads.
+ *
+ * Returns the packet size, -1 if the packet did not fit into the buffer and
+ * it was skipped up to the next trailer, or 0 at the end of the file. A packet
+ * cut by the end of the file is skipped.
  * 
  * TODO: Better would be mmap directly the file
  */ 
-static inline ssize_t read_dma_packet_from_file(FILE *inputFile, char *buffer, uint64_t size, uint64_t nbReads)
+static inline ssize_t read_dma_packet_from_file(FILE *inputFile, char *buffer, uint64_t size, uint64_t nbReads, uint64_t& skippedBytes)
 {
   static constexpr uint64_t deadbeaf = 0xdeadbeefdeadbeefL;
+  char *start = buffer;
   size_t bytesRead = 0;
   size_t rc;
 
-  while ( !feof(inputFile) && bytesRead < size) {
+  while ( bytesRead < size ) {
     // Expecting 32 byte alignment 
     rc = fread( buffer, 1, 32, inputFile );
 
@@ -47,14 +145,13 @@ static inline ssize_t read_dma_packet_from_file(FILE *inputFile, char *buffer, u
     }
 
     if (rc != 32) {
-      if ( feof(inputFile) && rc == 0 && bytesRead == 0) {
-        // We have reached the perfect end of the file, let's start again
-        fseek(inputFile, 0, SEEK_SET);
-        continue;
+      if ( bytesRead + rc > 0 ) {
+        // Misaligned data or a truncated file, drop the incomplete packet
+        LOG(WARNING) << "#" << nbReads << ": File read ends prematurely, skipping " << bytesRead + rc << " bytes of an incomplete packet";
+        skippedBytes += bytesRead + rc;
       }
-
-      // Misaligned data
-      throw std::runtime_error("#" + std::to_string(nbReads) + ": File read ends prematurely, missing " + std::to_string(32-rc) + " bytes. Something is probably misaligned.");
+      // We have reached the end of the file, the caller starts again
+      return 0;
     }
 
     bytesRead += 32;
@@ -67,18 +164,8 @@ static inline ssize_t read_dma_packet_from_file(FILE *inputFile, char *buffer, u
     buffer += 32;
   }
 
-  // We are here either
-  //   because we found EOF earlier than the end of the packet 
-  //   or the packet cannot fit into the buffer
-  // We can deal with both conditions but for the moment we throw an error 
-
-  if (feof(inputFile)) {
-    throw std::runtime_error("EOF reached but no end of the packet found.");
-  }
-
-  throw std::runtime_error("Packet is too big and cannot fit into preallocated memory");
-  // TODO: Read and discard data until deadbeef is found
-
+  // The packet cannot fit into the buffer or the trailer is not 32 byte aligned, resynchronize
+  skippedBytes += bytesRead + skip_to_next_trailer( inputFile, start, size );
   return -1;
 }
 
@@ -87,25 +174,153 @@ inline ssize_t FileDmaInputFilter::readPacket(char **buffer, size_t bufferSize)
 {
   // Read from DMA
   int skip = 0;
-  ssize_t bytesRead = read_dma_packet_from_file(inputFile, *buffer, bufferSize, nbReads() );
+  ssize_t bytesRead = read_dma_packet_from_file(inputFile, *buffer, bufferSize, nbReads(), stats.nbSkippedBytes );
+
+  // If a packet was skipped or the end of the file was reached, read again
+  while ( bytesRead <= 0 ) {
+    if ( bytesRead == 0 ) {
+      rewindInput();
+      bytesRead = read_dma_packet_from_file(inputFile, *buffer, bufferSize, nbReads(), stats.nbSkippedBytes );
+      continue;
+    }
 
-  // If large packet returned, skip and read again
-  while ( bytesRead > (ssize_t)bufferSize ) {
     stats.nbOversizedPackets++;
     skip++;
+    if ( replay_.pacing == ReplayConfig::Pacing::TIMESTAMPS ) {
+      // The skipped packet has a line in the sidecar too
+      double time;
+      readTimestamp( time );
+    }
     LOG(ERROR)  
-      << "#" << nbReads() << ": ERROR: Read returned " << bytesRead << " > buffer size " << bufferSize
-      << ". Skipping packet #" << skip << ".";
+      << "#" << nbReads() << ": ERROR: Packet does not fit into the buffer of " << bufferSize
+      << " bytes or it is misaligned. Skipped packet #" << skip << ", " << stats.nbSkippedBytes << " bytes skipped in total.";
     if (skip >= 100) {
       throw std::runtime_error("FATAL: Read is still returning large packets.");
     }
-    bytesRead = read_dma_packet_from_file(inputFile, *buffer, bufferSize, nbReads() );
+    bytesRead = read_dma_packet_from_file(inputFile, *buffer, bufferSize, nbReads(), stats.nbSkippedBytes );
   }
 
+  nbPacketsInPass_++;
   return bytesRead;
 }
 
 
+void FileDmaInputFilter::rewindInput()
+{
+  // Without a single packet the file would be read again forever
+  if ( nbPacketsInPass_ == 0 ) {
+    throw std::runtime_error( "No complete packet that fits into the buffer in the input file " + fileName_ );
+  }
+  nbPacketsInPass_ = 0;
+  fseek( inputFile, 0, SEEK_SET );
+
+  if ( replay_.pacing == ReplayConfig::Pacing::TIMESTAMPS ) {
+    // The sidecar is replayed again together with the file
+    double time;
+    if ( readTimestamp( time ) ) {
+      warnTimestampCount( "more" );
+    }
+    rewind( timestampFile_ );
+    nbTimestampsInPass_ = 0;
+  }
+}
+
+
+bool FileDmaInputFilter::readTimestamp(double& time)
+{
+  if ( fscanf( timestampFile_, "%lf", &time ) != 1 ) {
+    return false;
+  }
+  nbTimestampsInPass_++;
+  return true;
+}
+
+
+void FileDmaInputFilter::warnTimestampCount(const char *comparison)
+{
+  if ( !timestampCountWarned_ ) {
+    timestampCountWarned_ = true;
+    LOG(WARNING) << "The replay timestamp file " << replay_.timestampFile << " has " << comparison
+                 << " lines than the input file has packets, the replay is not paced as recorded";
+  }
+}
+
+
+double FileDmaInputFilter::packetTime(const char *packet, size_t size)
+{
+  if ( replay_.pacing == ReplayConfig::Pacing::ORBIT ) {
+    // Orbit counter in the trailer at the end of the packet
+    uint64_t orbit;
+    memcpy( &orbit, packet + size - constants::orbit_trailer_size + 3*sizeof(uint64_t), sizeof(orbit) );
+    return orbit / constants::orbit_frequency;
+  }
+
+  double time;
+  if ( !readTimestamp( time ) ) {
+    if ( nbTimestampsInPass_ == 0 ) {
+      throw std::runtime_error( "No timestamps in the replay timestamp file: " + replay_.timestampFile );
+    }
+    // Out of timestamps before the end of the file, the rest of the pass is not paced
+    warnTimestampCount( "fewer" );
+    time = lastTimestamp_;
+  }
+  lastTimestamp_ = time;
+  return time;
+}
+
+
+void FileDmaInputFilter::waitUntil(int64_t targetNs)
+{
+  int64_t spinNs = replay_.spinSeconds * 1e9;
+
+  while ( !control().shutdown.load(std::memory_order_acquire) ) {
+    int64_t now = monotonic_ns();
+    int64_t remaining = targetNs - now;
+    if ( remaining <= 0 ) {
+      return;
+    }
+    if ( remaining <= spinNs ) {
+      // Busy-poll the rest, a sleep would wake up too late
+      continue;
+    }
+
+    int64_t until = now + std::min( remaining - spinNs, max_sleep_ns );
+    struct timespec ts;
+    ts.tv_sec = until / 1000000000;
+    ts.tv_nsec = until % 1000000000;
+    clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+  }
+}
+
+
+void FileDmaInputFilter::pace(double sourceTime)
+{
+  double gap = sourceTime - lastSourceTime_;
+  if ( !paced_ || gap < 0 || gap > max_replay_gap_seconds ) {
+    // Start, the file is read again or the orbit counter restarted
+    if ( paced_ ) {
+      stats.nbRebases++;
+    }
+    paced_ = true;
+    baseSourceTime_ = sourceTime;
+    baseNs_ = monotonic_ns();
+  }
+  lastSourceTime_ = sourceTime;
+
+  int64_t targetNs = baseNs_ + int64_t( (sourceTime - baseSourceTime_) / replay_.speedup * 1e9 );
+  waitUntil( targetNs );
+
+  // Positive if released late
+  double error = (monotonic_ns() - targetNs) * 1e-9;
+  stats.nbPaced++;
+  stats.sumErrorSeconds += std::abs( error );
+  stats.maxErrorSeconds = std::max( stats.maxErrorSeconds, error );
+  if ( error > late_seconds ) {
+    stats.nbLate++;
+  }
+}
+
+
 /**************************************************************************
  * Entry points are here
  * Overriding virtual functions
@@ -114,12 +329,25 @@ inline ssize_t FileDmaInputFilter::readPacket(char **buffer, size_t bufferSize)
 // Print some additional info
 void  FileDmaInputFilter::print(std::ostream& out) const
 {
-  out << ", oversized packets " << stats.nbOversizedPackets;
+  out << ", oversized packets " << stats.nbOversizedPackets
+      << ", skipped bytes " << stats.nbSkippedBytes;
+
+  if ( stats.nbPaced ) {
+    out << ", pacing error avg " << stats.sumErrorSeconds / stats.nbPaced * 1e6
+        << " us max " << stats.maxErrorSeconds * 1e6 << " us"
+        << ", late " << stats.nbLate
+        << ", rebases " << stats.nbRebases;
+  }
 }
 
 ssize_t FileDmaInputFilter::readInput(char **buffer, size_t bufferSize)
 {
-  return readPacket( buffer, bufferSize );
+  ssize_t bytesRead = readPacket( buffer, bufferSize );
+
+  if ( replay_.pacing != ReplayConfig::Pacing::NONE ) {
+    pace( packetTime(*buffer, bytesRead) );
+  }
+  return bytesRead;
 }
 
 
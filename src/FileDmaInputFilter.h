@@ -8,10 +8,23 @@
 
 #include "InputFilter.h"
 
+// Pacing of the replay, by default packets are read as fast as possible
+struct ReplayConfig {
+  enum class Pacing { NONE, ORBIT, TIMESTAMPS };
+  Pacing pacing = Pacing::NONE;
+  // Sidecar with the time of each packet in seconds, one per line (Pacing::TIMESTAMPS)
+  std::string timestampFile;
+  // Replay this many times faster than recorded
+  double speedup = 1;
+  // Busy-poll this long before the release time, sleep before that
+  double spinSeconds = 50e-6;
+};
+
 class FileDmaInputFilter: public InputFilter {
 public:
   //FileDmaInputFilter( const std::string&, size_t, size_t);
-  FileDmaInputFilter( const std::string& fileName, size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control );
+  FileDmaInputFilter( const std::string& fileName, size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control,
+                      const ReplayConfig& replay = ReplayConfig() );
   virtual ~FileDmaInputFilter();
 
 protected:
@@ -21,11 +34,49 @@ protected:
 private:
   ssize_t readPacket(char **buffer, size_t bufferSize);
 
+  // Read the file again from the start, throws if the last pass did not find any packet
+  void rewindInput();
+
+  // Time of the packet in seconds as recorded, from its orbit number or from the sidecar
+  double packetTime(const char *packet, size_t size);
+
+  // Next line of the sidecar, one per packet including the skipped ones. Returns false at its end.
+  bool readTimestamp(double& time);
+  void warnTimestampCount(const char *comparison);
+
+  // Wait until the packet is due
+  void pace(double sourceTime);
+
+  // Sleep or spin until the monotonic time in ns, returns early on shutdown
+  void waitUntil(int64_t targetNs);
+
 private:
   FILE* inputFile;
+  std::string fileName_;
+  // Packets read since the file was (re)started
+  uint64_t nbPacketsInPass_;
+
+  ReplayConfig replay_;
+  FILE* timestampFile_;
+  // Sidecar lines read since the file was (re)started
+  uint64_t nbTimestampsInPass_;
+  double lastTimestamp_;
+  bool timestampCountWarned_;
+
+  // Source time and monotonic time of the first paced packet, they are rebased when the source time goes back
+  bool paced_;
+  double baseSourceTime_;
+  int64_t baseNs_;
+  double lastSourceTime_;
 
   struct Statistics {
     uint64_t nbOversizedPackets = 0;
+    uint64_t nbSkippedBytes = 0;
+    uint64_t nbPaced = 0;
+    uint64_t nbLate = 0;
+    uint64_t nbRebases = 0;
+    double sumErrorSeconds = 0;
+    double maxErrorSeconds = 0;
   } stats;  
 };
 
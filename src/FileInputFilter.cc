@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "tbb/scalable_allocator.h"
+
+#include "FileInputFilter.h"
+#include "format.h"
+#include "log.h"
+#include "trailer.h"
+
+// O_DIRECT needs buffers and sizes aligned to the logical block size of the device
+static constexpr size_t chunk_alignment = 4096;
+
+// Bytes of a trailer that can be left at the end of a chunk when searching at 32-bit words
+static constexpr size_t trailer_carry = constants::orbit_trailer_size - sizeof(uint32_t);
+
+
+FileInputFilter::FileInputFilter( const std::string& fileName, size_t nbChunks, size_t blocksPerChunk,
+                                  size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control ) :
+  InputFilter( packetBufferSize, nbPacketBuffers, control ),
+  fd_(-1),
+  direct_(false),
+  stopping_(false),
+  chunk_(NULL),
+  pos_(0),
+  eof_(false)
+{
+  if (fileName == "-") {
+    fd_ = STDIN_FILENO;
+  } else {
+    struct stat sb;
+    if (stat( fileName.c_str(), &sb ) == 0 && S_ISREG(sb.st_mode)) {
+      // Bypass the page cache, a dump is read only once
+      fd_ = open( fileName.c_str(), O_RDONLY | O_DIRECT );
+      direct_ = (fd_ >= 0);
+    }
+    if (fd_ < 0) {
+      fd_ = open( fileName.c_str(), O_RDONLY );
+    }
+    if (fd_ < 0) {
+      throw std::system_error(errno, std::system_category(), "Cannot open input file: " + fileName);
+    }
+    if (!direct_) {
+      posix_fadvise( fd_, 0, 0, POSIX_FADV_SEQUENTIAL );
+    }
+  }
+
+  nbChunks_ = nbChunks < 2 ? 2 : nbChunks;
+  chunkSize_ = (blocksPerChunk * sizeof(block1) + chunk_alignment - 1) / chunk_alignment * chunk_alignment;
+  chunkSize_ = chunkSize_ ? chunkSize_ : chunk_alignment;
+
+  chunks_.reset( new Chunk[nbChunks_]() );
+  for (size_t i = 0; i < nbChunks_; i++) {
+    chunks_[i].data = (char *) scalable_aligned_malloc( chunkSize_, chunk_alignment );
+    if (!chunks_[i].data) {
+      throw std::bad_alloc();
+    }
+    freeChunks_.push( &chunks_[i] );
+  }
+
+  reader_ = std::thread( &FileInputFilter::readAhead, this );
+
+  LOG(TRACE) << "Created raw file input filter, " << nbChunks_ << " chunks of " << chunkSize_ << " bytes"
+             << (direct_ ? ", O_DIRECT" : "");
+}
+
+FileInputFilter::~FileInputFilter() {
+  // Wake up the reader if it waits for a free chunk
+  stopping_ = true;
+  freeChunks_.push( NULL );
+  reader_.join();
+
+  for (size_t i = 0; i < nbChunks_; i++) {
+    scalable_aligned_free( chunks_[i].data );
+  }
+
+  if (fd_ != STDIN_FILENO) {
+    close( fd_ );
+  }
+  LOG(TRACE) << "Destroyed raw file input filter";
+}
+
+
+ssize_t FileInputFilter::readChunk( char *data )
+{
+  while (!stopping_) {
+    // A FIFO may not have data for a long time, do not block the shutdown
+    if (!direct_) {
+      struct pollfd pfd = { fd_, POLLIN, 0 };
+      int ret = poll( &pfd, 1, 100 );
+      if (ret == 0 || (ret < 0 && errno == EINTR)) {
+        continue;
+      }
+    }
+
+    ssize_t n = read( fd_, data, chunkSize_ );
+    if (n < 0 && errno == EINVAL && direct_) {
+      // The file system does not support O_DIRECT with this alignment
+      LOG(WARNING) << "O_DIRECT read failed, reading through the page cache";
+      fcntl( fd_, F_SETFL, fcntl( fd_, F_GETFL ) & ~O_DIRECT );
+      direct_ = false;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return n;
+  }
+  return 0;
+}
+
+void FileInputFilter::readAhead()
+{
+  while (true) {
+    Chunk *chunk;
+    freeChunks_.pop( chunk );
+    if (!chunk || stopping_) {
+      break;
+    }
+
+    chunk->size = readChunk( chunk->data );
+    chunk->error = errno;
+    fullChunks_.push( chunk );
+
+    // Nothing more to read after the end or an error
+    if (chunk->size <= 0) {
+      break;
+    }
+  }
+}
+
+
+bool FileInputFilter::nextChunk()
+{
+  if (eof_) {
+    return false;
+  }
+
+  // Return the scanned chunk to the reader
+  if (chunk_) {
+    freeChunks_.push( chunk_ );
+    chunk_ = NULL;
+  }
+
+  tbb::tick_count t0 = tbb::tick_count::now();
+  Chunk *chunk;
+  fullChunks_.pop( chunk );
+  stats.waitSeconds += (tbb::tick_count::now() - t0).seconds();
+
+  if (chunk->size < 0) {
+    throw std::system_error(chunk->error, std::system_category(), "#" + std::to_string(nbReads()) + ": Input read failed");
+  }
+  if (chunk->size == 0) {
+    freeChunks_.push( chunk );
+    eof_ = true;
+    return false;
+  }
+
+  stats.nbChunks++;
+  chunk_ = chunk;
+  pos_ = 0;
+  return true;
+}
+
+
+/*
+ * Skip the input up to and including the next trailer, which is searched at any 32-bit word
+ * so the scanning is aligned again after corrupted data. Returns false at the end of the input.
+ */
+bool FileInputFilter::skipToTrailer()
+{
+  // End of the previous chunk and the start of the current one, a trailer can span both
+  char edge[2*trailer_carry];
+  size_t carry = 0;
+
+  while ((chunk_ && pos_ < (size_t)chunk_->size) || nextChunk()) {
+    const char *p = chunk_->data + pos_;
+    const char *end = chunk_->data + chunk_->size;
+
+    if (carry) {
+      size_t n = std::min( trailer_carry, (size_t)(end - p) );
+      memcpy( edge + carry, p, n );
+      const char *found = trailer::find( edge, edge + carry + n );
+      if (found != edge + carry + n) {
+        size_t after = found - edge + constants::orbit_trailer_size - carry;
+        stats.nbSkippedBytes += after;
+        pos_ += after;
+        return true;
+      }
+    }
+
+    const char *found = trailer::find( p, end );
+    if (found != end) {
+      stats.nbSkippedBytes += found + constants::orbit_trailer_size - p;
+      pos_ = found + constants::orbit_trailer_size - chunk_->data;
+      return true;
+    }
+
+    carry = std::min( trailer_carry, (size_t)(end - p) );
+    memcpy( edge, end - carry, carry );
+    stats.nbSkippedBytes += end - p;
+    pos_ = chunk_->size;
+  }
+  return false;
+}
+
+
+/*
+ * Copy the next packet into buffer. The data are scanned in 32 byte words,
+ * a packet ends with a word starting with the orbit trailer.
+ */
+ssize_t FileInputFilter::readPacket( char *buffer, size_t bufferSize )
+{
+  // Length of the packet so far, it keeps counting when the packet does not fit into the buffer
+  size_t len = 0;
+
+  while (true) {
+    if ((!chunk_ || pos_ == (size_t)chunk_->size) && !nextChunk()) {
+      if (len) {
+        stats.nbTruncatedBytes += len;
+        LOG(WARNING) << "#" << nbReads() << ": Input ends inside a packet, " << len << " bytes dropped";
+      }
+      return 0;
+    }
+
+    const char *p = chunk_->data + pos_;
+    size_t avail = chunk_->size - pos_;
+    size_t partial = len % 32;
+    size_t take;
+    bool found = false;
+
+    if (partial) {
+      // Complete the word split by the chunk boundary
+      take = std::min( 32 - partial, avail );
+      memcpy( word_ + partial, p, take );
+      found = (partial + take == 32) && trailer::is_trailer( word_ );
+    } else {
+      size_t nbWords = avail / 32;
+      take = avail;
+      for (size_t i = 0; i < nbWords; i++) {
+        if (trailer::is_trailer( p + 32*i )) {
+          take = 32*(i + 1);
+          found = true;
+          break;
+        }
+      }
+      if (!found && avail % 32) {
+        memcpy( word_, p + nbWords*32, avail % 32 );
+      }
+    }
+
+    if (len + take <= bufferSize) {
+      memcpy( buffer + len, p, take );
+    }
+    len += take;
+    pos_ += take;
+
+    if (len > bufferSize) {
+      // Too big or the trailer is not 32 byte aligned, skip up to the next trailer at any 32-bit word
+      stats.nbOversizedPackets++;
+      stats.nbSkippedBytes += len;
+      LOG(ERROR) << "#" << nbReads() << ": Packet does not fit into the buffer of " << bufferSize << " bytes or it is misaligned. Skipping.";
+      len = 0;
+      if (!found && !skipToTrailer()) {
+        return 0;
+      }
+      continue;
+    }
+    if (found) {
+      return len;
+    }
+  }
+}
+
+
+/**************************************************************************
+ * Entry points are here
+ * Overriding virtual functions
+ */
+
+// Print some additional info
+void FileInputFilter::print(std::ostream& out) const
+{
+  out << ", oversized packets " << stats.nbOversizedPackets
+      << ", skipped bytes " << stats.nbSkippedBytes
+      << ", chunks " << stats.nbChunks
+      << ", waited for input " << stats.waitSeconds << " sec";
+}
+
+ssize_t FileInputFilter::readInput(char **buffer, size_t bufferSize)
+{
+  return readPacket( *buffer, bufferSize );
+}
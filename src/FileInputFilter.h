@@ -0,0 +1,88 @@
+#ifndef FILE_INPUT_FILTER_H
+#define FILE_INPUT_FILTER_H
+
+/*
+ * Raw stream reader: replays a dump of DMA data from a file, a FIFO or stdin ("-").
+ *
+ * A reader thread reads ahead into nbChunks chunks of blocksPerChunk x sizeof(block1)
+ * bytes (rounded to 4 KiB), using O_DIRECT for regular files when the file system
+ * supports it. Packets are found by scanning for the orbit trailer, also across the
+ * chunk boundaries, so the input does not need to be aligned to the chunks. After
+ * a packet without a trailer within the buffer size, the input is resynchronized on
+ * the next trailer at any 32-bit word.
+ * The input ends at the end of the file.
+ */
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "tbb/concurrent_queue.h"
+#include "tbb/pipeline.h"
+#include "tbb/tick_count.h"
+
+#include "InputFilter.h"
+
+class FileInputFilter: public InputFilter {
+public:
+  FileInputFilter( const std::string& fileName, size_t nbChunks, size_t blocksPerChunk,
+                   size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control );
+  virtual ~FileInputFilter();
+
+protected:
+  ssize_t readInput(char **buffer, size_t bufferSize); // Override
+  void print(std::ostream& out) const;  // Override
+
+private:
+  struct Chunk {
+    char *data;
+    ssize_t size;   // Bytes read, 0 at the end of the input, -1 on error
+    int error;
+  };
+
+  // Read chunks in the reader thread
+  void readAhead();
+  ssize_t readChunk( char *data );
+
+  // Get the next chunk from the reader thread, returns false at the end of the input
+  bool nextChunk();
+
+  // Resynchronize after a packet without a trailer within the buffer size
+  bool skipToTrailer();
+
+  ssize_t readPacket( char *buffer, size_t bufferSize );
+
+private:
+  int fd_;
+  // Used by the reader thread only, after the constructor
+  bool direct_;
+  size_t nbChunks_;
+  size_t chunkSize_;
+
+  std::unique_ptr<Chunk[]> chunks_;
+  tbb::concurrent_bounded_queue<Chunk*> freeChunks_;
+  tbb::concurrent_bounded_queue<Chunk*> fullChunks_;
+  std::atomic<bool> stopping_;
+  std::thread reader_;
+
+  // Chunk being scanned and the position in it
+  Chunk *chunk_;
+  size_t pos_;
+  bool eof_;
+
+  // Word split by a chunk boundary
+  char word_[32];
+
+  struct Statistics {
+    uint64_t nbChunks = 0;
+    uint64_t nbOversizedPackets = 0;
+    uint64_t nbSkippedBytes = 0;
+    uint64_t nbTruncatedBytes = 0;
+    double waitSeconds = 0;
+  } stats;
+};
+
+typedef std::shared_ptr<FileInputFilter> FileInputFilterPtr;
+
+#endif // FILE_INPUT_FILTER_H
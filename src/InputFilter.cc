@@ -10,16 +10,25 @@
 InputFilter::InputFilter(size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control) : 
     filter(serial_in_order),
     control_(control),
-    nextSlice_(Slice::preAllocate( packetBufferSize, nbPacketBuffers )),
+    nextSlice_(NULL),
     nbReads_(0),
     nbBytesRead_(0),
     previousNbBytesRead_(0),
-    previousStartTime_( tbb::tick_count::now() )
+    previousStartTime_( tbb::tick_count::now() ),
+    packetBufferSize_(packetBufferSize),
+    nbPacketBuffers_(nbPacketBuffers),
+    nbSpillSlices_(0)
 { 
     minBytesRead_ = SSIZE_MAX;
     maxBytesRead_ = 0;
     previousNbReads_ = 0;
 
+    // Touching all slices takes a while with a large pool
+    tbb::tick_count t0 = tbb::tick_count::now();
+    nextSlice_ = Slice::preAllocate( packetBufferSize, nbPacketBuffers );
+    LOG(INFO) << "Startup: allocated " << nbPacketBuffers << " slices of " << packetBufferSize << " bytes in "
+              << (tbb::tick_count::now() - t0).seconds() << " sec";
+
     LOG(TRACE) << "Configuration translated into:";
     LOG(TRACE) << "  MAX_BYTES_PER_INPUT_SLICE: " << packetBufferSize;
     LOG(TRACE) << "  TOTAL_SLICES: " << nbPacketBuffers;
@@ -58,10 +67,17 @@ void InputFilter::printStats(std::ostream& out, ssize_t lastBytesRead)
     std::ios state(nullptr);
 	  state.copyfmt(out);
 
+    if (!sourceName_.empty()) {
+      out << '[' << sourceName_ << "] ";
+    }
     out 
       << "#" << nbReads_ << ": Reading " << std::fixed << std::setprecision(1) << bwd << " MB/sec, " 
       << nbReadsDiff << " packet(s) min/avg/max " << minBytesRead_ <<  '/' << avgBytesRead << '/' << maxBytesRead_
-      << " last " << lastBytesRead;
+      << " last " << lastBytesRead
+      << ", blocked " << std::setprecision(3) << overloadStats_.blockedSeconds << " sec"
+      << ", dropped " << overloadStats_.nbDroppedPackets << " packet(s)/" << overloadStats_.nbDroppedOrbits << " orbit(s)/"
+      << overloadStats_.nbDroppedBytes << " bytes"
+      << ", spilled " << overloadStats_.nbSpilledSlices << " (" << nbSpillSlices_ << " in the pool)";
       
 	  // Restore formatting
 	  out.copyfmt(state);
@@ -76,53 +92,21 @@ void InputFilter::printStats(std::ostream& out, ssize_t lastBytesRead)
 
 
 /*
- * This function is a HACK. It should not be here!
- * It should be a part of processor. Puting it here
- * is a quick and dirty solution for debugging.
- * TODO: Fixme!
+ * Count orbits in a packet, each orbit is terminated by a 32 byte trailer starting with 0xdeadbeefdeadbeef
  */
-void dumpPacketTrailer(char *buffer, size_t size, std::ostream& out)
+static uint64_t countOrbitTrailers(const char *buffer, size_t size)
 {
-  // If a packet doesn't have a proper trailer, we cannot check
-  if (size < 32) {
-    return;
-  }
-
-  // Get to the trailer
-  buffer += size - 32;
-
-  // Save formatting
-  std::ios state(nullptr);
-  state.copyfmt(out);
-
-  uint64_t deadbeef = *reinterpret_cast<uint64_t *>( buffer ); 
-  uint64_t autorealignCounter = *reinterpret_cast<uint64_t *>( buffer + 8 );
-  uint64_t droppedOrbitCounter = *reinterpret_cast<uint64_t *>( buffer + 2*8 );
-  uint64_t orbitCounter = *reinterpret_cast<uint64_t *>( buffer + 3*8 );
-
-  if (deadbeef == 0xdeadbeefdeadbeef) {
-    out 
-      << ", HW: autorealign " << autorealignCounter
-      << " orbits " << orbitCounter
-      << " dropped " <<  droppedOrbitCounter;
-
-  } else {
-    out << ", HW trailer: " << std::hex;
-    for (int i = 0; i < 32; i++) {
-      unsigned int val = (uint8_t)(buffer[i]);
-      out << std::setw(2) << std::setfill('0') << val;
-      i++;
-      val = (uint8_t)(buffer[i]);
-      out << std::setw(2) << std::setfill('0') << val << ' ';
+  uint64_t nbOrbits = 0;
+  for (size_t offset = 0; offset + 32 <= size; offset += 32) {
+    if (*reinterpret_cast<const uint64_t *>( buffer + offset ) == 0xdeadbeefdeadbeef) {
+      nbOrbits++;
     }
   }
-
-  // Restore formatting
-  out.copyfmt(state);
+  return nbOrbits;
 }
 
 
-void* InputFilter::operator()(void*) {
+ssize_t InputFilter::readSlice() {
   // Prepare destination buffer
   char *buffer = nextSlice_->begin();
   // Available buffer size
@@ -134,8 +118,16 @@ void* InputFilter::operator()(void*) {
   // It is optional to use the provided buffer
   bytesRead = readInput( &buffer, bufferSize );
 
-  // This should really not happen
-  assert( bytesRead != 0);
+  // Zero means the end of the input, there is nothing to complete
+  if (bytesRead == 0) {
+    return 0;
+  }
+
+  // Nothing was read, it does not count as a read
+  if (bytesRead == IDLE) {
+    nbReads_--;
+    return IDLE;
+  }
 
   if (buffer != nextSlice_->begin()) {
     // If read returned a different buffer, then it didn't use our buffer and we have to copy data
@@ -146,6 +138,10 @@ void* InputFilter::operator()(void*) {
   // Notify that we processed the given buffer
   readComplete(buffer);
 
+  if (nbBytesRead_ == 0) {
+    LOG(INFO) << "Startup: first packet received " << (tbb::tick_count::now() - control_.start_time).seconds() << " sec after start";
+  }
+
   // Update some stats
   nbBytesRead_ += bytesRead;
 
@@ -157,14 +153,87 @@ void* InputFilter::operator()(void*) {
   if (control_.packets_per_report && (nbReads_ % control_.packets_per_report == 0)) {
     std::ostringstream log;
     printStats( log, bytesRead );
-    // HACK: This function is not supposed to be called from here
-    dumpPacketTrailer( nextSlice_->begin(), bytesRead, log );
     LOG(INFO) << log.str();
   }
 
+  return bytesRead;
+}
+
+
+Slice* InputFilter::getFreeSlice(ssize_t lastBytesRead) {
+  Slice *slice = Slice::tryGetAllocated();
+  if (slice) {
+    // The overload is over when half of the pool is free again, the spill slices are not needed any more
+    while (nbSpillSlices_ > 0 && Slice::nbAvailable() > nbPacketBuffers_ / 2) {
+      Slice *spill = Slice::tryGetAllocated();
+      if (!spill) {
+        break;
+      }
+      spill->free();
+      nbSpillSlices_--;
+    }
+    return slice;
+  }
+
+  switch (control_.overload_policy) {
+    case OverloadPolicy::DROP_NEWEST:
+      // Discard the packet we have just read, nextSlice_ is reused for the next read.
+      // An empty read has nothing to discard.
+      if (lastBytesRead > 0) {
+        overloadStats_.nbDroppedPackets++;
+        overloadStats_.nbDroppedBytes += lastBytesRead;
+        overloadStats_.nbDroppedOrbits += countOrbitTrailers( nextSlice_->begin(), lastBytesRead );
+      }
+      return NULL;
+
+    case OverloadPolicy::SPILL:
+      if (nbSpillSlices_ < control_.overload_spill_buffers) {
+        // The extra slice joins the pool when it is given back
+        overloadStats_.nbSpilledSlices++;
+        nbSpillSlices_++;
+        LOG(WARNING) << "#" << nbReads_ << ": Slice pool exhausted, allocating spill slice #" << nbSpillSlices_;
+        return Slice::allocate( packetBufferSize_ );
+      }
+      // Spill buffers are exhausted, we have to block
+      break;
+
+    case OverloadPolicy::BLOCK:
+      break;
+  }
+
+  tbb::tick_count t0 = tbb::tick_count::now();
+  slice = Slice::getAllocated();
+  overloadStats_.blockedSeconds += (tbb::tick_count::now() - t0).seconds();
+  return slice;
+}
+
+
+void* InputFilter::operator()(void*) {
+  ssize_t bytesRead;
+  Slice *freeSlice;
+
+  // Returning NULL stops the pipeline
+  if (control_.shutdown.load(std::memory_order_acquire)) {
+    LOG(DEBUG) << "#" << nbReads_ << ": Shutdown requested, stopping the input";
+    return NULL;
+  }
+
+  // Packets may be dropped here if we are running out of free slices
+  do {
+    bytesRead = readSlice();
+    if (bytesRead == 0) {
+      LOG(DEBUG) << "#" << nbReads_ << ": End of the input";
+      return NULL;
+    }
+    if (bytesRead == IDLE) {
+      bytesRead = 0;
+    }
+    freeSlice = getFreeSlice( bytesRead );
+  } while (!freeSlice);
+
   // Have more data to process.
   Slice* thisSlice = nextSlice_;
-  nextSlice_ = Slice::getAllocated();
+  nextSlice_ = freeSlice;
   
   // Adjust the end of this buffer
   thisSlice->set_end( thisSlice->end() + bytesRead );
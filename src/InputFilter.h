@@ -3,6 +3,7 @@
 
 #include <cstddef>
 #include <iostream>
+#include <string>
 
 #include "tbb/pipeline.h"
 #include "tbb/tick_count.h"
@@ -23,8 +24,20 @@ public:
   // Return the number of read calls
   uint64_t nbReads() { return nbReads_; }
 
+  // Return the number of bytes read
+  uint64_t nbBytesRead() { return nbBytesRead_; }
+
+  // Name of the data source shown in the statistics, when several sources are read
+  void setSourceName(const std::string& name) { sourceName_ = name; }
+
 protected:
-  // Read input to a provided buffer or return a different buffer
+  // Run control shared with the other stages
+  ctrl& control() const { return control_; }
+
+  // Returned by readInput when no data was read, an empty packet is passed on so the other stages see the run state
+  static constexpr ssize_t IDLE = -2;
+
+  // Read input to a provided buffer or return a different buffer, returning 0 ends the pipeline
   virtual ssize_t readInput(char **buffer, size_t bufferSize) = 0;
 
   // Notify the read that the buffer returned by readInput is processed (can be freed or reused)
@@ -37,6 +50,13 @@ protected:
 private:
   void* operator()(void* item); 
 
+  // Read one packet into nextSlice_ and return its size
+  ssize_t readSlice();
+
+  // Get a slice for the next read, applying the overload policy if the pool is exhausted.
+  // Returns NULL if the packet in nextSlice_ was dropped.
+  Slice* getFreeSlice(ssize_t lastBytesRead);
+
   // NOTE: This can be moved out of this class into a separate one
   //       and run in a single thread in order to do reporting...
   void printStats(std::ostream& out, ssize_t lastBytesRead);
@@ -65,6 +85,23 @@ private:
 
   // Remember timestamp for performance monitoring 
   tbb::tick_count previousStartTime_;
+
+  std::string sourceName_;
+
+  // Size of slices allocated by the SPILL policy
+  size_t packetBufferSize_;
+  size_t nbPacketBuffers_;
+  // Spill slices in the pool, they are freed when the pool has recovered
+  uint64_t nbSpillSlices_;
+
+  // Software dead time caused by the exhausted slice pool
+  struct OverloadStatistics {
+    uint64_t nbDroppedPackets = 0;
+    uint64_t nbDroppedOrbits = 0;
+    uint64_t nbDroppedBytes = 0;
+    uint64_t nbSpilledSlices = 0;
+    double blockedSeconds = 0;
+  } overloadStats_;
 };
 
 #endif // INPUT_FILTER_H 
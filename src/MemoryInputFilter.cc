@@ -0,0 +1,93 @@
+#include <cerrno>
+#include <system_error>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "MemoryInputFilter.h"
+#include "log.h"
+
+
+MemoryInputFilter::MemoryInputFilter( const std::string& fileName, size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control ) : 
+  InputFilter( packetBufferSize, nbPacketBuffers, control ),
+  data_(NULL),
+  size_(0),
+  nextPacket_(0)
+{ 
+  int fd = open( fileName.c_str(), O_RDONLY );
+  if ( fd < 0 ) {
+    throw std::system_error(errno, std::system_category(), "Cannot open input file: " + fileName);
+  }
+
+  struct stat sb;
+  if ( fstat(fd, &sb) < 0 ) {
+    close( fd );
+    throw std::system_error(errno, std::system_category(), "Cannot stat input file: " + fileName);
+  }
+  size_ = sb.st_size;
+
+  // Populate the mapping now, we don't want to measure page faults
+  data_ = (char *) mmap( NULL, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0 );
+  close( fd );
+  if ( data_ == MAP_FAILED ) {
+    throw std::system_error(errno, std::system_category(), "Cannot mmap input file: " + fileName);
+  }
+
+  // Index packets, each packet ends with a 32 byte trailer starting with 0xdeadbeefdeadbeef
+  size_t packetStart = 0;
+  for (size_t offset = 0; offset + 32 <= size_; offset += 32) {
+    if ( *reinterpret_cast<uint64_t *>( data_ + offset ) == 0xdeadbeefdeadbeef ) {
+      size_t packetSize = offset + 32 - packetStart;
+      if (packetSize <= packetBufferSize) {
+        packets_.push_back( std::make_pair(packetStart, packetSize) );
+      } else {
+        LOG(WARNING) << "Packet at offset " << packetStart << " is too big and will not be replayed";
+      }
+      packetStart = offset + 32;
+    }
+  }
+
+  if ( packets_.empty() ) {
+    munmap( data_, size_ );
+    throw std::runtime_error( "No complete packet found in input file: " + fileName );
+  }
+
+  LOG(TRACE) << "Created memory input filter with " << packets_.size() << " packets"; 
+}
+
+MemoryInputFilter::~MemoryInputFilter() {
+  munmap( data_, size_ );
+  LOG(TRACE) << "Destroyed memory input filter";
+}
+
+
+/**************************************************************************
+ * Entry points are here
+ * Overriding virtual functions
+ */
+
+// Print some additional info
+void MemoryInputFilter::print(std::ostream& out) const
+{
+  out << ", replays " << stats.nbReplays;
+}
+
+ssize_t MemoryInputFilter::readInput(char **buffer, size_t bufferSize)
+{
+  (void)(bufferSize);
+
+  // Return our buffer, it will be copied into the slice
+  const std::pair<size_t, size_t>& packet = packets_[nextPacket_];
+  *buffer = data_ + packet.first;
+
+  nextPacket_++;
+  if (nextPacket_ == packets_.size()) {
+    nextPacket_ = 0;
+    stats.nbReplays++;
+  }
+
+  return packet.second;
+}
@@ -0,0 +1,43 @@
+#ifndef MEMORY_INPUT_FILTER_H
+#define MEMORY_INPUT_FILTER_H
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tbb/pipeline.h"
+#include "tbb/tick_count.h"
+
+#include "InputFilter.h"
+
+/*
+ * Replays packets from a memory mapped file in the FileDmaInputFilter format.
+ * Packet boundaries are indexed once when the file is mapped, so reading
+ * costs only a copy into the slice. Used for throughput benchmarks.
+ */
+class MemoryInputFilter: public InputFilter {
+public:
+  MemoryInputFilter( const std::string& fileName, size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control );
+  virtual ~MemoryInputFilter();
+
+protected:
+  ssize_t readInput(char **buffer, size_t bufferSize); // Override
+  void print(std::ostream& out) const;  // Override
+
+private:
+  char *data_;
+  size_t size_;
+
+  // Offset and size of each packet
+  std::vector< std::pair<size_t, size_t> > packets_;
+  size_t nextPacket_;
+
+  struct Statistics {
+    uint64_t nbReplays = 0;
+  } stats;
+};
+
+typedef std::shared_ptr<MemoryInputFilter> MemoryInputFilterPtr;
+
+#endif // MEMORY_INPUT_FILTER_H
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
+#include "ReprocessInputFilter.h"
+#include "format.h"
+#include "log.h"
+#include "trailer.h"
+
+// Files are indexed in ranges of this size, one range per task
+static constexpr size_t index_range_size = 16*1024*1024;
+
+
+ReprocessInputFilter::ReprocessInputFilter( const std::vector<std::string>& fileNames, size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control ) :
+  InputFilter( packetBufferSize, nbPacketBuffers, control ),
+  fileNames_(fileNames),
+  nextFile_(0),
+  packetBufferSize_(packetBufferSize),
+  data_(NULL),
+  size_(0),
+  nextPacket_(0)
+{
+  // Fail early on a wrong file name, not in the middle of the processing
+  for (const std::string& fileName : fileNames_) {
+    if ( access(fileName.c_str(), R_OK) < 0 ) {
+      throw std::system_error(errno, std::system_category(), "Cannot read input file: " + fileName);
+    }
+  }
+  LOG(TRACE) << "Created reprocessing input filter with " << fileNames_.size() << " files";
+}
+
+ReprocessInputFilter::~ReprocessInputFilter() {
+  closeFile();
+  LOG(TRACE) << "Destroyed reprocessing input filter";
+}
+
+
+bool ReprocessInputFilter::openNextFile()
+{
+  closeFile();
+  if (nextFile_ == fileNames_.size()) {
+    return false;
+  }
+  const std::string& fileName = fileNames_[nextFile_++];
+
+  int fd = open( fileName.c_str(), O_RDONLY );
+  if ( fd < 0 ) {
+    throw std::system_error(errno, std::system_category(), "Cannot open input file: " + fileName);
+  }
+
+  struct stat sb;
+  if ( fstat(fd, &sb) < 0 ) {
+    close( fd );
+    throw std::system_error(errno, std::system_category(), "Cannot stat input file: " + fileName);
+  }
+  size_ = sb.st_size;
+
+  if (size_ > 0) {
+    data_ = (char *) mmap( NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( data_ == MAP_FAILED ) {
+      data_ = NULL;
+      close( fd );
+      throw std::system_error(errno, std::system_category(), "Cannot mmap input file: " + fileName);
+    }
+    madvise( data_, size_, MADV_SEQUENTIAL );
+  }
+  close( fd );
+
+  tbb::tick_count t0 = tbb::tick_count::now();
+  indexPackets();
+  double seconds = (tbb::tick_count::now() - t0).seconds();
+  stats.indexSeconds += seconds;
+  stats.nbFiles++;
+
+  LOG(INFO) << "Reprocessing file " << nextFile_ << '/' << fileNames_.size() << ": " << fileName << ", "
+            << size_ << " bytes, " << packets_.size() << " packets indexed in " << seconds << " sec";
+  return true;
+}
+
+void ReprocessInputFilter::closeFile()
+{
+  if (data_) {
+    munmap( data_, size_ );
+    data_ = NULL;
+  }
+  size_ = 0;
+  packets_.clear();
+  nextPacket_ = 0;
+}
+
+
+void ReprocessInputFilter::indexPackets()
+{
+  // End offsets of the trailers found in each range
+  size_t nbRanges = (size_ + index_range_size - 1) / index_range_size;
+  std::vector< std::vector<size_t> > trailerEnds( nbRanges );
+
+  tbb::parallel_for( tbb::blocked_range<size_t>(0, nbRanges), [this, &trailerEnds]( const tbb::blocked_range<size_t>& r ) {
+    for (size_t i = r.begin(); i != r.end(); i++) {
+      // Trailers starting in this range, the last one may end in the next range
+      const char *begin = data_ + i * index_range_size;
+      const char *end = data_ + std::min( (i + 1) * index_range_size, size_ );
+      const char *scanEnd = std::min( end + constants::orbit_trailer_size - sizeof(uint32_t), (const char *)data_ + size_ );
+
+      for (const char *p = trailer::find( begin, scanEnd ); p < end; p = trailer::find( p, scanEnd )) {
+        p += constants::orbit_trailer_size;
+        trailerEnds[i].push_back( p - data_ );
+      }
+    }
+  });
+
+  size_t packetStart = 0;
+  for (const std::vector<size_t>& ends : trailerEnds) {
+    for (size_t packetEnd : ends) {
+      size_t packetSize = packetEnd - packetStart;
+      if (packetSize <= packetBufferSize_) {
+        packets_.push_back( std::make_pair(packetStart, packetSize) );
+      } else {
+        stats.nbOversizedPackets++;
+        stats.nbSkippedBytes += packetSize;
+        LOG(WARNING) << "Packet at offset " << packetStart << " is too big and will be skipped";
+      }
+      packetStart = packetEnd;
+    }
+  }
+
+  if (packetStart < size_) {
+    stats.nbSkippedBytes += size_ - packetStart;
+    LOG(WARNING) << "No trailer after offset " << packetStart << ", " << size_ - packetStart << " bytes skipped";
+  }
+}
+
+
+/**************************************************************************
+ * Entry points are here
+ * Overriding virtual functions
+ */
+
+// Print some additional info
+void ReprocessInputFilter::print(std::ostream& out) const
+{
+  out << ", file " << nextFile_ << '/' << fileNames_.size()
+      << ", oversized packets " << stats.nbOversizedPackets
+      << ", skipped bytes " << stats.nbSkippedBytes
+      << ", indexing " << stats.indexSeconds << " sec";
+}
+
+ssize_t ReprocessInputFilter::readInput(char **buffer, size_t bufferSize)
+{
+  (void)(bufferSize);
+
+  while (nextPacket_ == packets_.size()) {
+    if (!openNextFile()) {
+      LOG(INFO) << "Reprocessed " << stats.nbFiles << " files, " << stats.nbPackets << " packets, skipped "
+                << stats.nbOversizedPackets << " oversized packets and " << stats.nbSkippedBytes << " bytes";
+      return 0;
+    }
+  }
+
+  // Return our buffer, it will be copied into the slice
+  const std::pair<size_t, size_t>& packet = packets_[nextPacket_++];
+  *buffer = data_ + packet.first;
+  stats.nbPackets++;
+
+  return packet.second;
+}
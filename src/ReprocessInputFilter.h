@@ -0,0 +1,60 @@
+#ifndef REPROCESS_INPUT_FILTER_H
+#define REPROCESS_INPUT_FILTER_H
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tbb/pipeline.h"
+#include "tbb/tick_count.h"
+
+#include "InputFilter.h"
+
+/*
+ * Reads a list of raw dumps in the FileDmaInputFilter format once, for offline reprocessing.
+ * Each file is memory mapped and its packet boundaries are indexed by all threads
+ * before the packets are passed on, the input ends after the last file.
+ * Data without a trailer and packets too big for a slice are skipped.
+ */
+class ReprocessInputFilter: public InputFilter {
+public:
+  ReprocessInputFilter( const std::vector<std::string>& fileNames, size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control );
+  virtual ~ReprocessInputFilter();
+
+protected:
+  ssize_t readInput(char **buffer, size_t bufferSize); // Override
+  void print(std::ostream& out) const;  // Override
+
+private:
+  // Map and index the next file, returns false if there are no more files
+  bool openNextFile();
+  void closeFile();
+
+  // Find the packets of the mapped file in parallel
+  void indexPackets();
+
+private:
+  std::vector<std::string> fileNames_;
+  size_t nextFile_;
+  size_t packetBufferSize_;
+
+  char *data_;
+  size_t size_;
+
+  // Offset and size of each packet of the current file
+  std::vector< std::pair<size_t, size_t> > packets_;
+  size_t nextPacket_;
+
+  struct Statistics {
+    uint64_t nbFiles = 0;
+    uint64_t nbPackets = 0;
+    uint64_t nbOversizedPackets = 0;
+    uint64_t nbSkippedBytes = 0;
+    double indexSeconds = 0;
+  } stats;
+};
+
+typedef std::shared_ptr<ReprocessInputFilter> ReprocessInputFilterPtr;
+
+#endif // REPROCESS_INPUT_FILTER_H
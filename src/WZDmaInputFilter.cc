@@ -12,10 +12,22 @@
 #include "log.h"
 
 
-WZDmaInputFilter::WZDmaInputFilter( size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control ) : 
+WZDmaInputFilter::WZDmaInputFilter( size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control, unsigned board, unsigned prefaultThreads,
+                                    unsigned maxConfirmBatch, const struct wz_emu_config *emulator ) : 
   InputFilter( packetBufferSize, nbPacketBuffers, control )
 { 
+  confirm_.maxSize = maxConfirmBatch > 0 ? maxConfirmBatch : 1;
+
+  if (emulator) {
+    wz_use_emulator( &dma_, emulator );
+    LOG(WARNING) << "Using WZ DMA emulator instead of the board";
+  } else {
+    wz_use_hardware( &dma_, board );
+  }
+  dma_.prefault_threads = prefaultThreads;
+
   // Initialize the DMA subsystem 
+  tbb::tick_count t0 = tbb::tick_count::now();
 	if ( wz_init( &dma_ ) < 0 ) {
     std::string msg = "Cannot initialize WZ DMA device";
     if (errno == ENOENT) {
@@ -24,11 +36,17 @@ WZDmaInputFilter::WZDmaInputFilter( size_t packetBufferSize, size_t nbPacketBuff
     throw std::system_error(errno, std::system_category(), msg);
   }
 
+  tbb::tick_count t1 = tbb::tick_count::now();
+
 	// Start the DMA
 	if ( wz_start_dma( &dma_ ) < 0) {
     throw std::system_error(errno, std::system_category(), "Cannot start WZ DMA");
 	}
 
+  LOG(INFO) << "Startup: DMA initialized in " << (t1 - t0).seconds() << " sec (prefault of the buffer "
+            << dma_.prefault_seconds << " sec using " << prefaultThreads << " thread(s)), started in "
+            << (tbb::tick_count::now() - t1).seconds() << " sec";
+
   LOG(TRACE) << "Created WZ DMA input filter"; 
 }
 
@@ -53,9 +71,13 @@ inline ssize_t WZDmaInputFilter::read_packet_from_dma(char **buffer)
 
       if (errno == EIO) {
         LOG(ERROR) << "#" << nbReads() << ": Trying to restart DMA (attempt #" << tries << "):";
+        tbb::tick_count t0 = tbb::tick_count::now();
         wz_stop_dma( &dma_ );
         wz_close( &dma_ );
 
+        // Closing releases all buffers
+        confirm_.nbPackets = 0;
+
         // Initialize the DMA subsystem 
         if ( wz_init( &dma_ ) < 0 ) {
           throw std::system_error(errno, std::system_category(), "Cannot initialize WZ DMA device");
@@ -65,6 +87,7 @@ inline ssize_t WZDmaInputFilter::read_packet_from_dma(char **buffer)
           throw std::system_error(errno, std::system_category(), "Cannot start WZ DMA device");
         }
 
+        stats.restartSeconds += (tbb::tick_count::now() - t0).seconds();
         LOG(ERROR) << "Success.";
         tries++;
 
@@ -151,7 +174,11 @@ void WZDmaInputFilter::print(std::ostream& out) const
     out 
       << ", DMA errors " << stats.nbDmaErrors
       << ", oversized " << stats.nbDmaOversizedPackets
-      << ", resets " << stats.nbBoardResets;
+      << ", resets " << stats.nbBoardResets
+      << ", restart time " << stats.restartSeconds << " sec"
+      << ", ring free " << stats.ringFree << " (min " << stats.ringFreeMin << ") of " << dma_.ring_len / WZ_DMA_BUFLEN
+      << ", confirm batch " << confirm_.size
+      << ", confirms " << stats.nbConfirms;
 }
 
 
@@ -165,9 +192,52 @@ ssize_t WZDmaInputFilter::readInput(char **buffer, size_t bufferSize)
 // Notify the DMA that packet was processed
 void WZDmaInputFilter::readComplete(char *buffer) {
   (void)(buffer);
+  uint32_t nbBufs = dma_.ring_len / WZ_DMA_BUFLEN;
+
+  // Only a contiguous range of buffers can be confirmed at once
+  if (confirm_.nbPackets > 0 && dma_.bdesc.first_desc != (confirm_.lastDesc + 1) % nbBufs) {
+    confirm_pending();
+  }
+
+  if (confirm_.nbPackets == 0) {
+    confirm_.firstDesc = dma_.bdesc.first_desc;
+  }
+  confirm_.lastDesc = dma_.bdesc.last_desc;
+  confirm_.nbPackets++;
+
+  if (confirm_.nbPackets >= confirm_.size) {
+    confirm_pending();
+  }
+}
+
 
-  // Free the DMA buffer
-  if ( wz_read_complete( &dma_ ) < 0 ) {
+void WZDmaInputFilter::confirm_pending()
+{
+  // Free the DMA buffers
+  if ( wz_confirm( &dma_, confirm_.firstDesc, confirm_.lastDesc ) < 0 ) {
       throw std::system_error(errno, std::system_category(), "Cannot complete WZ DMA read");
 	}  
+  confirm_.nbPackets = 0;
+  stats.nbConfirms++;
+
+  int nbFree = wz_get_free( &dma_ );
+  if (nbFree < 0) {
+    return;
+  }
+  int nbBufs = dma_.ring_len / WZ_DMA_BUFLEN;
+  stats.ringFree = nbFree;
+  stats.ringFreeMin = (stats.ringFreeMin < 0 || nbFree < stats.ringFreeMin) ? nbFree : stats.ringFreeMin;
+
+  // Hold back at most 1/8 of the free buffers, when the ring fills up every packet is confirmed
+  unsigned size = nbFree / 8;
+  confirm_.size = size < 1 ? 1 : (size > confirm_.maxSize ? confirm_.maxSize : size);
+
+  // The firmware drops orbits when the ring is full
+  if (!confirm_.ringLow && nbFree < nbBufs / 10) {
+    confirm_.ringLow = true;
+    LOG(WARNING) << "#" << nbReads() << ": DMA ring almost full, " << nbFree << " of " << nbBufs << " buffers free";
+  } else if (confirm_.ringLow && nbFree > nbBufs / 4) {
+    confirm_.ringLow = false;
+    LOG(WARNING) << "#" << nbReads() << ": DMA ring recovered, " << nbFree << " of " << nbBufs << " buffers free";
+  }
 }
\ No newline at end of file
@@ -13,7 +13,10 @@
 
 class WZDmaInputFilter: public InputFilter {
  public:
-  WZDmaInputFilter( size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control );
+  // Up to maxConfirmBatch processed packets are released to the DMA with one confirm.
+  // If emulator is given, the board is emulated in user space
+  WZDmaInputFilter( size_t packetBufferSize, size_t nbPacketBuffers, ctrl& control, unsigned board = 0, unsigned prefaultThreads = 1,
+                    unsigned maxConfirmBatch = 1, const struct wz_emu_config *emulator = NULL );
   virtual ~WZDmaInputFilter();
 
 protected:
@@ -25,12 +28,29 @@ private:
   ssize_t read_packet_from_dma(char **buffer);
   ssize_t read_packet( char **buffer, size_t bufferSize );
 
+  // Release the pending packets to the DMA and adjust the batch size to the ring headroom
+  void confirm_pending();
+
   struct Statistics {
     uint64_t nbDmaErrors = 0;
     uint64_t nbDmaOversizedPackets = 0;
     uint64_t nbBoardResets = 0;
+    double restartSeconds = 0;
+    uint64_t nbConfirms = 0;
+    int ringFree = -1;
+    int ringFreeMin = -1;
   } stats;
 
+  // Processed packets not yet released to the DMA, they are contiguous in the ring
+  struct ConfirmBatch {
+    uint32_t firstDesc = 0;
+    uint32_t lastDesc = 0;
+    unsigned nbPackets = 0;
+    unsigned size = 1;
+    unsigned maxSize = 1;
+    bool ringLow = false;
+  } confirm_;
+
   struct wz_private dma_;
 };
 
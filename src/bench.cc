@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#include <time.h>
+
+#include "tbb/task_scheduler_init.h"
+#include "tbb/tick_count.h"
+
+#include "bench.h"
+#include "pipeline.h"
+#include "slice.h"
+#include "log.h"
+
+namespace bench {
+
+// CPU time of the calling thread, time spent blocked or sleeping is not counted
+static inline uint64_t thread_cpu_ns()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Wrapper has to run in the same mode as the wrapped stage
+static tbb::filter::mode stage_mode(const tbb::filter& stage)
+{
+  if (!stage.is_serial()) {
+    return tbb::filter::parallel;
+  }
+  return stage.is_ordered() ? tbb::filter::serial_in_order : tbb::filter::serial_out_of_order;
+}
+
+TimedFilter::TimedFilter( const std::string& name, tbb::filter& stage ) :
+  tbb::filter( stage_mode(stage) ),
+  name_(name),
+  stage_(stage),
+  cpuNs_(0),
+  nbItems_(0),
+  nbBytes_(0)
+{
+}
+
+void* TimedFilter::operator()( void* item )
+{
+  // The stage may give the input slice back, so take its size now
+  size_t bytes = item ? static_cast<Slice*>(item)->size() : 0;
+
+  uint64_t t0 = thread_cpu_ns();
+  void *result = stage_(item);
+  cpuNs_ += thread_cpu_ns() - t0;
+
+  // The input stage gets no item, count what it produced
+  if (!item && result) {
+    bytes = static_cast<Slice*>(result)->size();
+  }
+  if (item || result) {
+    nbItems_++;
+    nbBytes_ += bytes;
+  }
+  return result;
+}
+
+
+NullOutputStream::NullOutputStream() :
+  tbb::filter(serial_out_of_order)
+{
+}
+
+void* NullOutputStream::operator()( void* item )
+{
+  Slice& out = *static_cast<Slice*>(item);
+  out.free();
+  return NULL;
+}
+
+
+tbb::filter& Monitor::wrap( const std::string& name, tbb::filter& stage )
+{
+  stages_.push_back( std::unique_ptr<TimedFilter>( new TimedFilter(name, stage) ) );
+  return *stages_.back();
+}
+
+
+int run_bench( ctrl& control, config& conf )
+{
+  double seconds = conf.getBenchSeconds();
+  bool nullOutput = conf.getBenchNullOutput();
+  std::vector<std::string> table;
+  std::vector<std::string> stageNames;
+
+  // The output stage writes only when running
+  control.running = true;
+
+  for (uint32_t nbThreads : conf.getBenchThreads()) {
+    for (uint32_t tokensPerThread : conf.getBenchTokensPerThread()) {
+      size_t nbTokens = nbThreads * tokensPerThread;
+      LOG(INFO) << "Benchmark run: threads " << nbThreads << ", tokens " << nbTokens << ", " << seconds << " seconds";
+
+      Monitor monitor( nullOutput );
+      tbb::task_scheduler_init init( nbThreads );
+
+      // Stop the input after the requested time, the timer ends early when the run stops by itself
+      control.shutdown = false;
+      std::thread timer( [&control, seconds]() {
+        auto end = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                        std::chrono::duration<double>(seconds) );
+        for (auto now = std::chrono::steady_clock::now();
+             now < end && !control.shutdown.load(std::memory_order_acquire);
+             now = std::chrono::steady_clock::now()) {
+          std::this_thread::sleep_for( std::min<std::chrono::steady_clock::duration>( end - now, std::chrono::milliseconds(100) ) );
+        }
+        control.shutdown.store(true, std::memory_order_release);
+        control.notify();
+      });
+      auto stopTimer = [&control, &timer]() {
+        control.shutdown.store(true, std::memory_order_release);
+        timer.join();
+      };
+
+      tbb::tick_count t0 = tbb::tick_count::now();
+      int ok;
+      try {
+        ok = run_pipeline( nbTokens, control, conf, &monitor );
+      } catch (...) {
+        // A joinable thread must not be destroyed
+        stopTimer();
+        throw;
+      }
+      double wall = (tbb::tick_count::now() - t0).seconds();
+      stopTimer();
+
+      if (!ok) {
+        return 0;
+      }
+
+      // Throughput is given by the input stages of all sources, utilization is in percent of one core
+      uint64_t nbBytes = 0;
+      uint64_t nbItems = 0;
+      for (const auto& stage : monitor.stages()) {
+        if (stage->name().compare(0, 5, "input") == 0) {
+          nbBytes += stage->nbBytes();
+          nbItems += stage->nbItems();
+        }
+      }
+      std::ostringstream row;
+      row << std::setw(7) << nbThreads << std::setw(7) << nbTokens << std::fixed
+          << std::setw(9) << std::setprecision(3) << nbBytes / wall / 1e9
+          << std::setw(12) << std::setprecision(0) << nbItems / wall;
+
+      stageNames.clear();
+      for (const auto& stage : monitor.stages()) {
+        stageNames.push_back( stage->name() );
+        row << std::setw(10) << std::setprecision(0) << 100.0 * stage->cpuSeconds() / wall << '%';
+      }
+      table.push_back( row.str() );
+    }
+  }
+
+  control.running = false;
+
+  // Print the scaling table, stages are the same for all runs
+  std::ostringstream header;
+  header << std::setw(7) << "threads" << std::setw(7) << "tokens" << std::setw(9) << "GB/s" << std::setw(12) << "packets/s";
+  for (const std::string& name : stageNames) {
+    header << std::setw(11) << name;
+  }
+
+  LOG(INFO) << "Benchmark results (stage columns are CPU utilization):";
+  LOG(INFO) << header.str();
+  for (const std::string& row : table) {
+    LOG(INFO) << row;
+  }
+
+  return 1;
+}
+
+} // namespace bench
@@ -0,0 +1,70 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * End-to-end throughput benchmark (scdaq --bench).
+ * Runs the full pipeline built from the configuration for a given time
+ * with different numbers of threads and tokens, and prints a scaling table.
+ */
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tbb/pipeline.h"
+
+#include "controls.h"
+#include "config.h"
+
+namespace bench {
+
+//! Filter that wraps a pipeline stage and measures the CPU time spent in it
+class TimedFilter: public tbb::filter {
+public:
+  TimedFilter( const std::string& name, tbb::filter& stage );
+  void* operator()( void* item ) /*override*/;
+
+  const std::string& name() const { return name_; }
+  double cpuSeconds() const { return cpuNs_ * 1e-9; }
+  uint64_t nbItems() const { return nbItems_; }
+  uint64_t nbBytes() const { return nbBytes_; }
+
+private:
+  std::string name_;
+  tbb::filter& stage_;
+
+  std::atomic<uint64_t> cpuNs_;
+  std::atomic<uint64_t> nbItems_;
+  std::atomic<uint64_t> nbBytes_;
+};
+
+//! Filter that discards all data
+class NullOutputStream: public tbb::filter {
+public:
+  NullOutputStream();
+  void* operator()( void* item ) /*override*/;
+};
+
+//! Collects timed stages of one benchmark run
+class Monitor {
+public:
+  explicit Monitor( bool nullOutput ) : nullOutput_(nullOutput) {}
+
+  // Wrap a stage, the returned filter is owned by the monitor
+  tbb::filter& wrap( const std::string& name, tbb::filter& stage );
+
+  bool nullOutput() const { return nullOutput_; }
+  const std::vector< std::unique_ptr<TimedFilter> >& stages() const { return stages_; }
+
+private:
+  bool nullOutput_;
+  std::vector< std::unique_ptr<TimedFilter> > stages_;
+};
+
+// Run the benchmark for all configured numbers of threads and tokens
+int run_bench( ctrl& control, config& conf );
+
+} // namespace bench
+
+#endif // BENCH_H
@@ -0,0 +1,111 @@
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "bxmask.h"
+#include "log.h"
+
+
+BxMask::BxMask( const std::string& name, const std::string& fileName, unsigned neighbours, ctrl& control ) :
+    name_(name),
+    neighbours_(neighbours),
+    control_(control),
+    fileName_(fileName),
+    bits_( load(fileName) )
+{
+  control_.add_stats( name_, [this]() { return report(); } );
+  control_.set_bxmask_loader( [this]( const std::string& file ) { return reload( file ); } );
+  LOG(INFO) << '[' << name_ << "] Loaded " << fileName_ << ", " << bits_->count() << " bx selected";
+}
+
+BxMask::~BxMask()
+{
+  control_.set_bxmask_loader( nullptr );
+  control_.remove_stats( name_ );
+  LOG(INFO) << '[' << name_ << "] " << report();
+}
+
+
+std::shared_ptr<const BxMask::Bits> BxMask::load( const std::string& fileName ) const
+{
+  std::ifstream file( fileName );
+  if (!file) {
+    throw std::runtime_error( "Cannot open bx mask file '" + fileName + "'" );
+  }
+
+  Bits listed;
+  std::string line;
+  for (unsigned lineNumber = 1; std::getline( file, line ); lineNumber++) {
+    line = line.substr( 0, line.find('#') );
+    for (char& c : line) {
+      c = (c == ',') ? ' ' : c;
+    }
+
+    std::istringstream tokens( line );
+    std::string token;
+    while (tokens >> token) {
+      unsigned first, last;
+      char dash;
+      std::istringstream range( token );
+      bool valid = (range >> first) && first < nb_bx;
+      last = first;
+      if (valid && range >> dash) {
+        valid = dash == '-' && (range >> last) && last < nb_bx && first <= last && range.eof();
+      }
+      if (!valid) {
+        throw std::runtime_error( "Bx mask file '" + fileName + "' line " + std::to_string(lineNumber) + ": Invalid bx '" + token + "'" );
+      }
+      for (unsigned bx = first; bx <= last; bx++) {
+        listed.set( bx );
+      }
+    }
+  }
+  if (listed.none()) {
+    throw std::runtime_error( "Bx mask file '" + fileName + "' selects no bx" );
+  }
+
+  // The neighbourhood of the listed bx, the abort gap wraps around to bx 0
+  std::shared_ptr<Bits> bits = std::make_shared<Bits>( listed );
+  for (unsigned bx = 0; bx < nb_bx; bx++) {
+    if (listed.test( bx )) {
+      for (unsigned d = 1; d <= neighbours_ && d < nb_bx; d++) {
+        bits->set( (bx + d) % nb_bx );
+        bits->set( (bx + nb_bx - d) % nb_bx );
+      }
+    }
+  }
+  return bits;
+}
+
+
+std::string BxMask::reload( const std::string& fileName )
+{
+  std::lock_guard<std::mutex> guard( lock_ );
+  std::string file = fileName.empty() ? fileName_ : fileName;
+  try {
+    std::shared_ptr<const Bits> bits = load( file );
+    std::atomic_store( &bits_, bits );
+    fileName_ = file;
+    stats.nbReloads++;
+    LOG(INFO) << '[' << name_ << "] Reloaded " << fileName_ << ", " << bits->count() << " bx selected";
+    return "ok, " + std::to_string( bits->count() ) + " bx selected";
+  }
+  catch (std::exception& e) {
+    stats.nbFailedReloads++;
+    LOG(ERROR) << '[' << name_ << "] " << e.what() << ", keeping the previous mask";
+    return std::string("ERROR: ") + e.what();
+  }
+}
+
+
+std::string BxMask::report()
+{
+  std::ostringstream out;
+  {
+    std::lock_guard<std::mutex> guard( lock_ );
+    out << "file " << fileName_ << ", " << bits()->count() << " bx selected (+-" << neighbours_ << ")";
+  }
+  out << "; removed records " << stats.nbRecords << ", muons " << stats.nbMuons
+      << "; reloads " << stats.nbReloads << ", failed " << stats.nbFailedReloads;
+  return out.str();
+}
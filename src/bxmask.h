@@ -0,0 +1,69 @@
+#ifndef BXMASK_H
+#define BXMASK_H
+
+/*
+ * Bunch crossings selected by the filling scheme.
+ *
+ * The mask file lists the colliding bx (0..3563), separated by spaces, commas or
+ * new lines, ranges written as first-last, and comments start with '#'. The bx
+ * within +-neighbours of a listed one are selected too (wrapping around the orbit).
+ * With zero suppression the reformatter drops the records of the bx outside the mask.
+ *
+ * The run control command "bxmask [file]" loads the file again, or another file.
+ * The processing threads keep using the previous mask until their next packet.
+ */
+
+#include <atomic>
+#include <bitset>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+#include "controls.h"
+
+class BxMask {
+public:
+  static constexpr unsigned nb_bx = 3564;
+  typedef std::bitset<nb_bx> Bits;
+
+  // Throws std::runtime_error if the file cannot be loaded
+  BxMask( const std::string& name, const std::string& fileName, unsigned neighbours, ctrl& control );
+  ~BxMask();
+
+  // Current mask, hold it while processing one packet
+  std::shared_ptr<const Bits> bits() const { return std::atomic_load( &bits_ ); }
+
+  // Count the records removed by the mask
+  void count( uint64_t nbRecords, uint64_t nbMuons ) {
+    stats.nbRecords += nbRecords;
+    stats.nbMuons += nbMuons;
+  }
+
+  // Load the given file or the current one again, the previous mask is kept on errors
+  std::string reload( const std::string& fileName );
+
+private:
+  std::shared_ptr<const Bits> load( const std::string& fileName ) const;
+
+  std::string report();
+
+private:
+  std::string name_;
+  unsigned neighbours_;
+  ctrl& control_;
+
+  // Serializes the reloads
+  std::mutex lock_;
+  std::string fileName_;
+  std::shared_ptr<const Bits> bits_;
+
+  struct Statistics {
+    std::atomic<uint64_t> nbRecords{0};
+    std::atomic<uint64_t> nbMuons{0};
+    std::atomic<uint64_t> nbReloads{0};
+    std::atomic<uint64_t> nbFailedReloads{0};
+  } stats;
+};
+
+#endif // BXMASK_H
@@ -0,0 +1,140 @@
+#include <cstring>
+
+#include "checksum.h"
+
+namespace checksum {
+
+// Reflected Castagnoli polynomial
+static constexpr uint32_t polynomial = 0x82f63b78;
+
+// Tables of the slicing by 8, table[k][b] is the CRC of byte b followed by k zero bytes
+struct Tables {
+  uint32_t table[8][256];
+
+  Tables()
+  {
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; i++) {
+        crc = (crc >> 1) ^ (polynomial & -(crc & 1));
+      }
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+      for (int k = 1; k < 8; k++) {
+        table[k][b] = (table[k-1][b] >> 8) ^ table[0][table[k-1][b] & 0xff];
+      }
+    }
+  }
+};
+
+static uint32_t crc32c_table( uint32_t crc, const unsigned char *p, size_t size )
+{
+  static const Tables tables;
+  const uint32_t (*t)[256] = tables.table;
+
+  for (; size >= 8; p += 8, size -= 8) {
+    uint32_t lo, hi;
+    memcpy( &lo, p, 4 );
+    memcpy( &hi, p + 4, 4 );
+    lo ^= crc;
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+        ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  for (; size; p++, size--) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42( uint32_t crc, const unsigned char *p, size_t size )
+{
+  uint64_t crc64 = crc;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy( &word, p, 8 );
+    crc64 = __builtin_ia32_crc32di( crc64, word );
+  }
+  crc = (uint32_t)crc64;
+  for (; size; p++, size--) {
+    crc = __builtin_ia32_crc32qi( crc, *p );
+  }
+  return crc;
+}
+
+static bool has_sse42()
+{
+  static const bool has = __builtin_cpu_supports( "sse4.2" );
+  return has;
+}
+#endif
+
+// Product of a 32x32 matrix over GF(2) and a vector
+static uint32_t gf2_times( const uint32_t *matrix, uint32_t vector )
+{
+  uint32_t sum = 0;
+  for (; vector; vector >>= 1, matrix++) {
+    if (vector & 1) {
+      sum ^= *matrix;
+    }
+  }
+  return sum;
+}
+
+static void gf2_square( uint32_t *square, const uint32_t *matrix )
+{
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2_times( matrix, matrix[n] );
+  }
+}
+
+uint32_t crc32c_combine( uint32_t crc1, uint32_t crc2, uint64_t size2 )
+{
+  if (size2 == 0) {
+    return crc1;
+  }
+
+  // Operator shifting the CRC by one zero bit, then squared to shift by 2, 4, 8... bits
+  uint32_t odd[32], even[32];
+  odd[0] = polynomial;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = 1u << (n - 1);
+  }
+  gf2_square( even, odd );
+  gf2_square( odd, even );
+
+  // Shift crc1 by size2 zero bytes, one bit of size2 at a time
+  do {
+    gf2_square( even, odd );
+    if (size2 & 1) {
+      crc1 = gf2_times( even, crc1 );
+    }
+    size2 >>= 1;
+    if (size2 == 0) {
+      break;
+    }
+    gf2_square( odd, even );
+    if (size2 & 1) {
+      crc1 = gf2_times( odd, crc1 );
+    }
+    size2 >>= 1;
+  } while (size2);
+
+  return crc1 ^ crc2;
+}
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t size )
+{
+  const unsigned char *p = static_cast<const unsigned char *>( data );
+  crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+  if (has_sse42()) {
+    return ~crc32c_sse42( crc, p, size );
+  }
+#endif
+  return ~crc32c_table( crc, p, size );
+}
+
+} // namespace checksum
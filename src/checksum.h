@@ -0,0 +1,24 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+/*
+ * CRC32C (Castagnoli) of the output data, computed incrementally as the data are written.
+ *
+ * The SSE4.2 crc32 instruction is used when the CPU has it (checked once at run time,
+ * the build does not need -msse4.2), otherwise a table, 8 bytes at a time.
+ */
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace checksum {
+
+// CRC32C of the data following the ones of crc (0 at the start)
+uint32_t crc32c( uint32_t crc, const void *data, size_t size );
+
+// CRC32C of two blocks of data from the CRC32C of each one and the size of the second
+uint32_t crc32c_combine( uint32_t crc1, uint32_t crc2, uint64_t size2 );
+
+} // namespace checksum
+
+#endif // CHECKSUM_H
@@ -0,0 +1,105 @@
+#include <cstddef>
+#include <cstring>
+
+#include "columnar.h"
+#include "format.h"
+
+// Size of the header of a reformatted record (header, bx, orbit)
+static constexpr size_t record_header_size = 3 * sizeof(uint32_t);
+
+// Columns start at this alignment from the start of the block
+static constexpr size_t column_alignment = 32;
+
+static inline size_t align( size_t offset )
+{
+  return (offset + column_alignment - 1) & ~(column_alignment - 1);
+}
+
+
+ColumnarEncoder::ColumnarEncoder( uint32_t orbitsPerBlock ) :
+    orbitsPerBlock_( orbitsPerBlock ? orbitsPerBlock : 1 ),
+    nbOrbits_(0)
+{
+}
+
+
+const char* ColumnarEncoder::add( const char *p, const char *end )
+{
+  while (end - p >= (ptrdiff_t)record_header_size) {
+    const uint32_t *words = reinterpret_cast<const uint32_t *>( p );
+    uint32_t mAcount = (words[0] & header_masks::mAcount) >> header_shifts::mAcount;
+    uint32_t mBcount = (words[0] & header_masks::mBcount) >> header_shifts::mBcount;
+    uint32_t nbMuons = mAcount + mBcount;
+    if (p + record_header_size + nbMuons * sizeof(muon) > end) {
+      break;
+    }
+
+    // A new orbit starts, the block ends before it if it has all its orbits
+    if (orbit_.empty() || words[2] != orbit_.back()) {
+      if (nbOrbits_ == orbitsPerBlock_) {
+        return p;
+      }
+      nbOrbits_++;
+    }
+
+    header_.push_back( words[0] );
+    bx_.push_back( words[1] );
+    orbit_.push_back( words[2] );
+    first_.push_back( muF_.size() );
+
+    const muon *mu = reinterpret_cast<const muon *>( p + record_header_size );
+    for (uint32_t i = 0; i < nbMuons; i++) {
+      muF_.push_back( mu[i].f );
+      muS_.push_back( mu[i].s );
+      muExtra_.push_back( mu[i].extra );
+    }
+    p += record_header_size + nbMuons * sizeof(muon);
+  }
+
+  // An incomplete record is not written
+  return end;
+}
+
+
+void ColumnarEncoder::encode( std::vector<char>& block )
+{
+  block.clear();
+  if (empty()) {
+    return;
+  }
+  first_.push_back( muF_.size() );
+
+  columnar_header header;
+  memset( &header, 0, sizeof(header) );
+  header.magic = columnar_header::magic_number;
+  header.version = columnar_header::current_version;
+  header.header_size = sizeof(header);
+  header.nb_orbits = nbOrbits_;
+  header.nb_records = orbit_.size();
+  header.nb_muons = muF_.size();
+  header.first_orbit = orbit_.front();
+  header.last_orbit = orbit_.back();
+
+  // Columns in the order of the header offsets
+  const std::vector<uint32_t> *columns[columnar_header::nb_columns] = { &orbit_, &bx_, &header_, &first_, &muF_, &muS_, &muExtra_ };
+  uint32_t *offsets[columnar_header::nb_columns] = { &header.orbit_offset, &header.bx_offset, &header.header_offset, &header.first_offset,
+                                                     &header.mu_f_offset, &header.mu_s_offset, &header.mu_extra_offset };
+  size_t offset = align( sizeof(header) );
+  for (unsigned c = 0; c < columnar_header::nb_columns; c++) {
+    *offsets[c] = offset;
+    offset = align( offset + columns[c]->size() * sizeof(uint32_t) );
+  }
+  header.block_size = offset;
+
+  // Header and columns with the zero padding between them
+  block.assign( header.block_size, 0 );
+  memcpy( block.data(), &header, sizeof(header) );
+  for (unsigned c = 0; c < columnar_header::nb_columns; c++) {
+    memcpy( block.data() + *offsets[c], columns[c]->data(), columns[c]->size() * sizeof(uint32_t) );
+  }
+
+  nbOrbits_ = 0;
+  for (std::vector<uint32_t> *column : { &orbit_, &bx_, &header_, &first_, &muF_, &muS_, &muExtra_ }) {
+    column->clear();
+  }
+}
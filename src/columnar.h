@@ -0,0 +1,41 @@
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+/*
+ * Encoder of the columnar output format (see columnar_header in format.h).
+ *
+ * The reformatted records of a number of orbits are transposed into one column
+ * per word, so a reader can map a column and scan it with SIMD instead of walking
+ * the variable size records. A block ends at an orbit boundary.
+ */
+
+#include <stdint.h>
+#include <vector>
+
+class ColumnarEncoder {
+public:
+  explicit ColumnarEncoder( uint32_t orbitsPerBlock );
+
+  // Add the records of [p, end) up to the end of the block, returns where it stopped.
+  // The block is full if not all records were added.
+  const char* add( const char *p, const char *end );
+
+  bool empty() const { return orbit_.empty(); }
+
+  // Encode the block into block and start a new one
+  void encode( std::vector<char>& block );
+
+private:
+  uint32_t orbitsPerBlock_;
+  uint32_t nbOrbits_;
+
+  std::vector<uint32_t> orbit_;
+  std::vector<uint32_t> bx_;
+  std::vector<uint32_t> header_;
+  std::vector<uint32_t> first_;
+  std::vector<uint32_t> muF_;
+  std::vector<uint32_t> muS_;
+  std::vector<uint32_t> muExtra_;
+};
+
+#endif // COLUMNAR_H
@@ -0,0 +1,386 @@
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "compact.h"
+#include "format.h"
+
+namespace compact {
+
+// Size of the header of a reformatted record (header, bx, orbit)
+static constexpr size_t record_header_size = 3 * sizeof(uint32_t);
+
+// Flags of a record
+static constexpr uint8_t flag_orbit  = 1 << 0;
+static constexpr uint8_t flag_match  = 1 << 1;
+static constexpr uint8_t flag_extra  = 1 << 2;
+static constexpr uint8_t flag_header = 1 << 3;
+
+// Muons of one bx, 8 links with two muons each
+static constexpr uint32_t max_muons = 16;
+
+static inline uint32_t zigzag( uint32_t delta ) { return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31); }
+static inline uint32_t unzigzag( uint32_t v ) { return (v >> 1) ^ (uint32_t)-(int32_t)(v & 1); }
+
+static inline char* put_varint( char *q, uint32_t v )
+{
+  while (v >= 0x80) {
+    *q++ = (char)(v | 0x80);
+    v >>= 7;
+  }
+  *q++ = (char)v;
+  return q;
+}
+
+static inline bool get_varint( const uint8_t *&p, const uint8_t *end, uint32_t& v )
+{
+  v = 0;
+  for (unsigned shift = 0; shift < 35; shift += 7) {
+    if (p == end) {
+      return false;
+    }
+    uint8_t byte = *p++;
+    v |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline uint32_t header_word( uint32_t bxmatch, uint32_t mAcount, uint32_t orbitmatch, uint32_t mBcount )
+{
+  return (bxmatch << header_shifts::bxmatch) + (mAcount << header_shifts::mAcount)
+       + (orbitmatch << header_shifts::orbitmatch) + (mBcount << header_shifts::mBcount);
+}
+
+static inline uint32_t derived_extra( uint32_t bx, bool isB ) { return isB ? (bx | 1) : (bx & ~1u); }
+
+
+size_t max_encoded_size( size_t size )
+{
+  // A record of n muons takes at most 20 + 12 n bytes instead of 12 + 12 n
+  return sizeof(compact_header) + 2 * size;
+}
+
+
+size_t encode( const char *p, const char *end, char *out )
+{
+  compact_header header;
+  memset( &header, 0, sizeof(header) );
+  header.magic = compact_header::magic_number;
+  header.version = compact_header::current_version;
+  header.header_size = sizeof(header);
+  if (end - p >= (ptrdiff_t)record_header_size) {
+    memcpy( &header.first_orbit, p + 2 * sizeof(uint32_t), sizeof(uint32_t) );
+  }
+
+  char *q = out + sizeof(header);
+  uint32_t previousOrbit = header.first_orbit;
+  uint32_t previousBx = 0;
+  while (end - p >= (ptrdiff_t)record_header_size) {
+    uint32_t words[3];
+    memcpy( words, p, sizeof(words) );
+    uint32_t mAcount = (words[0] & header_masks::mAcount) >> header_shifts::mAcount;
+    uint32_t mBcount = (words[0] & header_masks::mBcount) >> header_shifts::mBcount;
+    uint32_t bxmatch = (words[0] & header_masks::bxmatch) >> header_shifts::bxmatch;
+    uint32_t orbitmatch = (words[0] & header_masks::orbitmatch) >> header_shifts::orbitmatch;
+    uint32_t nbMuons = mAcount + mBcount;
+    if (nbMuons > max_muons || p + record_header_size + nbMuons * sizeof(muon) > end) {
+      break;
+    }
+    const char *mu = p + record_header_size;
+    p += record_header_size + nbMuons * sizeof(muon);
+
+    // The extra words which are not the bx word of the record
+    uint16_t extraMask = 0;
+    for (uint32_t i = 0; i < nbMuons; i++) {
+      uint32_t extra;
+      memcpy( &extra, mu + i * sizeof(muon) + offsetof(muon, extra), sizeof(extra) );
+      if (extra != derived_extra( words[1], i >= mAcount )) {
+        extraMask |= 1 << i;
+      }
+    }
+
+    uint8_t flags = 0;
+    if (words[2] != previousOrbit) {
+      flags |= flag_orbit;
+    }
+    if (bxmatch != 0xff || orbitmatch != 0xff) {
+      flags |= flag_match;
+    }
+    if (extraMask) {
+      flags |= flag_extra;
+    }
+    if (words[0] != header_word( bxmatch, mAcount, orbitmatch, mBcount )) {
+      flags |= flag_header;
+    }
+
+    *q++ = (char)(mAcount | mBcount << 4);
+    *q++ = (char)flags;
+    if (flags & flag_orbit) {
+      q = put_varint( q, zigzag( words[2] - previousOrbit ) );
+      previousOrbit = words[2];
+      previousBx = 0;
+    }
+    q = put_varint( q, zigzag( words[1] - previousBx ) );
+    previousBx = words[1];
+    if (flags & flag_match) {
+      *q++ = (char)bxmatch;
+      *q++ = (char)orbitmatch;
+    }
+    if (flags & flag_header) {
+      memcpy( q, &words[0], sizeof(uint32_t) ); q += sizeof(uint32_t);
+    }
+    for (uint32_t i = 0; i < nbMuons; i++) {
+      memcpy( q, mu + i * sizeof(muon), 2 * sizeof(uint32_t) ); q += 2 * sizeof(uint32_t);
+    }
+    if (flags & flag_extra) {
+      memcpy( q, &extraMask, sizeof(extraMask) ); q += sizeof(extraMask);
+      for (uint32_t i = 0; i < nbMuons; i++) {
+        if (extraMask & (1 << i)) {
+          memcpy( q, mu + i * sizeof(muon) + offsetof(muon, extra), sizeof(uint32_t) ); q += sizeof(uint32_t);
+        }
+      }
+    }
+
+    header.nb_records++;
+    header.nb_muons += nbMuons;
+  }
+
+  header.last_orbit = previousOrbit;
+  header.block_size = q - out;
+  memcpy( out, &header, sizeof(header) );
+  return header.block_size;
+}
+
+
+// Reads the records of a block one at a time
+namespace {
+
+class Reader {
+public:
+  Reader( const char *block, size_t size ) :
+      p_( reinterpret_cast<const uint8_t *>(block) ),
+      end_( p_ + size ),
+      remaining_(0),
+      orbit_(0),
+      bx_(0)
+  {
+    valid_ = size >= sizeof(header_);
+    if (valid_) {
+      memcpy( &header_, block, sizeof(header_) );
+      valid_ = header_.magic == compact_header::magic_number && header_.version == compact_header::current_version
+               && header_.header_size >= sizeof(header_) && header_.block_size <= size && header_.header_size <= header_.block_size;
+    }
+    if (valid_) {
+      end_ = p_ + header_.block_size;
+      p_ += header_.header_size;
+      remaining_ = header_.nb_records;
+      orbit_ = header_.first_orbit;
+    }
+  }
+
+  bool valid() const { return valid_; }
+  const compact_header& header() const { return header_; }
+
+  // Next record, with the f and s words of the muons at muons, false at the end or on an error
+  bool next( uint32_t words[3], const uint8_t *&muons, uint32_t& nbMuons, uint32_t& mAcount, uint16_t& extraMask, const uint8_t *&extras )
+  {
+    if (!valid_ || remaining_ == 0) {
+      // The whole block has to be used by the records
+      valid_ = valid_ && p_ == end_;
+      return false;
+    }
+    remaining_--;
+    valid_ = false;
+
+    if (end_ - p_ < 2) {
+      return false;
+    }
+    uint8_t tag = *p_++;
+    uint8_t flags = *p_++;
+    mAcount = tag & 0x0f;
+    uint32_t mBcount = tag >> 4;
+    nbMuons = mAcount + mBcount;
+    if (nbMuons > max_muons) {
+      return false;
+    }
+
+    uint32_t v;
+    if (flags & flag_orbit) {
+      if (!get_varint( p_, end_, v )) {
+        return false;
+      }
+      orbit_ += unzigzag( v );
+      bx_ = 0;
+    }
+    if (!get_varint( p_, end_, v )) {
+      return false;
+    }
+    bx_ += unzigzag( v );
+
+    uint32_t bxmatch = 0xff, orbitmatch = 0xff;
+    if (flags & flag_match) {
+      if (end_ - p_ < 2) {
+        return false;
+      }
+      bxmatch = *p_++;
+      orbitmatch = *p_++;
+    }
+    words[0] = header_word( bxmatch, mAcount, orbitmatch, mBcount );
+    if (flags & flag_header) {
+      if (end_ - p_ < (ptrdiff_t)sizeof(uint32_t)) {
+        return false;
+      }
+      memcpy( &words[0], p_, sizeof(uint32_t) ); p_ += sizeof(uint32_t);
+    }
+    words[1] = bx_;
+    words[2] = orbit_;
+
+    if (end_ - p_ < (ptrdiff_t)(nbMuons * 2 * sizeof(uint32_t))) {
+      return false;
+    }
+    muons = p_;
+    p_ += nbMuons * 2 * sizeof(uint32_t);
+
+    extraMask = 0;
+    extras = p_;
+    if (flags & flag_extra) {
+      if (end_ - p_ < (ptrdiff_t)sizeof(extraMask)) {
+        return false;
+      }
+      memcpy( &extraMask, p_, sizeof(extraMask) ); p_ += sizeof(extraMask);
+      extras = p_;
+      size_t nbExtras = __builtin_popcount( extraMask );
+      if ((extraMask >> nbMuons) || end_ - p_ < (ptrdiff_t)(nbExtras * sizeof(uint32_t))) {
+        return false;
+      }
+      p_ += nbExtras * sizeof(uint32_t);
+    }
+
+    valid_ = true;
+    return true;
+  }
+
+private:
+  const uint8_t *p_;
+  const uint8_t *end_;
+  compact_header header_;
+  bool valid_;
+  uint32_t remaining_;
+  uint32_t orbit_;
+  uint32_t bx_;
+};
+
+}
+
+
+size_t decoded_size( const char *block, size_t size )
+{
+  Reader reader( block, size );
+  if (!reader.valid()) {
+    return 0;
+  }
+  return (size_t)reader.header().nb_records * record_header_size + (size_t)reader.header().nb_muons * sizeof(muon);
+}
+
+
+size_t decode_rows( const char *block, size_t size, char *out )
+{
+  Reader reader( block, size );
+  uint32_t words[3], nbMuons, mAcount;
+  uint16_t extraMask;
+  const uint8_t *muons, *extras;
+
+  char *q = out;
+  uint32_t nbAllMuons = 0;
+  while (reader.next( words, muons, nbMuons, mAcount, extraMask, extras )) {
+    nbAllMuons += nbMuons;
+    if (nbAllMuons > reader.header().nb_muons) {
+      return 0;
+    }
+    memcpy( q, words, sizeof(words) ); q += sizeof(words);
+    for (uint32_t i = 0; i < nbMuons; i++) {
+      uint32_t extra = derived_extra( words[1], i >= mAcount );
+      if (extraMask & (1 << i)) {
+        memcpy( &extra, extras, sizeof(extra) ); extras += sizeof(extra);
+      }
+      memcpy( q, muons + i * 2 * sizeof(uint32_t), 2 * sizeof(uint32_t) ); q += 2 * sizeof(uint32_t);
+      memcpy( q, &extra, sizeof(extra) ); q += sizeof(extra);
+    }
+  }
+  if (!reader.valid() || nbAllMuons != reader.header().nb_muons) {
+    return 0;
+  }
+  return q - out;
+}
+
+
+bool decode_columns( const char *block, size_t size, Columns& columns )
+{
+  Reader reader( block, size );
+  if (!reader.valid()) {
+    return false;
+  }
+  size_t nbRecords = reader.header().nb_records;
+  size_t nbAllMuons = reader.header().nb_muons;
+  columns.orbit.resize( nbRecords );
+  columns.bx.resize( nbRecords );
+  columns.header.resize( nbRecords );
+  columns.first.resize( nbRecords + 1 );
+  columns.muF.resize( nbAllMuons );
+  columns.muS.resize( nbAllMuons );
+  columns.muExtra.resize( nbAllMuons );
+
+  uint32_t words[3], nbMuons, mAcount;
+  uint16_t extraMask;
+  const uint8_t *muons, *extras;
+  size_t record = 0, m = 0;
+  while (reader.next( words, muons, nbMuons, mAcount, extraMask, extras )) {
+    if (m + nbMuons > nbAllMuons) {
+      return false;
+    }
+    columns.header[record] = words[0];
+    columns.bx[record] = words[1];
+    columns.orbit[record] = words[2];
+    columns.first[record] = m;
+    record++;
+
+    // Split the f and s words, two muons at a time
+    uint32_t *f = &columns.muF[m];
+    uint32_t *s = &columns.muS[m];
+    uint32_t i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= nbMuons; i += 2) {
+      __m128i fs = _mm_loadu_si128( reinterpret_cast<const __m128i *>(muons + i * 2 * sizeof(uint32_t)) );
+      __m128i ff_ss = _mm_shuffle_epi32( fs, _MM_SHUFFLE(3, 1, 2, 0) );
+      _mm_storel_epi64( reinterpret_cast<__m128i *>(f + i), ff_ss );
+      _mm_storel_epi64( reinterpret_cast<__m128i *>(s + i), _mm_unpackhi_epi64( ff_ss, ff_ss ) );
+    }
+#endif
+    for (; i < nbMuons; i++) {
+      memcpy( f + i, muons + i * 2 * sizeof(uint32_t), sizeof(uint32_t) );
+      memcpy( s + i, muons + i * 2 * sizeof(uint32_t) + sizeof(uint32_t), sizeof(uint32_t) );
+    }
+
+    // The extra words are the bx word unless they are in the block
+    uint32_t *extra = &columns.muExtra[m];
+    for (i = 0; i < nbMuons; i++) {
+      extra[i] = derived_extra( words[1], i >= mAcount );
+    }
+    for (uint16_t mask = extraMask; mask; mask &= mask - 1) {
+      memcpy( extra + __builtin_ctz( mask ), extras, sizeof(uint32_t) ); extras += sizeof(uint32_t);
+    }
+    m += nbMuons;
+  }
+  if (!reader.valid() || record != nbRecords || m != nbAllMuons) {
+    return false;
+  }
+  columns.first[nbRecords] = m;
+  return true;
+}
+
+} // namespace compact
@@ -0,0 +1,59 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+/*
+ * Compact encoding of the reformatted records (see compact_header in format.h).
+ *
+ * A block holds the records of one packet. Each record is
+ *   tag     1 byte   mAcount in the low 4 bits, mBcount in the high 4 bits
+ *   flags   1 byte   ORBIT, MATCH, EXTRA, HEADER below
+ *   orbit   varint   zigzag delta to the previous orbit (first_orbit of the block), if ORBIT
+ *   bx      varint   zigzag delta to the previous bx word of the orbit (0 at a new orbit)
+ *   match   2 bytes  bxmatch and orbitmatch if MATCH, otherwise both are 0xff
+ *   header  4 bytes  the header word if HEADER, when it has bits outside the fields above
+ *   muons   8 bytes  f and s words of each muon
+ *   extra   2 bytes  mask of the muons with an extra word, if EXTRA, followed by their words
+ * The extra word of a muon is the bx word with bit 0 cleared (A muons) or set (B muons)
+ * unless it is in the EXTRA mask. Decoding gives back the exact records.
+ *
+ * This file and compact.cc have no dependency on the rest of scdaq, readers of the
+ * output can build them as they are.
+ */
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+namespace compact {
+
+// Upper bound of the size of the block encoding size bytes of records
+size_t max_encoded_size( size_t size );
+
+// Encode the records of [p, end) as one block into out, returns the block size.
+// The encoding stops at an incomplete record or one with more than 16 muons.
+size_t encode( const char *p, const char *end, char *out );
+
+// Size of the records of a block, 0 if it is not a valid compact block
+size_t decoded_size( const char *block, size_t size );
+
+// Decode a block into the records, out must hold decoded_size() bytes.
+// Returns the size of the records, 0 if the block is not valid.
+size_t decode_rows( const char *block, size_t size, char *out );
+
+// Records of a block with one array per word, the muons of record i are [first[i], first[i+1])
+struct Columns {
+  std::vector<uint32_t> orbit;
+  std::vector<uint32_t> bx;
+  std::vector<uint32_t> header;
+  std::vector<uint32_t> first;
+  std::vector<uint32_t> muF;
+  std::vector<uint32_t> muS;
+  std::vector<uint32_t> muExtra;
+};
+
+// Decode a block into columns, returns false if the block is not valid
+bool decode_columns( const char *block, size_t size, Columns& columns );
+
+} // namespace compact
+
+#endif // COMPACT_H
@@ -5,12 +5,18 @@
 #include <stdint.h>
 #include "boost/lexical_cast.hpp"
 #include <map>
+#include <sstream>
 #include <stdexcept>
+#include <vector>
+
+#include "controls.h"
+#include "format.h"
 
 class config{
 public:
   
-  enum class InputType { WZDMA, DMA, FILEDMA, FILE };
+  enum class InputType { WZDMA, DMA, FILEDMA, FILE, MEMORY };
+  enum class OutputFormat { ROW, COLUMNAR, COMPACT };
 
   config(std::string filename);
 
@@ -30,6 +36,9 @@ public:
     if (input == "file") {
       return InputType::FILE;
     }
+    if (input == "memory") {
+      return InputType::MEMORY;
+    }
     throw std::invalid_argument("Configuration error: Wrong input type '" + input + "'");
   }
   const std::string& getDmaDevice() const 
@@ -48,9 +57,98 @@ public:
     std::string v = vmap.at("packets_per_report");
     return boost::lexical_cast<uint32_t>(v.c_str()); 
   } 
+  uint32_t getWzDmaPrefaultThreads() const {
+    std::string v = getOptional("wzdma_prefault_threads", "8");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  uint32_t getWzDmaConfirmBatch() const {
+    std::string v = getOptional("wzdma_confirm_batch", "16");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  bool getWzDmaEmulator() const {
+    return getOptional("wzdma_backend", "hardware") == "emulator";
+  }
+  uint32_t getWzDmaEmuBuffers() const {
+    std::string v = getOptional("wzdma_emu_buffers", "64");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  double getWzDmaEmuRate() const {
+    std::string v = getOptional("wzdma_emu_rate", "0");
+    return boost::lexical_cast<double>(v.c_str());
+  }
+  uint32_t getWzDmaEmuBxPerPacket() const {
+    std::string v = getOptional("wzdma_emu_bx_per_packet", "3564");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  uint32_t getWzDmaEmuEioEvery() const {
+    std::string v = getOptional("wzdma_emu_eio_every", "0");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  uint32_t getWzDmaEmuOversizedEvery() const {
+    std::string v = getOptional("wzdma_emu_oversized_every", "0");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  bool getWzDmaEmuWrap() const {
+    return getOptional("wzdma_emu_wrap", "no") == "yes";
+  }
   const std::string& getInputFile() const {
     return vmap.at("input_file");
   }
+  // Pacing of the filedma replay: none, orbit or timestamps
+  std::string getFileDmaReplay() const {
+    return getOptional("filedma_replay", "none");
+  }
+  std::string getFileDmaReplayTimestamps() const {
+    return getOptional("filedma_replay_timestamps", "");
+  }
+  double getFileDmaReplaySpeedup() const {
+    std::string v = getOptional("filedma_replay_speedup", "1");
+    return boost::lexical_cast<double>(v.c_str());
+  }
+  double getFileDmaReplaySpin() const {
+    std::string v = getOptional("filedma_replay_spin_us", "50");
+    return boost::lexical_cast<double>(v.c_str()) / 1e6;
+  }
+  // Data sources read by one process: DMA devices, input files or WZ DMA board numbers
+  std::vector<std::string> getInputSources() const {
+    switch (getInput()) {
+    case InputType::DMA:
+      return getStrings("dma_dev", vmap.at("dma_dev"));
+    case InputType::WZDMA:
+      return getStrings("wzdma_boards", "0");
+    default:
+      return getStrings("input_file", vmap.at("input_file"));
+    }
+  }
+  // Decode the firmware counters from the orbit trailer of each packet, on by default as it
+  // replaces the trailer dump of the input statistics
+  bool getTrailerMonitor() const {
+    return getOptional("trailer_monitor", "yes") == "yes";
+  }
+  // Check the orbit sequence and the consistency of the links in the raw data
+  bool getContinuityChecker() const {
+    return getOptional("continuity_checker", "no") == "yes";
+  }
+  // Per bx occupancy of the reformatted data over a sliding window of orbits
+  bool getOccupancyMonitor() const {
+    return getOptional("occupancy_monitor", "no") == "yes";
+  }
+  uint32_t getOccupancyWindowOrbits() const {
+    std::string v = getOptional("occupancy_window_orbits", "1124550");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  // Merge several sources by orbit into one output
+  bool getEventBuilder() const {
+    return getOptional("event_builder", "no") == "yes";
+  }
+  uint32_t getEventBuilderMaxOrbits() const {
+    std::string v = getOptional("event_builder_max_orbits", "1000");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  double getEventBuilderTimeout() const {
+    std::string v = getOptional("event_builder_timeout_ms", "100");
+    return boost::lexical_cast<double>(v.c_str()) / 1000;
+  }
   const std::string& getElasticUrl() const
   {
     return vmap.at("elastic_url");
@@ -98,11 +196,167 @@ public:
   bool getEnableElasticProcessor() const {
     return (true ? vmap.at("enable_elastic_processor") == "yes" : false);
   }
+  OutputFormat getOutputFormat() const {
+    const std::string format = getOptional("output_format", "row");
+    if (format == "row") {
+      return OutputFormat::ROW;
+    }
+    if (format == "columnar") {
+      return OutputFormat::COLUMNAR;
+    }
+    if (format == "compact") {
+      return OutputFormat::COMPACT;
+    }
+    throw std::invalid_argument("Configuration error: Wrong output format '" + format + "'");
+  }
+  // Orbits per block of the columnar output format, 0 for the other formats
+  uint32_t getColumnarOrbits() const {
+    if (getOutputFormat() != OutputFormat::COLUMNAR) {
+      return 0;
+    }
+    std::string v = getOptional("columnar_orbits_per_block", "64");
+    return std::max<uint32_t>( boost::lexical_cast<uint32_t>(v.c_str()), 1 );
+  }
+  // Format of the reformatted data in the file headers (see file_header in format.h)
+  uint16_t getFileFormat() const {
+    switch (getOutputFormat()) {
+    case OutputFormat::COLUMNAR:
+      return file_header::format_columnar;
+    case OutputFormat::COMPACT:
+      return file_header::format_compact;
+    default:
+      return file_header::format_row;
+    }
+  }
+  // End the output files with a trailer holding the checksum of the data
+  bool getOutputFileTrailer() const {
+    return getOptional("output_file_trailer", "yes") == "yes";
+  }
+  // Source in the file headers, the sources of one process are numbered from it
+  uint32_t getSourceId() const {
+    std::string v = getOptional("source_id", "0");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  // Move the closed output files to this directory in the background, no mover if empty
+  std::string getMoverDestination() const {
+    return getOptional("mover_destination", "");
+  }
+  uint32_t getMoverThreads() const {
+    std::string v = getOptional("mover_threads", "2");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  // Compress the moved files with bzip2, or copy them as they are
+  bool getMoverBzip2() const {
+    const std::string compression = getOptional("mover_compression", "none");
+    if (compression != "none" && compression != "bzip2") {
+      throw std::invalid_argument("Configuration error: Wrong mover compression '" + compression + "'");
+    }
+    return compression == "bzip2";
+  }
+  // Rules of the reduced stream, no selection if empty
+  std::string getSelection() const {
+    return getOptional("selection", "");
+  }
+  std::string getSelectionOutputFilenameBase() const {
+    return getOptional("selection_output_filename_base", getOutputFilenameBase() + "/selected");
+  }
+  uint64_t getSelectionMaxFileSize() const {
+    std::string v = getOptional("selection_max_file_size", "0");
+    return boost::lexical_cast<uint64_t>(v.c_str());
+  }
+  // Dimuon mass histograms per lumisection, log binned
+  bool getDimuonHistograms() const {
+    return getOptional("dimuon_histograms", "no") == "yes";
+  }
+  std::string getDimuonOutputDirectory() const {
+    return getOptional("dimuon_output_directory", getOutputFilenameBase() + "/dimuon");
+  }
+  uint32_t getDimuonBins() const {
+    std::string v = getOptional("dimuon_bins", "1000");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  float getDimuonMinMass() const {
+    std::string v = getOptional("dimuon_min_mass", "0.2");
+    return boost::lexical_cast<float>(v.c_str());
+  }
+  float getDimuonMaxMass() const {
+    std::string v = getOptional("dimuon_max_mass", "200");
+    return boost::lexical_cast<float>(v.c_str());
+  }
+  uint32_t getDimuonQualCut() const {
+    std::string v = getOptional("dimuon_qual_cut", "12");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
   bool getDoZS() const {
     return (true ? vmap.at("doZS") == "yes" : false);
   }
+  // Filling scheme applied with the zero suppression, no mask if empty
+  std::string getBxMaskFile() const {
+    return getOptional("bxmask_file", "");
+  }
+  uint32_t getBxMaskNeighbours() const {
+    std::string v = getOptional("bxmask_neighbours", "0");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+  OverloadPolicy getOverloadPolicy() const {
+    const std::string input = getOptional("overload_policy", "block");
+    if (input == "block") {
+      return OverloadPolicy::BLOCK;
+    }
+    if (input == "drop_newest") {
+      return OverloadPolicy::DROP_NEWEST;
+    }
+    if (input == "spill") {
+      return OverloadPolicy::SPILL;
+    }
+    throw std::invalid_argument("Configuration error: Wrong overload policy '" + input + "'");
+  }
+  uint32_t getOverloadSpillBuffers() const {
+    std::string v = getOptional("overload_spill_buffers", "0");
+    return boost::lexical_cast<uint32_t>(v.c_str());
+  }
+
+  // Settings for the benchmark mode (scdaq --bench)
+  double getBenchSeconds() const {
+    std::string v = getOptional("bench_seconds", "10");
+    return boost::lexical_cast<double>(v.c_str());
+  }
+  std::vector<uint32_t> getBenchThreads() const {
+    return getList("bench_threads", vmap.at("threads"));
+  }
+  std::vector<uint32_t> getBenchTokensPerThread() const {
+    return getList("bench_tokens_per_thread", "4");
+  }
+  bool getBenchNullOutput() const {
+    return getOptional("bench_output", "null") == "null";
+  }
 
 private:
+  // Return a comma separated list of numbers
+  std::vector<uint32_t> getList(const std::string& key, const std::string& def) const {
+    std::vector<uint32_t> list;
+    for (const std::string& item : getStrings(key, def)) {
+      list.push_back( boost::lexical_cast<uint32_t>(item.c_str()) );
+    }
+    return list;
+  }
+
+  // Return a comma separated list of strings
+  std::vector<std::string> getStrings(const std::string& key, const std::string& def) const {
+    std::vector<std::string> list;
+    std::istringstream in( getOptional(key, def) );
+    std::string item;
+    while (std::getline(in, item, ',')) {
+      list.push_back( item );
+    }
+    return list;
+  }
+
+  // Return the value of an optional key, or the default if the key is missing
+  std::string getOptional(const std::string& key, const std::string& def) const {
+    auto it = vmap.find(key);
+    return it != vmap.end() ? it->second : def;
+  }
   
   std::map<std::string,std::string> vmap;
   
@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "continuity.h"
+#include "format.h"
+#include "slice.h"
+#include "log.h"
+#include "trailer.h"
+
+// A larger jump of the orbit number is a new run or a reset, not a gap
+static constexpr uint32_t restart_distance = 1 << 20;
+
+// A link is reported as desynchronized above this fraction of mismatched blocks in a sample
+static constexpr double desync_threshold = 0.01;
+static constexpr double sample_seconds = 1;
+
+
+void ContinuityChecker::Sequence::step( uint32_t orbit )
+{
+  // Distance modulo 2^32, the orbit counter wraps around
+  uint32_t forward = orbit - last;
+  if (forward == 0) {
+    nbDuplicates++;
+  } else if (forward <= restart_distance) {
+    if (forward > 1) {
+      nbGaps++;
+      nbGapOrbits += forward - 1;
+    }
+  } else if (last - orbit <= restart_distance) {
+    nbReordered++;
+  } else {
+    nbRestarts++;
+  }
+}
+
+void ContinuityChecker::Sequence::add( uint32_t orbit )
+{
+  if (started) {
+    step( orbit );
+  } else {
+    started = true;
+    first = orbit;
+  }
+  last = orbit;
+  nbOrbits++;
+}
+
+void ContinuityChecker::Sequence::append( const Sequence& next )
+{
+  if (!next.started) {
+    return;
+  }
+  if (started) {
+    step( next.first );
+  } else {
+    started = true;
+    first = next.first;
+  }
+  last = next.last;
+  nbOrbits += next.nbOrbits;
+  nbGaps += next.nbGaps;
+  nbGapOrbits += next.nbGapOrbits;
+  nbDuplicates += next.nbDuplicates;
+  nbReordered += next.nbReordered;
+  nbRestarts += next.nbRestarts;
+}
+
+void ContinuityChecker::Counters::add( const Counters& packet )
+{
+  orbits.append( packet.orbits );
+  nbPackets += packet.nbPackets;
+  nbMalformed += packet.nbMalformed;
+  nbBlocks += packet.nbBlocks;
+  nbWrongOrbitBlocks += packet.nbWrongOrbitBlocks;
+  for (unsigned i = 0; i < nb_links; i++) {
+    orbitMismatches[i] += packet.orbitMismatches[i];
+    bxMismatches[i] += packet.bxMismatches[i];
+  }
+}
+
+
+// Bit i is set if word i of the 8 link words differs from word 0 in the masked bits
+static inline unsigned link_mismatches( const uint32_t *words, uint32_t mask )
+{
+#ifdef __SSE2__
+  const __m128i m = _mm_set1_epi32( (int)mask );
+  const __m128i ref = _mm_set1_epi32( (int)(words[0] & mask) );
+  __m128i lo = _mm_and_si128( _mm_loadu_si128( reinterpret_cast<const __m128i *>(words) ), m );
+  __m128i hi = _mm_and_si128( _mm_loadu_si128( reinterpret_cast<const __m128i *>(words + 4) ), m );
+  unsigned match = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32(lo, ref) ) )
+                 | _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32(hi, ref) ) ) << 4;
+  return ~match & 0xff;
+#else
+  unsigned mismatch = 0;
+  for (unsigned i = 1; i < ContinuityChecker::nb_links; i++) {
+    mismatch |= ((words[i] & mask) != (words[0] & mask)) << i;
+  }
+  return mismatch;
+#endif
+}
+
+
+void ContinuityChecker::scanPacket( const char *p, const char *end, Counters& packet )
+{
+  // Blocks of the current orbit, the orbit number is known at its trailer
+  uint64_t segmentBlocks = 0;
+  uint64_t segmentOther = 0;
+  uint32_t segmentOrbit = 0;
+
+  packet.nbPackets = 1;
+  while (p < end) {
+    if (trailer::is_trailer( p )) {
+      if (end - p < (ptrdiff_t)constants::orbit_trailer_size) {
+        break;
+      }
+      uint64_t orbit;
+      memcpy( &orbit, p + 3*sizeof(uint64_t), sizeof(orbit) );
+      packet.orbits.add( (uint32_t)orbit );
+
+      // All blocks are wrong if the first one does not have the orbit of the trailer
+      if (segmentBlocks) {
+        packet.nbWrongOrbitBlocks += (segmentOrbit == (uint32_t)orbit) ? segmentOther : segmentBlocks;
+      }
+      segmentBlocks = 0;
+      segmentOther = 0;
+      p += constants::orbit_trailer_size;
+      continue;
+    }
+
+    if (end - p < (ptrdiff_t)sizeof(block1)) {
+      break;
+    }
+    const block1 *bl = reinterpret_cast<const block1 *>( p );
+
+    unsigned orbitMismatch = link_mismatches( bl->orbit, 0xffffffff );
+    unsigned bxMismatch = link_mismatches( bl->bx, masks::bx << shifts::bx );
+    for (unsigned i = 0; orbitMismatch | bxMismatch; i++, orbitMismatch >>= 1, bxMismatch >>= 1) {
+      packet.orbitMismatches[i] += orbitMismatch & 1;
+      packet.bxMismatches[i] += bxMismatch & 1;
+    }
+
+    if (segmentBlocks == 0) {
+      segmentOrbit = bl->orbit[0];
+    } else if (bl->orbit[0] != segmentOrbit) {
+      segmentOther++;
+    }
+    segmentBlocks++;
+    packet.nbBlocks++;
+    p += sizeof(block1);
+  }
+
+  // Data after the last trailer or a partial block
+  if (p != end || segmentBlocks) {
+    packet.nbMalformed = 1;
+  }
+}
+
+
+void* ContinuityChecker::Scan::operator()( void* item )
+{
+  Slice *slice = static_cast<Slice*>( item );
+
+  // Empty packets only carry the run state
+  if (slice->size()) {
+    Counters packet;
+    scanPacket( slice->begin(), slice->end(), packet );
+    checker_.add( slice, packet );
+  }
+  return slice;
+}
+
+void* ContinuityChecker::Merge::operator()( void* item )
+{
+  Slice *slice = static_cast<Slice*>( item );
+  checker_.merge( slice );
+  return slice;
+}
+
+
+ContinuityChecker::ContinuityChecker( const std::string& name, ctrl& control ) :
+    name_(name),
+    control_(control),
+    scan_(*this),
+    merge_(*this),
+    sampleTime_( tbb::tick_count::now() )
+{
+  for (unsigned i = 0; i < nb_links; i++) {
+    desynchronized_[i] = false;
+  }
+  control_.add_stats( name_, [this]() { return report(); } );
+  LOG(TRACE) << "Created continuity checker " << name_;
+}
+
+ContinuityChecker::~ContinuityChecker()
+{
+  control_.remove_stats( name_ );
+  LOG(INFO) << '[' << name_ << "] " << report();
+}
+
+
+void ContinuityChecker::add( Slice *slice, const Counters& packet )
+{
+  std::lock_guard<std::mutex> guard( pendingLock_ );
+  pending_[slice] = packet;
+}
+
+void ContinuityChecker::merge( Slice *slice )
+{
+  Counters packet;
+  bool found = false;
+  {
+    std::lock_guard<std::mutex> guard( pendingLock_ );
+    auto it = pending_.find( slice );
+    if (it != pending_.end()) {
+      packet = it->second;
+      pending_.erase( it );
+      found = true;
+    }
+  }
+
+  tbb::tick_count now = tbb::tick_count::now();
+  bool print = false;
+  {
+    std::lock_guard<std::mutex> guard( lock_ );
+    if (found) {
+      total_.add( packet );
+      print = control_.packets_per_report && (total_.nbPackets % control_.packets_per_report == 0);
+    }
+    if ((now - sampleTime_).seconds() >= sample_seconds) {
+      closeSample( now );
+    }
+  }
+
+  if (print) {
+    LOG(INFO) << '[' << name_ << "] " << report();
+  }
+}
+
+
+void ContinuityChecker::closeSample( tbb::tick_count now )
+{
+  uint64_t nbBlocks = total_.nbBlocks - sampleStart_.nbBlocks;
+  lastSample_.nbBlocks = nbBlocks;
+
+  for (unsigned i = 0; i < nb_links; i++) {
+    lastSample_.orbitMismatches[i] = total_.orbitMismatches[i] - sampleStart_.orbitMismatches[i];
+    lastSample_.bxMismatches[i] = total_.bxMismatches[i] - sampleStart_.bxMismatches[i];
+
+    // Warn when a link gets out of sync and when it is back
+    uint64_t mismatches = std::max( lastSample_.orbitMismatches[i], lastSample_.bxMismatches[i] );
+    bool desync = nbBlocks && mismatches > desync_threshold * nbBlocks;
+    if (desync && !desynchronized_[i]) {
+      LOG(WARNING) << '[' << name_ << "] Link " << i << " desynchronized: " << lastSample_.orbitMismatches[i] << " orbit and "
+                   << lastSample_.bxMismatches[i] << " bx mismatches in " << nbBlocks << " blocks";
+    } else if (!desync && desynchronized_[i] && nbBlocks) {
+      LOG(INFO) << '[' << name_ << "] Link " << i << " in sync again";
+    }
+    desynchronized_[i] = nbBlocks ? desync : desynchronized_[i];
+  }
+
+  sampleStart_ = total_;
+  sampleTime_ = now;
+}
+
+
+std::string ContinuityChecker::report()
+{
+  std::lock_guard<std::mutex> guard( lock_ );
+  std::ostringstream out;
+  const Sequence& orbits = total_.orbits;
+
+  out << "packets " << total_.nbPackets << ", malformed " << total_.nbMalformed
+      << ", orbits " << orbits.nbOrbits << " (last " << orbits.last << ")"
+      << ", gaps " << orbits.nbGaps << " (" << orbits.nbGapOrbits << " orbits)"
+      << ", duplicates " << orbits.nbDuplicates << ", reordered " << orbits.nbReordered
+      << ", restarts " << orbits.nbRestarts
+      << ", blocks " << total_.nbBlocks << ", wrong orbit " << total_.nbWrongOrbitBlocks;
+
+  // Mismatches with link 0, total and in the last sample
+  out << "; link orbit/bx mismatches:";
+  for (unsigned i = 1; i < nb_links; i++) {
+    out << ' ' << total_.orbitMismatches[i] << '/' << total_.bxMismatches[i];
+  }
+  out << "; last second in " << lastSample_.nbBlocks << " blocks:";
+  for (unsigned i = 1; i < nb_links; i++) {
+    out << ' ' << lastSample_.orbitMismatches[i] << '/' << lastSample_.bxMismatches[i]
+        << (desynchronized_[i] ? " DESYNC" : "");
+  }
+  return out.str();
+}
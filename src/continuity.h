@@ -0,0 +1,117 @@
+#ifndef CONTINUITY_H
+#define CONTINUITY_H
+
+/*
+ * Validation of the raw block1 data, before the reformatter modifies them.
+ *
+ * The scan stage runs in parallel: for each block it compares the orbit and bx
+ * words of the 8 links with link 0 (SSE2), and it checks the sequence of the orbit
+ * numbers given by the orbit trailers within the packet. The merge stage runs in
+ * order and adds the packet summaries to the totals, checking the sequence across
+ * the packets. A warning is logged when the mismatch rate of a link exceeds 1% in
+ * a one second sample. The counters are published for the run control command "stats".
+ */
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+#include "tbb/pipeline.h"
+#include "tbb/tick_count.h"
+
+#include "controls.h"
+
+class Slice;
+
+class ContinuityChecker {
+public:
+  ContinuityChecker( const std::string& name, ctrl& control );
+  ~ContinuityChecker();
+
+  // Parallel stage followed by the serial stage, both pass the packets on
+  tbb::filter& scan() { return scan_; }
+  tbb::filter& merge() { return merge_; }
+
+  static constexpr unsigned nb_links = 8;
+
+  // Sequence of orbit numbers, public for the unit tests
+  struct Sequence {
+    bool started = false;
+    uint32_t first = 0;
+    uint32_t last = 0;
+    uint64_t nbOrbits = 0;
+    uint64_t nbGaps = 0;
+    uint64_t nbGapOrbits = 0;
+    uint64_t nbDuplicates = 0;
+    uint64_t nbReordered = 0;
+    uint64_t nbRestarts = 0;
+
+    void add( uint32_t orbit );
+    // Append the sequence of the following packet
+    void append( const Sequence& next );
+  private:
+    // Count the step from last to orbit
+    void step( uint32_t orbit );
+  };
+
+private:
+  struct Counters {
+    Sequence orbits;
+    uint64_t nbPackets = 0;
+    uint64_t nbMalformed = 0;
+    uint64_t nbBlocks = 0;
+    uint64_t nbWrongOrbitBlocks = 0;
+    uint64_t orbitMismatches[nb_links] = {};
+    uint64_t bxMismatches[nb_links] = {};
+
+    void add( const Counters& packet );
+  };
+
+  class Scan: public tbb::filter {
+  public:
+    explicit Scan( ContinuityChecker& checker ) : tbb::filter(parallel), checker_(checker) {}
+    void* operator()( void* item ) /*override*/;
+  private:
+    ContinuityChecker& checker_;
+  };
+
+  class Merge: public tbb::filter {
+  public:
+    explicit Merge( ContinuityChecker& checker ) : tbb::filter(serial_in_order), checker_(checker) {}
+    void* operator()( void* item ) /*override*/;
+  private:
+    ContinuityChecker& checker_;
+  };
+
+  static void scanPacket( const char *p, const char *end, Counters& packet );
+
+  void add( Slice *slice, const Counters& packet );
+  void merge( Slice *slice );
+
+  // Close the one second sample and check the link mismatch rates, lock_ has to be held
+  void closeSample( tbb::tick_count now );
+
+  std::string report();
+
+private:
+  std::string name_;
+  ctrl& control_;
+  Scan scan_;
+  Merge merge_;
+
+  // Summaries of the scanned packets waiting for the merge
+  std::mutex pendingLock_;
+  std::unordered_map<Slice*, Counters> pending_;
+
+  std::mutex lock_;
+  Counters total_;
+  // Totals at the start of the sample and the increments of the last sample
+  Counters sampleStart_;
+  Counters lastSample_;
+  tbb::tick_count sampleTime_;
+  bool desynchronized_[nb_links];
+};
+
+#endif // CONTINUITY_H
@@ -1,14 +1,120 @@
 #ifndef CONTROLS_H
 #define CONTROLS_H
 #include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
 #include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tbb/tick_count.h"
+
+/* What the input stage does when no free slice is available */
+enum class OverloadPolicy { BLOCK, DROP_NEWEST, SPILL };
 
 struct ctrl {
   uint32_t run_number;
   std::atomic<bool> running;
+  /* Stop the pipeline, the input stage will not read any more data */
+  std::atomic<bool> shutdown{false};
   /* Always write data to a file regardless of the run status */
   bool output_force_write;
   uint64_t max_file_size;
   int packets_per_report;
+  OverloadPolicy overload_policy;
+  /* Maximum number of extra slices allocated by the SPILL policy */
+  uint32_t overload_spill_buffers;
+  /* When the process started, used to report the startup time */
+  tbb::tick_count start_time = tbb::tick_count::now();
+
+  /* Input stages waiting for data register an eventfd, it is signalled when the run state changes */
+  void add_wakeup(int fd) {
+    std::lock_guard<std::mutex> guard(wakeup_lock);
+    wakeup_fds.push_back(fd);
+  }
+  void remove_wakeup(int fd) {
+    std::lock_guard<std::mutex> guard(wakeup_lock);
+    wakeup_fds.erase(std::remove(wakeup_fds.begin(), wakeup_fds.end(), fd), wakeup_fds.end());
+  }
+  /* Call after changing running, run_number or shutdown */
+  void notify() {
+    std::lock_guard<std::mutex> guard(wakeup_lock);
+    for (int fd : wakeup_fds) {
+      uint64_t one = 1;
+      ssize_t ret = write(fd, &one, sizeof(one));
+      (void)(ret);
+    }
+  }
+
+  /* Monitoring stages publish their counters, the run control command "stats" returns them */
+  void add_stats(const std::string& name, std::function<std::string()> reporter) { stats_reporters.add(name, reporter); }
+  void remove_stats(const std::string& name) { stats_reporters.remove(name); }
+  /* One line per reporter, or only the given one */
+  std::string stats(const std::string& name = "") { return stats_reporters.collect(name); }
+
+  /* Histogramming stages publish snapshots, the run control command "occupancy" returns them */
+  void add_occupancy(const std::string& name, std::function<std::string()> reporter) { occupancy_reporters.add(name, reporter); }
+  void remove_occupancy(const std::string& name) { occupancy_reporters.remove(name); }
+  std::string occupancy(const std::string& name = "") { return occupancy_reporters.collect(name); }
+
+  /* The run control command "bxmask [file]" reloads the bx mask, if one is configured */
+  void set_bxmask_loader(std::function<std::string(const std::string&)> loader) {
+    std::lock_guard<std::mutex> guard(bxmask_lock);
+    bxmask_loader = loader;
+  }
+  std::string load_bxmask(const std::string& file) {
+    std::lock_guard<std::mutex> guard(bxmask_lock);
+    return bxmask_loader ? bxmask_loader(file) : "ERROR: No bx mask configured";
+  }
+
+  /* The output streams pass their closed files to the file mover, if one is configured */
+  void set_file_mover(std::function<void(const std::string&)> mover) {
+    std::lock_guard<std::mutex> guard(mover_lock);
+    file_mover = mover;
+  }
+  void move_file(const std::string& file) {
+    std::lock_guard<std::mutex> guard(mover_lock);
+    if (file_mover) {
+      file_mover(file);
+    }
+  }
+
+private:
+  /* Named reporters called from the run control thread */
+  struct Reporters {
+    std::mutex lock;
+    std::map<std::string, std::function<std::string()>> reporters;
+
+    void add(const std::string& name, std::function<std::string()> reporter) {
+      std::lock_guard<std::mutex> guard(lock);
+      reporters[name] = reporter;
+    }
+    void remove(const std::string& name) {
+      std::lock_guard<std::mutex> guard(lock);
+      reporters.erase(name);
+    }
+    std::string collect(const std::string& name) {
+      std::lock_guard<std::mutex> guard(lock);
+      std::string out;
+      for (const auto& reporter : reporters) {
+        if (name.empty() || name == reporter.first) {
+          out += reporter.first + ": " + reporter.second() + "\n";
+        }
+      }
+      return out;
+    }
+  };
+
+  std::mutex wakeup_lock;
+  std::vector<int> wakeup_fds;
+  Reporters stats_reporters;
+  Reporters occupancy_reporters;
+  std::mutex bxmask_lock;
+  std::function<std::string(const std::string&)> bxmask_loader;
+  std::mutex mover_lock;
+  std::function<void(const std::string&)> file_mover;
 };
 #endif 
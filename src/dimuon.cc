@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dimuon.h"
+#include "format.h"
+#include "slice.h"
+#include "log.h"
+#include "tools.h"
+
+// Size of the header of a reformatted record (header, bx, orbit)
+static constexpr size_t record_header_size = 3 * sizeof(uint32_t);
+
+static inline uint32_t run_of( uint64_t key ) { return key >> 32; }
+static inline uint32_t ls_of( uint64_t key ) { return (uint32_t)key; }
+
+
+DimuonHistograms::DimuonHistograms( const std::string& name, const std::string& directory, uint32_t nbBins, float minMass, float maxMass,
+                                    uint32_t qualCut, ctrl& control ) :
+    tbb::filter(parallel),
+    name_(name),
+    directory_(directory),
+    nbBins_(nbBins),
+    minMass_(minMass),
+    maxMass_(maxMass),
+    logMin_( std::log(minMass) ),
+    binsPerLog_( nbBins / (std::log(maxMass) - std::log(minMass)) ),
+    qualCut_(qualCut),
+    control_(control),
+    latest_(0)
+{
+  if (nbBins_ == 0 || !(minMass_ > 0) || !(maxMass_ > minMass_)) {
+    throw std::invalid_argument( "Configuration error: Wrong dimuon histogram binning" );
+  }
+  if (!tools::filesystem::create_directories( directory_ )) {
+    throw std::runtime_error( tools::strerror("ERROR when creating the dimuon directory '" + directory_ + "'") );
+  }
+  control_.add_stats( name_, [this]() { return report(); } );
+  LOG(TRACE) << "Created dimuon histograms " << name_ << " in " << directory_;
+}
+
+DimuonHistograms::~DimuonHistograms()
+{
+  control_.remove_stats( name_ );
+
+  // The pipeline is done, write what all threads have
+  for (Accumulator& acc : local_) {
+    if (acc.used) {
+      flush( acc );
+    }
+  }
+  Accumulator none;
+  flush( none, true );
+  LOG(INFO) << '[' << name_ << "] " << report();
+}
+
+
+void DimuonHistograms::fillPairs( unsigned n, Accumulator& acc )
+{
+  for (unsigned k = n; k < n + 3; k++) {
+    acc.e[k] = acc.px[k] = acc.py[k] = acc.pz[k] = acc.charge[k] = 0;
+  }
+
+  uint64_t nbOutOfRange = 0;
+  for (unsigned i = 0; i + 1 < n; i++) {
+    float mass[4];
+
+    // m^2 = 2 (E1 E2 - p1.p2) for massless muons, with muon i and four following ones at a time
+    for (unsigned j = i + 1; j < n; j += 4) {
+#ifdef __SSE2__
+      __m128 dot = _mm_mul_ps( _mm_set1_ps(acc.e[i]), _mm_loadu_ps(acc.e + j) );
+      dot = _mm_sub_ps( dot, _mm_mul_ps( _mm_set1_ps(acc.px[i]), _mm_loadu_ps(acc.px + j) ) );
+      dot = _mm_sub_ps( dot, _mm_mul_ps( _mm_set1_ps(acc.py[i]), _mm_loadu_ps(acc.py + j) ) );
+      dot = _mm_sub_ps( dot, _mm_mul_ps( _mm_set1_ps(acc.pz[i]), _mm_loadu_ps(acc.pz + j) ) );
+      __m128 m2 = _mm_max_ps( _mm_add_ps(dot, dot), _mm_setzero_ps() );
+      _mm_storeu_ps( mass, _mm_sqrt_ps(m2) );
+#else
+      for (unsigned k = 0; k < 4; k++) {
+        float dot = acc.e[i]*acc.e[j+k] - acc.px[i]*acc.px[j+k] - acc.py[i]*acc.py[j+k] - acc.pz[i]*acc.pz[j+k];
+        mass[k] = std::sqrt( std::max( 2 * dot, 0.f ) );
+      }
+#endif
+      for (unsigned k = 0; k < 4 && j + k < n; k++) {
+        float bin = (std::log( mass[k] ) - logMin_) * binsPerLog_;
+        if (!(bin >= 0 && bin < nbBins_)) {
+          nbOutOfRange++;
+          continue;
+        }
+        std::vector<uint32_t>& h = (acc.charge[i] != acc.charge[j+k]) ? acc.histograms.os : acc.histograms.ss;
+        h[(uint32_t)bin]++;
+      }
+    }
+  }
+
+  stats.nbPairs += n * (n - 1) / 2;
+  if (nbOutOfRange) {
+    stats.nbOutOfRange += nbOutOfRange;
+  }
+}
+
+
+void DimuonHistograms::fill( const char *p, const char *end, uint32_t run, Accumulator& acc )
+{
+  while (end - p >= (ptrdiff_t)record_header_size) {
+    const uint32_t *words = reinterpret_cast<const uint32_t *>( p );
+    uint32_t mAcount = (words[0] & header_masks::mAcount) >> header_shifts::mAcount;
+    uint32_t mBcount = (words[0] & header_masks::mBcount) >> header_shifts::mBcount;
+    uint32_t orbit = words[2];
+    const muon *mu = reinterpret_cast<const muon *>( p + record_header_size );
+    p += record_header_size + (mAcount + mBcount) * sizeof(muon);
+    if (p > end) {
+      break;
+    }
+
+    // Lumisections are numbered from 1
+    uint64_t k = key( run, orbit / orbits_per_lumisection + 1 );
+    if (acc.used && k != acc.key) {
+      flush( acc );
+    }
+    if (!acc.used) {
+      acc.used = true;
+      acc.key = k;
+      acc.histograms.os.assign( nbBins_, 0 );
+      acc.histograms.ss.assign( nbBins_, 0 );
+    }
+
+    // Four-vectors of the muons passing the quality cut
+    unsigned n = 0;
+    for (uint32_t i = 0; i < mAcount + mBcount && n < max_muons; i++) {
+      uint32_t ipt = (mu[i].f >> shifts::pt) & masks::pt;
+      uint32_t qual = (mu[i].f >> shifts::qual) & masks::qual;
+      if (ipt == 0 || qual < qualCut_) {
+        continue;
+      }
+      int32_t ieta = (mu[i].f >> shifts::etaext) & masks::etaext;
+      if (ieta & masks::etaexts) {
+        ieta -= 2 * masks::etaexts;
+      }
+      float pt = (ipt - 1) * gmt_scales::pt_scale;
+      float eta = ieta * gmt_scales::eta_scale;
+      float phi = ((mu[i].f >> shifts::phiext) & masks::phiext) * gmt_scales::phi_scale;
+
+      acc.px[n] = pt * std::cos(phi);
+      acc.py[n] = pt * std::sin(phi);
+      acc.pz[n] = pt * std::sinh(eta);
+      acc.e[n] = pt * std::cosh(eta);
+      acc.charge[n] = (mu[i].s >> shifts::chrg) & masks::chrg;
+      n++;
+    }
+    if (n >= 2) {
+      fillPairs( n, acc );
+    }
+  }
+}
+
+
+void* DimuonHistograms::operator()( void* item )
+{
+  Slice *slice = static_cast<Slice*>( item );
+
+  // Histograms belong to a run
+  if (control_.running.load(std::memory_order_acquire)) {
+    fill( slice->begin(), slice->end(), control_.run_number, local_.local() );
+  }
+  return slice;
+}
+
+
+void DimuonHistograms::flush( Accumulator& acc, bool all )
+{
+  std::lock_guard<std::mutex> guard( lock_ );
+
+  if (acc.used) {
+    latest_ = std::max( latest_, acc.key );
+    Histograms& h = pending_[acc.key];
+    if (h.os.empty()) {
+      h.os.assign( nbBins_, 0 );
+      h.ss.assign( nbBins_, 0 );
+    }
+    for (uint32_t bin = 0; bin < nbBins_; bin++) {
+      h.os[bin] += acc.histograms.os[bin];
+      h.ss[bin] += acc.histograms.ss[bin];
+    }
+    acc.used = false;
+  }
+
+  // A lumisection is complete when the data are two lumisections ahead, or in the next run
+  for (auto it = pending_.begin(); it != pending_.end(); ) {
+    bool complete = all || run_of(it->first) != run_of(latest_) || ls_of(it->first) + 2 <= ls_of(latest_);
+    if (!complete) {
+      ++it;
+      continue;
+    }
+    if (acc.key == it->first && !all) {
+      stats.nbLate++;
+    }
+    dump( it->first, it->second );
+    it = pending_.erase( it );
+  }
+}
+
+
+void DimuonHistograms::dump( uint64_t key, const Histograms& histograms )
+{
+  char fileName[PATH_MAX];
+  snprintf( fileName, sizeof(fileName), "%s/dimuon_%06u.jsonl", directory_.c_str(), run_of(key) );
+
+  std::ostringstream line;
+  line << "{\"run\":" << run_of(key) << ",\"ls\":" << ls_of(key)
+       << ",\"min\":" << minMass_ << ",\"max\":" << maxMass_ << ",\"bins\":" << nbBins_;
+  for (const auto& h : { std::make_pair("os", &histograms.os), std::make_pair("ss", &histograms.ss) }) {
+    line << ",\"" << h.first << "\":[";
+    for (uint32_t bin = 0; bin < nbBins_; bin++) {
+      line << (bin ? "," : "") << (*h.second)[bin];
+    }
+    line << ']';
+  }
+  line << "}\n";
+
+  // Opened for each lumisection, the file can be moved away while running
+  FILE *file = fopen( fileName, "a" );
+  std::string text = line.str();
+  if (file == NULL || fwrite( text.data(), 1, text.size(), file ) != text.size()) {
+    stats.nbWriteErrors++;
+    LOG(ERROR) << '[' << name_ << "] " << tools::strerror( "Cannot write to '" + std::string(fileName) + "'" );
+  }
+  if (file) {
+    fclose( file );
+  }
+  stats.nbLumisections++;
+}
+
+
+std::string DimuonHistograms::report()
+{
+  std::ostringstream out;
+  out << "pairs " << stats.nbPairs << ", out of range " << stats.nbOutOfRange
+      << "; lumisections written " << stats.nbLumisections << ", late " << stats.nbLate
+      << ", write errors " << stats.nbWriteErrors;
+  return out.str();
+}
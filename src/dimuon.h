@@ -0,0 +1,95 @@
+#ifndef DIMUON_H
+#define DIMUON_H
+
+/*
+ * Invariant mass histograms of the muon pairs within each bx, per lumisection.
+ *
+ * Muons passing the quality cut are converted to massless four-vectors, the masses
+ * of the pairs are computed four pairs at a time (SSE) and filled into log binned
+ * histograms of the opposite and same sign pairs. Each thread fills its own histograms
+ * without locking, for one lumisection (2^18 orbits) at a time, and adds them to the
+ * shared ones when it gets to the next lumisection. A lumisection is written when
+ * the data are two lumisections ahead, as one JSON line
+ *   {"run":N,"ls":N,"min":M,"max":M,"bins":N,"os":[...],"ss":[...]}
+ * to <directory>/dimuon_<run>.jsonl. A thread which was idle during the following
+ * lumisections writes another line for the same lumisection, the lines add up.
+ */
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/pipeline.h"
+
+#include "controls.h"
+
+class DimuonHistograms: public tbb::filter {
+public:
+  DimuonHistograms( const std::string& name, const std::string& directory, uint32_t nbBins, float minMass, float maxMass,
+                    uint32_t qualCut, ctrl& control );
+  ~DimuonHistograms();
+
+  void* operator()( void* item ) /*override*/;
+
+  static constexpr uint32_t orbits_per_lumisection = 1 << 18;
+  // Muons of one bx, 8 links with two muons each
+  static constexpr unsigned max_muons = 16;
+
+private:
+  struct Histograms {
+    std::vector<uint32_t> os;
+    std::vector<uint32_t> ss;
+  };
+
+  // Filled by one thread
+  struct Accumulator {
+    bool used = false;
+    uint64_t key = 0;
+    Histograms histograms;
+    // Four-vectors of the muons of one bx, padded for the last group of 4
+    float e[max_muons + 3], px[max_muons + 3], py[max_muons + 3], pz[max_muons + 3], charge[max_muons + 3];
+  };
+
+  // Run number and lumisection
+  static uint64_t key( uint32_t run, uint32_t ls ) { return (uint64_t)run << 32 | ls; }
+
+  void fill( const char *p, const char *end, uint32_t run, Accumulator& acc );
+  void fillPairs( unsigned n, Accumulator& acc );
+
+  // Add the histograms of a thread to the shared ones and write the complete lumisections
+  void flush( Accumulator& acc, bool all = false );
+  void dump( uint64_t key, const Histograms& histograms );
+
+  std::string report();
+
+private:
+  std::string name_;
+  std::string directory_;
+  uint32_t nbBins_;
+  float minMass_;
+  float maxMass_;
+  float logMin_;
+  float binsPerLog_;
+  uint32_t qualCut_;
+  ctrl& control_;
+
+  tbb::enumerable_thread_specific<Accumulator> local_;
+
+  std::mutex lock_;
+  std::map<uint64_t, Histograms> pending_;
+  uint64_t latest_;
+
+  struct Statistics {
+    std::atomic<uint64_t> nbPairs{0};
+    std::atomic<uint64_t> nbOutOfRange{0};
+    std::atomic<uint64_t> nbLumisections{0};
+    std::atomic<uint64_t> nbLate{0};
+    std::atomic<uint64_t> nbWriteErrors{0};
+  } stats;
+};
+
+#endif // DIMUON_H
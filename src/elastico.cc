@@ -95,7 +95,7 @@ void ElasticProcessor::makeCreateIndexRequest(unsigned int run){
   curl_easy_setopt(handle, CURLOPT_URL, p_request_url.c_str()); 
 }
 
-void ElasticProcessor::makeAppendToBulkRequest(std::ostringstream &particle_data, char*c){
+char *ElasticProcessor::makeAppendToBulkRequest(std::ostringstream &particle_data, char*c){
   uint32_t *p = (uint32_t*)c;
   uint32_t header = *p++;
   int mAcount = (header&header_masks::mAcount)>>header_shifts::mAcount;
@@ -103,9 +103,12 @@ void ElasticProcessor::makeAppendToBulkRequest(std::ostringstream &particle_data
   
   uint32_t bx=*p++;
   uint32_t orbit=*p++;
+  // Header, bx and orbit words are followed by mAcount + mBcount muons
+  char *next = (char*)p + (mAcount + mBcount)*sizeof(muon);
   for(/*unsigned*/ int i = 0; i < mAcount; i++){
     uint32_t mf = *p++;
     uint32_t ms = *p++;
+    p++; // Skip the extra word
     uint32_t ipt = (mf >> shifts::pt) & masks::pt;
     if(ipt<pt_cut)continue;
     uint32_t qual = (mf >> shifts::qual) & masks::qual;
@@ -126,7 +129,6 @@ void ElasticProcessor::makeAppendToBulkRequest(std::ostringstream &particle_data
 
     (void)(iso);      // TODO: Unused variable
     (void)(chrgv);    // TODO: Unused variable
-    (void)(mBcount);  // TODO: Unused variable
     (void)(index);    // TODO: Unused variable
 
     particle_data << "{\"index\" : {}}\n" 
@@ -143,6 +145,7 @@ void ElasticProcessor::makeAppendToBulkRequest(std::ostringstream &particle_data
 
   }
 
+  return next;
 }
 
 
@@ -151,10 +154,10 @@ void* ElasticProcessor::operator()( void* item ){
   Slice& input = *static_cast<Slice*>(item);
   std::ostringstream particle_data;
   char* p = input.begin();
-  if(control->running){
+  if(control->running && input.size() > 0){
     if(c_request_url.empty()) makeCreateIndexRequest(control->run_number);
     while(p!=input.end()){
-      makeAppendToBulkRequest(particle_data,p);
+      p = makeAppendToBulkRequest(particle_data,p);
     }
     curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE,particle_data.str().length());
     curl_easy_setopt(handle, CURLOPT_COPYPOSTFIELDS, particle_data.str().c_str()); /* data goes here */
@@ -17,9 +17,11 @@ public:
   ElasticProcessor(size_t, ctrl *, std::string, uint32_t, uint32_t);
   void* operator()( void* item )/*override*/;
   ~ElasticProcessor();
+
+  // Append muons of one reformatted bx record, returns pointer to the next record (public for the benchmarks)
+  char *makeAppendToBulkRequest(std::ostringstream &, char *);
 private:
   void makeCreateIndexRequest(unsigned int);
-  void makeAppendToBulkRequest(std::ostringstream &, char *);
   size_t max_size;
   ctrl *control;
   std::string request_url; 
@@ -0,0 +1,418 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "eventbuilder.h"
+#include "format.h"
+#include "slice.h"
+#include "log.h"
+
+// A fragment older than this many orbits behind the last built one means the orbit counter restarted
+static constexpr uint32_t resync_distance = 1 << 20;
+
+// Size of the header of a built record and of a reformatted record (header, bx, orbit)
+static constexpr size_t record_header_size = 3 * sizeof(uint32_t);
+
+static inline const uint32_t* record_words( const char *p )
+{
+  return reinterpret_cast<const uint32_t *>( p );
+}
+
+// Size of a reformatted record, the header holds the number of muons in both blocks
+static inline size_t record_size( const char *p )
+{
+  uint32_t header = record_words(p)[0];
+  uint32_t mAcount = (header >> 16) & 0xff;
+  uint32_t mBcount = header & 0xff;
+  return record_header_size + (mAcount + mBcount) * sizeof(muon);
+}
+
+static inline uint32_t record_bx( const char *p )
+{
+  return (record_words(p)[1] >> shifts::bx) & masks::bx;
+}
+
+static inline uint32_t record_orbit( const char *p )
+{
+  return record_words(p)[2];
+}
+
+static inline uint32_t record_muons( const char *p )
+{
+  uint32_t header = record_words(p)[0];
+  return ((header >> 16) & 0xff) + (header & 0xff);
+}
+
+
+EventBuilder::Port::Port( EventBuilder& builder, size_t source ) :
+    tbb::filter(serial_in_order),
+    builder_(builder),
+    source_(source)
+{
+}
+
+void* EventBuilder::Port::operator()( void* item )
+{
+  builder_.add( source_, static_cast<Slice*>(item) );
+  return NULL;
+}
+
+
+EventBuilder::EventBuilder( size_t nbSources, size_t maxOrbits, double timeoutSeconds, ctrl& control ) :
+    tbb::filter(serial_in_order),
+    nbSources_(nbSources),
+    maxOrbits_(maxOrbits > 0 ? maxOrbits : 1),
+    timeoutSeconds_(timeoutSeconds),
+    control_(control),
+    anyBuilt_(false),
+    lastBuiltOrbit_(0),
+    stop_(false)
+{
+  if (nbSources_ > 32) {
+    throw std::invalid_argument("Configuration error: The event builder supports at most 32 sources");
+  }
+
+  for (size_t i = 0; i < nbSources_; i++) {
+    ports_.emplace_back( new Port(*this, i) );
+  }
+  stats.nbMissing.resize( nbSources_ );
+  stats.nbLate.resize( nbSources_ );
+
+  // Sources are blocked when the output does not keep up
+  built_.set_capacity( maxOrbits_ );
+
+  timer_ = std::thread( &EventBuilder::checkTimeouts, this );
+
+  LOG(TRACE) << "Created event builder for " << nbSources_ << " sources";
+}
+
+EventBuilder::~EventBuilder()
+{
+  stopTimer();
+
+  for (Slice *slice : ready_) {
+    slice->free();
+  }
+  for (auto& orbit : pending_) {
+    for (Slice *fragment : orbit.second.fragments) {
+      if (fragment) {
+        fragment->free();
+      }
+    }
+  }
+
+  Slice *slice;
+  while (built_.try_pop( slice )) {
+    if (slice) {
+      slice->free();
+    }
+  }
+}
+
+
+void EventBuilder::add( size_t source, Slice *packet )
+{
+  // Without any record there is no orbit number
+  if (packet->size() < record_header_size) {
+    std::lock_guard<std::mutex> guard( lock_ );
+    stats.nbEmpty++;
+    packet->free();
+    return;
+  }
+
+  std::vector<Slice*> fragments;
+  splitOrbits( packet, fragments );
+
+  {
+    std::lock_guard<std::mutex> guard( lock_ );
+    if (fragments.size() > 1) {
+      stats.nbSplit++;
+    }
+    for (Slice *fragment : fragments) {
+      insert( source, fragment );
+    }
+    buildReady( false );
+  }
+  push();
+}
+
+
+void EventBuilder::splitOrbits( Slice *packet, std::vector<Slice*>& fragments )
+{
+  // Start and number of muons of the records of each orbit
+  std::vector<const char*> starts;
+  std::vector<uint32_t> counts;
+  const char *p = packet->begin();
+  const char *end = packet->end();
+  while (size_t(end - p) >= record_header_size) {
+    if (starts.empty() || record_orbit(p) != record_orbit(starts.back())) {
+      starts.push_back( p );
+      counts.push_back( 0 );
+    }
+    counts.back() += record_muons( p );
+    p += std::min( record_size( p ), size_t(end - p) );
+  }
+
+  if (starts.size() == 1) {
+    fragments.push_back( packet );
+    return;
+  }
+
+  starts.push_back( end );
+  for (size_t i = 0; i < counts.size(); i++) {
+    size_t size = starts[i+1] - starts[i];
+    Slice *fragment = Slice::allocate( size );
+    memcpy( fragment->begin(), starts[i], size );
+    fragment->set_end( fragment->begin() + size );
+    fragment->set_counts( counts[i] );
+    fragments.push_back( fragment );
+  }
+  packet->free();
+}
+
+
+void EventBuilder::insert( size_t source, Slice *fragment )
+{
+  uint32_t orbit = record_orbit( fragment->begin() );
+
+  if (anyBuilt_ && orbit <= lastBuiltOrbit_) {
+    if (lastBuiltOrbit_ - orbit < resync_distance) {
+      // The orbit was already built without this fragment
+      stats.nbLate[source]++;
+      fragment->free();
+      return;
+    }
+    LOG(WARNING) << "Event builder: orbit counter of source " << source << " restarted at " << orbit
+                 << ", last built orbit " << lastBuiltOrbit_;
+    buildReady( true );
+    anyBuilt_ = false;
+    stats.nbResyncs++;
+  }
+
+  Orbit& pending = pending_[orbit];
+  if (pending.fragments.empty()) {
+    pending.fragments.resize( nbSources_, NULL );
+    pending.nbFragments = 0;
+    pending.arrival = tbb::tick_count::now();
+  }
+
+  if (pending.fragments[source]) {
+    // The same orbit twice from one source, keep the first one
+    stats.nbLate[source]++;
+    fragment->free();
+  } else {
+    pending.fragments[source] = fragment;
+    pending.nbFragments++;
+  }
+
+  stats.maxPending = pending_.size() > stats.maxPending ? pending_.size() : stats.maxPending;
+}
+
+
+void EventBuilder::buildReady( bool all )
+{
+  tbb::tick_count now = tbb::tick_count::now();
+
+  while (!pending_.empty()) {
+    auto oldest = pending_.begin();
+    Orbit& orbit = oldest->second;
+
+    bool complete = orbit.nbFragments == nbSources_;
+    bool overflow = pending_.size() > maxOrbits_;
+    bool timeout = (now - orbit.arrival).seconds() > timeoutSeconds_;
+    if (!(all || complete || overflow || timeout)) {
+      break;
+    }
+
+    if (!complete) {
+      stats.nbIncomplete++;
+      if (overflow) {
+        stats.nbOverflows++;
+      } else if (timeout) {
+        stats.nbTimeouts++;
+      }
+      for (size_t i = 0; i < nbSources_; i++) {
+        if (!orbit.fragments[i]) {
+          stats.nbMissing[i]++;
+        }
+      }
+    }
+
+    ready_.push_back( build( oldest->first, orbit ) );
+    anyBuilt_ = true;
+    lastBuiltOrbit_ = oldest->first;
+    pending_.erase( oldest );
+
+    stats.nbBuilt++;
+    if (control_.packets_per_report && (stats.nbBuilt % control_.packets_per_report == 0)) {
+      printStats();
+    }
+  }
+}
+
+
+Slice* EventBuilder::build( uint32_t orbit, Orbit& pending )
+{
+  // Fragment positions, a built record has a header in addition to the fragment records
+  std::vector<const char*> p( nbSources_, NULL );
+  std::vector<const char*> end( nbSources_, NULL );
+  size_t size = 0;
+  for (size_t i = 0; i < nbSources_; i++) {
+    if (pending.fragments[i]) {
+      p[i] = pending.fragments[i]->begin();
+      end[i] = pending.fragments[i]->end();
+      size += pending.fragments[i]->size();
+    }
+  }
+
+  // Each record has at least one muon, so headers add at most a half
+  Slice *out = Slice::allocate( size + size / 2 + record_header_size );
+  char *q = out->begin();
+  uint32_t counts = 0;
+
+  while (true) {
+    // Next bx present in any fragment, records are ordered by bx
+    bool found = false;
+    uint32_t bx = 0;
+    for (size_t i = 0; i < nbSources_; i++) {
+      if (p[i] != end[i] && (!found || record_bx(p[i]) < bx)) {
+        bx = record_bx( p[i] );
+        found = true;
+      }
+    }
+    if (!found) {
+      break;
+    }
+
+    uint32_t *header = reinterpret_cast<uint32_t *>( q );
+    q += record_header_size;
+    header[0] = 0;
+    header[2] = orbit;
+
+    for (size_t i = 0; i < nbSources_; i++) {
+      if (p[i] != end[i] && record_bx(p[i]) == bx) {
+        // Do not trust the record length beyond the end of the fragment
+        size_t n = std::min( record_size( p[i] ), size_t(end[i] - p[i]) );
+        header[0] |= 1u << i;
+        header[1] = record_words(p[i])[1];
+        memcpy( q, p[i], n );
+        q += n;
+        p[i] += n;
+      }
+    }
+  }
+
+  for (Slice *fragment : pending.fragments) {
+    if (fragment) {
+      counts += fragment->get_counts();
+      fragment->free();
+    }
+  }
+
+  out->set_end( q );
+  out->set_counts( counts );
+  return out;
+}
+
+
+void EventBuilder::push()
+{
+  std::lock_guard<std::mutex> order( pushLock_ );
+  for (;;) {
+    Slice *slice;
+    {
+      std::lock_guard<std::mutex> guard( lock_ );
+      if (ready_.empty()) {
+        return;
+      }
+      slice = ready_.front();
+      ready_.pop_front();
+    }
+    try {
+      built_.push( slice );
+    } catch (...) {
+      // The builder pipeline was aborted
+      slice->free();
+      throw;
+    }
+  }
+}
+
+
+void EventBuilder::checkTimeouts()
+{
+  // Orbits are built at most half the timeout late
+  std::chrono::microseconds period( std::max<int64_t>( timeoutSeconds_ * 500000, 1000 ) );
+
+  try {
+    std::unique_lock<std::mutex> guard( lock_ );
+    while (!stop_) {
+      wakeup_.wait_for( guard, period );
+      if (stop_) {
+        break;
+      }
+      buildReady( false );
+      guard.unlock();
+      push();
+      guard.lock();
+    }
+  } catch (const std::exception& e) {
+    // Aborted with the builder pipeline, which reports the error
+    LOG(DEBUG) << "Event builder timer stopped: " << e.what();
+  }
+}
+
+void EventBuilder::stopTimer()
+{
+  {
+    std::lock_guard<std::mutex> guard( lock_ );
+    stop_ = true;
+  }
+  wakeup_.notify_one();
+  if (timer_.joinable()) {
+    timer_.join();
+  }
+}
+
+
+void EventBuilder::finish()
+{
+  stopTimer();
+  {
+    std::lock_guard<std::mutex> guard( lock_ );
+    buildReady( true );
+    printStats();
+  }
+  push();
+  built_.push( NULL );
+}
+
+void EventBuilder::abort()
+{
+  built_.abort();
+}
+
+
+void* EventBuilder::operator()( void* )
+{
+  Slice *slice;
+  built_.pop( slice );
+  return slice;
+}
+
+
+void EventBuilder::printStats()
+{
+  std::ostringstream out;
+  out << "Event builder: built " << stats.nbBuilt << " orbit(s), incomplete " << stats.nbIncomplete
+      << " (timeout " << stats.nbTimeouts << ", overflow " << stats.nbOverflows << ")"
+      << ", empty " << stats.nbEmpty << ", split " << stats.nbSplit << ", resyncs " << stats.nbResyncs
+      << ", pending " << pending_.size() << " (max " << stats.maxPending << ")"
+      << ", missing/late per source";
+  for (size_t i = 0; i < nbSources_; i++) {
+    out << ' ' << stats.nbMissing[i] << '/' << stats.nbLate[i];
+  }
+  LOG(INFO) << out.str();
+}
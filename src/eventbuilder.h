@@ -0,0 +1,134 @@
+#ifndef EVENTBUILDER_H
+#define EVENTBUILDER_H
+
+/*
+ * Event builder merging the reformatted streams of several sources by orbit.
+ *
+ * Each source pipeline ends with a port, which hands the reformatted packets
+ * to the builder, a packet with several orbits is split into one fragment per
+ * orbit. Fragments of the same orbit are kept in a reorder buffer until all
+ * sources delivered them, until the oldest one waited longer than the timeout,
+ * or until the buffer holds more than the maximum number of orbits. A timer
+ * thread checks the timeout when no fragment arrives. Built orbits are read by
+ * a separate pipeline, which has the builder as its input stage.
+ *
+ * Built orbit format, one record for each bx with data from any source:
+ *   uint32_t sources    bit i is set if source i has data in this bx
+ *   uint32_t bx         bx word
+ *   uint32_t orbit
+ *   followed by the reformatted record (see StreamProcessor) of each source in the mask
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "tbb/concurrent_queue.h"
+#include "tbb/pipeline.h"
+#include "tbb/tick_count.h"
+
+#include "controls.h"
+
+class Slice;
+
+class EventBuilder: public tbb::filter {
+public:
+  EventBuilder( size_t nbSources, size_t maxOrbits, double timeoutSeconds, ctrl& control );
+  ~EventBuilder();
+
+  // Last stage of the pipeline of the given source
+  tbb::filter& port( size_t source ) { return *ports_[source]; }
+
+  // All sources ended, build the remaining orbits and end the builder pipeline
+  void finish();
+
+  // The builder pipeline failed, unblock the sources
+  void abort();
+
+  void* operator()( void* item ) /*override*/;
+
+private:
+  class Port: public tbb::filter {
+  public:
+    Port( EventBuilder& builder, size_t source );
+    void* operator()( void* item ) /*override*/;
+  private:
+    EventBuilder& builder_;
+    size_t source_;
+  };
+
+  // Fragments of one orbit received so far
+  struct Orbit {
+    std::vector<Slice*> fragments;
+    size_t nbFragments;
+    tbb::tick_count arrival;
+  };
+
+  void add( size_t source, Slice *packet );
+
+  // Split a packet with records of several orbits into one fragment per orbit
+  void splitOrbits( Slice *packet, std::vector<Slice*>& fragments );
+
+  // Add the fragment of one orbit to the reorder buffer, lock_ has to be held
+  void insert( size_t source, Slice *fragment );
+
+  // Build the oldest orbits that are complete, timed out or over the limit into ready_, lock_ has to be held
+  void buildReady( bool all );
+
+  // Pass the orbits of ready_ on to the builder pipeline, lock_ must not be held as it blocks when the output is full
+  void push();
+
+  // Timer thread building the timed out orbits when no fragment arrives
+  void checkTimeouts();
+  void stopTimer();
+
+  // Merge the fragments by bx into a new slice
+  Slice* build( uint32_t orbit, Orbit& fragments );
+
+  void printStats();
+
+private:
+  size_t nbSources_;
+  size_t maxOrbits_;
+  double timeoutSeconds_;
+  ctrl& control_;
+
+  std::vector< std::unique_ptr<Port> > ports_;
+
+  std::mutex lock_;
+  std::map<uint32_t, Orbit> pending_;
+  bool anyBuilt_;
+  uint32_t lastBuiltOrbit_;
+
+  // Built orbits waiting for push(), in orbit order, under lock_
+  std::deque<Slice*> ready_;
+  // Keeps the order of the orbits pushed by several threads
+  std::mutex pushLock_;
+
+  // Built orbits, NULL ends the builder pipeline
+  tbb::concurrent_bounded_queue<Slice*> built_;
+
+  std::thread timer_;
+  std::condition_variable wakeup_;
+  bool stop_;
+
+  struct Statistics {
+    uint64_t nbBuilt = 0;
+    uint64_t nbIncomplete = 0;
+    uint64_t nbTimeouts = 0;
+    uint64_t nbOverflows = 0;
+    uint64_t nbEmpty = 0;
+    uint64_t nbSplit = 0;
+    uint64_t nbResyncs = 0;
+    size_t maxPending = 0;
+    std::vector<uint64_t> nbMissing;
+    std::vector<uint64_t> nbLate;
+  } stats;
+};
+
+#endif // EVENTBUILDER_H
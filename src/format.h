@@ -124,10 +124,109 @@ struct gmt_scales{
   static constexpr float phi_range = M_PI;
 };
 
+// Block of the columnar output, the header is followed by the columns at the given offsets
+// from the start of the block, each one 32 byte aligned:
+//   uint32_t orbit[nb_records], bx[nb_records], header[nb_records]   (the words of the row format)
+//   uint32_t first[nb_records + 1]                                   (index of the first muon of each record)
+//   uint32_t mu_f[nb_muons], mu_s[nb_muons], mu_extra[nb_muons]      (muon words, A block then B block)
+struct columnar_header{
+  static constexpr uint32_t magic_number = 0x42435353; // "SSCB"
+  static constexpr uint16_t current_version = 1;
+  static constexpr uint32_t nb_columns = 7;
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t block_size;
+  uint32_t nb_orbits;
+  uint32_t nb_records;
+  uint32_t nb_muons;
+  uint32_t first_orbit;
+  uint32_t last_orbit;
+  uint32_t orbit_offset;
+  uint32_t bx_offset;
+  uint32_t header_offset;
+  uint32_t first_offset;
+  uint32_t mu_f_offset;
+  uint32_t mu_s_offset;
+  uint32_t mu_extra_offset;
+  uint32_t reserved;
+};
+
+// Block of the compact output, one per reformatted packet. The header is followed by the
+// records, see compact.h. The delta coding starts again in each block.
+struct compact_header{
+  static constexpr uint32_t magic_number = 0x43435353; // "SSCC"
+  static constexpr uint16_t current_version = 1;
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t block_size;
+  uint32_t nb_records;
+  uint32_t nb_muons;
+  uint32_t first_orbit;
+  uint32_t last_orbit;
+};
+
+// Header at the start of each output file. It is written again with the orbits and the
+// counts when the file is closed, COMPLETE is not set in a file which was not closed.
+// With TRAILER the data_size bytes of data are followed by a file_trailer.
+struct file_header{
+  static constexpr uint32_t magic_number = 0x46435353; // "SSCF"
+  static constexpr uint16_t current_version = 1;
+  // Layout of the muon words: 1 for the original format above, 2 for the current masks
+  static constexpr uint16_t current_data_version = 2;
+
+  // Format of the data
+  static constexpr uint16_t format_raw      = 0; // block1 data, without the stream processor
+  static constexpr uint16_t format_row      = 1;
+  static constexpr uint16_t format_columnar = 2;
+  static constexpr uint16_t format_compact  = 3;
+
+  // Flags
+  static constexpr uint16_t flag_zs       = 1 << 0;
+  static constexpr uint16_t flag_trailer  = 1 << 1;
+  static constexpr uint16_t flag_complete = 1 << 2;
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint16_t data_version;
+  uint16_t format;
+  uint16_t flags;
+  uint16_t reserved0;
+  uint32_t run_number;
+  uint32_t file_index;
+  uint32_t source_id;
+  uint32_t first_orbit;
+  uint32_t last_orbit;
+  uint32_t reserved1;
+  uint64_t nb_records;
+  uint64_t nb_muons;
+  uint64_t data_size;
+};
+
+// Trailer at the end of an output file, checksum is the CRC32C of the data
+struct file_trailer{
+  static constexpr uint32_t magic_number = 0x54435353; // "SSCT"
+  static constexpr uint16_t current_version = 1;
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t trailer_size;
+  uint32_t checksum;
+  uint32_t reserved0;
+  uint64_t data_size;
+  uint64_t reserved1;
+};
+
 struct constants{
   static constexpr uint32_t deadbeef           = 0xdeadbeef;
   static constexpr uint32_t intermediate_marker= 0x0000000f;
   static constexpr uint32_t orbit_trailer_size = 32;
+  // LHC revolution frequency in Hz, the orbit counter increments at this rate
+  static constexpr double orbit_frequency = 11245.5;
   static constexpr uint32_t intermediate       = 0x00000001;
   static constexpr uint32_t final              = 0x00000001;
 };
@@ -0,0 +1,76 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+/*
+ * Generator of synthetic scouting data in the format received from the board,
+ * i.e. orbits of block1 records each followed by a 32 byte orbit trailer.
+ * Used by the benchmarks, the data are reproducible from run to run.
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+#include "format.h"
+
+namespace generator {
+
+// Size of one orbit with the given number of bunch crossings
+inline size_t orbit_size(unsigned nbBx)
+{
+  return nbBx * sizeof(block1) + constants::orbit_trailer_size;
+}
+
+/*
+ * Write one orbit with nbBx bunch crossings into buffer, each bx carries nbMuons muons (0-16).
+ * The first 8 muons go into the mu1 words of links 0-7, the next 8 into the mu2 words.
+ * Returns the number of bytes written.
+ */
+inline size_t fill_orbit(char *buffer, uint32_t orbit, unsigned nbBx, unsigned nbMuons, uint32_t& seed)
+{
+  block1 *bl = reinterpret_cast<block1 *>( buffer );
+
+  for (unsigned bx = 0; bx < nbBx; bx++, bl++) {
+    for (unsigned i = 0; i < 8; i++) {
+      bl->orbit[i] = orbit;
+      bl->bx[i] = (bx * 3564 / nbBx) & masks::bx;
+
+      // Cheap LCG, we only need some variation in the muon words
+      seed = seed * 1664525 + 1013904223;
+      uint32_t pt = 1 + (seed >> 24) % masks::pt;
+      uint32_t word = (seed & ~(masks::pt << shifts::pt)) | (pt << shifts::pt);
+
+      bl->mu1f[i] = i < nbMuons ? word : 0;
+      bl->mu1s[i] = i < nbMuons ? seed ^ 0x5a5a5a5a : 0;
+      bl->mu2f[i] = i + 8 < nbMuons ? word ^ 0x3ff : 0;
+      bl->mu2s[i] = i + 8 < nbMuons ? seed ^ 0xa5a5a5a5 : 0;
+    }
+  }
+
+  // Orbit trailer as inserted by the firmware
+  uint64_t *trailer = reinterpret_cast<uint64_t *>( bl );
+  trailer[0] = 0xdeadbeefdeadbeef;
+  trailer[1] = 0;         // autorealign counter
+  trailer[2] = 0;         // dropped orbit counter
+  trailer[3] = orbit;     // orbit counter
+
+  return orbit_size(nbBx);
+}
+
+/*
+ * Fill buffer with as many complete orbits as fit into size bytes (at least one orbit has to fit).
+ * The orbit number is incremented for each orbit written.
+ * Returns the number of bytes written.
+ */
+inline size_t fill_packet(char *buffer, size_t size, uint32_t& orbit, unsigned nbBx, unsigned nbMuons, uint32_t& seed)
+{
+  size_t written = 0;
+  while (written + orbit_size(nbBx) <= size) {
+    written += fill_orbit(buffer + written, orbit++, nbBx, nbMuons, seed);
+  }
+  return written;
+}
+
+} // namespace generator
+
+#endif // GENERATOR_H
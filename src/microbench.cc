@@ -0,0 +1,312 @@
+/*
+ * Microbenchmarks of the reformatting and decoding hot paths.
+ *
+ * Input data are generated block1 orbits (see generator.h), swept over the
+ * occupancy (muons per bx), the packet size and software zero suppression.
+ * Throughput is reported in bytes/s of input data and time/bx is the time
+ * spent per bunch crossing.
+ *
+ * Build and run (numbers are only meaningful with optimization):
+ *   $ make clean bench CXXFLAGS='-std=c++11 -O2 -g'
+ *   $ ./scdaq-microbench
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "benchmark/benchmark.h"
+#include "tbb/pipeline.h"
+
+#include "FileDmaInputFilter.h"
+#include "compact.h"
+#include "controls.h"
+#include "elastico.h"
+#include "generator.h"
+#include "processor.h"
+#include "slice.h"
+#include "trailer.h"
+
+// All slices in the pool have the same size, the firmware needs at least 1MB
+static constexpr size_t packet_buffer_size = 1024*1024;
+static constexpr size_t nb_packet_buffers = 16;
+
+// Number of bx in one generated orbit when the packet size does not matter
+static constexpr unsigned bx_per_orbit = 3564;
+
+static const unsigned nb_muons_sweep[] = { 0, 1, 2, 4, 8, 16 };
+
+static void set_bx_counter(benchmark::State& state, uint64_t nbBx)
+{
+  state.counters["time/bx"] = benchmark::Counter(nbBx, benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+}
+
+// Fill a slice with one packet of generated data, the processor expects one orbit per packet
+static void make_packet(Slice *slice, unsigned nbBx, unsigned nbMuons)
+{
+  uint32_t seed = 12345;
+  size_t size = generator::fill_orbit(slice->begin(), 1, nbBx, nbMuons, seed);
+  slice->set_end( slice->begin() + size );
+}
+
+
+/*
+ * StreamProcessor::process
+ * Arguments: muons per bx, bx per packet (i.e. packet size), doZS
+ */
+static void BM_StreamProcessor(benchmark::State& state)
+{
+  unsigned nbMuons = state.range(0);
+  unsigned nbBx = state.range(1);
+  bool doZS = state.range(2);
+  size_t packetSize = generator::orbit_size(nbBx);
+
+  StreamProcessor processor(packetSize, doZS);
+  Slice *input = Slice::allocate( packetSize );
+  Slice *out = Slice::allocate( 2*packetSize );
+  make_packet( input, nbBx, nbMuons );
+
+  for (auto _ : state) {
+    out->set_end( out->begin() );
+    processor.process( *input, *out );
+    benchmark::DoNotOptimize( out->end() );
+  }
+
+  state.SetBytesProcessed( int64_t(state.iterations()) * input->size() );
+  set_bx_counter( state, nbBx );
+  state.counters["out/in"] = double(out->size()) / input->size();
+
+  input->free();
+  out->free();
+}
+
+static void stream_processor_args(benchmark::internal::Benchmark *b)
+{
+  for (int doZS = 0; doZS <= 1; doZS++) {
+    for (unsigned nbMuons : nb_muons_sweep) {
+      // Empty bx are reported (logged) as an error with ZS enabled, it would measure the logger
+      if (doZS && nbMuons == 0) {
+        continue;
+      }
+      for (int nbBx : { 64, 512, 3564 }) {
+        b->Args({ int(nbMuons), nbBx, doZS });
+      }
+    }
+  }
+}
+BENCHMARK(BM_StreamProcessor)->Apply(stream_processor_args);
+
+
+/*
+ * compact::encode and compact::decode_columns of a whole reformatted packet
+ * Arguments: muons per bx
+ */
+static void BM_CompactEncode(benchmark::State& state)
+{
+  unsigned nbMuons = state.range(0);
+  unsigned nbBx = bx_per_orbit;
+  size_t packetSize = generator::orbit_size(nbBx);
+
+  StreamProcessor processor(packetSize, true);
+  Slice *input = Slice::allocate( packetSize );
+  Slice *records = Slice::allocate( 2*packetSize );
+  make_packet( input, nbBx, nbMuons );
+  processor.process( *input, *records );
+  std::vector<char> block( compact::max_encoded_size(records->size()) );
+
+  size_t size = 0;
+  for (auto _ : state) {
+    size = compact::encode( records->begin(), records->end(), block.data() );
+    benchmark::DoNotOptimize( block.data() );
+  }
+
+  state.SetBytesProcessed( int64_t(state.iterations()) * records->size() );
+  set_bx_counter( state, nbBx );
+  state.counters["out/in"] = double(size) / records->size();
+
+  input->free();
+  records->free();
+}
+BENCHMARK(BM_CompactEncode)->DenseRange(1, 16, 5);
+
+static void BM_CompactDecodeColumns(benchmark::State& state)
+{
+  unsigned nbMuons = state.range(0);
+  unsigned nbBx = bx_per_orbit;
+  size_t packetSize = generator::orbit_size(nbBx);
+
+  StreamProcessor processor(packetSize, true);
+  Slice *input = Slice::allocate( packetSize );
+  Slice *records = Slice::allocate( 2*packetSize );
+  make_packet( input, nbBx, nbMuons );
+  processor.process( *input, *records );
+  std::vector<char> block( compact::max_encoded_size(records->size()) );
+  size_t size = compact::encode( records->begin(), records->end(), block.data() );
+
+  compact::Columns columns;
+  for (auto _ : state) {
+    if (!compact::decode_columns( block.data(), size, columns )) {
+      state.SkipWithError( "Invalid compact block" );
+      break;
+    }
+    benchmark::DoNotOptimize( columns.muF.data() );
+  }
+
+  state.SetBytesProcessed( int64_t(state.iterations()) * records->size() );
+  set_bx_counter( state, nbBx );
+
+  input->free();
+  records->free();
+}
+BENCHMARK(BM_CompactDecodeColumns)->DenseRange(1, 16, 5);
+
+
+/*
+ * ElasticProcessor::makeAppendToBulkRequest over a whole reformatted packet
+ * Arguments: muons per bx
+ */
+static void BM_ElasticAppendToBulk(benchmark::State& state)
+{
+  unsigned nbMuons = state.range(0);
+  unsigned nbBx = bx_per_orbit;
+  size_t packetSize = generator::orbit_size(nbBx);
+
+  ctrl control;
+  control.running = false;
+  ElasticProcessor elastic(packetSize, &control, "", 0, 0);
+  StreamProcessor processor(packetSize, true);
+
+  Slice *input = Slice::allocate( packetSize );
+  Slice *out = Slice::allocate( 2*packetSize );
+  make_packet( input, nbBx, nbMuons );
+  processor.process( *input, *out );
+
+  for (auto _ : state) {
+    std::ostringstream particle_data;
+    char *p = out->begin();
+    while (p != out->end()) {
+      p = elastic.makeAppendToBulkRequest( particle_data, p );
+    }
+    benchmark::DoNotOptimize( particle_data );
+  }
+
+  state.SetBytesProcessed( int64_t(state.iterations()) * out->size() );
+  set_bx_counter( state, nbBx );
+
+  input->free();
+  out->free();
+}
+BENCHMARK(BM_ElasticAppendToBulk)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Arg(16);
+
+
+/*
+ * Resynchronization: search for the orbit trailer at every 32-bit word, as done on corrupted data
+ * Arguments: bx per orbit (i.e. distance between the trailers)
+ */
+static void BM_TrailerScan(benchmark::State& state)
+{
+  unsigned nbBx = state.range(0);
+  Slice *input = Slice::allocate( packet_buffer_size );
+  uint32_t orbit = 1;
+  uint32_t seed = 12345;
+  size_t size = generator::fill_packet( input->begin(), packet_buffer_size, orbit, nbBx, 8, seed );
+  input->set_end( input->begin() + size );
+
+  for (auto _ : state) {
+    const char *p = input->begin();
+    while (p != input->end()) {
+      p = trailer::find( p, input->end() );
+      p = (p == input->end()) ? p : p + constants::orbit_trailer_size;
+    }
+    benchmark::DoNotOptimize( p );
+  }
+
+  state.SetBytesProcessed( int64_t(state.iterations()) * input->size() );
+  input->free();
+}
+BENCHMARK(BM_TrailerScan)->Arg(16)->Arg(512)->Arg(3564);
+
+
+/*
+ * Slice pool get/give, contended by several threads
+ */
+static void BM_SlicePool(benchmark::State& state)
+{
+  if (state.thread_index() == 0) {
+    Slice::giveAllocated( Slice::preAllocate(packet_buffer_size, nb_packet_buffers) );
+  }
+
+  for (auto _ : state) {
+    Slice *slice = Slice::getAllocated();
+    benchmark::DoNotOptimize( slice );
+    Slice::giveAllocated( slice );
+  }
+
+  state.SetItemsProcessed( state.iterations() );
+}
+BENCHMARK(BM_SlicePool)->ThreadRange(1, 8)->UseRealTime();
+
+
+/*
+ * Packet reading from a file including the trailer scan in read_dma_packet_from_file.
+ * Each orbit is followed by a trailer, i.e. one packet is one orbit.
+ * Arguments: muons per bx, bx per orbit
+ */
+static void BM_FileDmaRead(benchmark::State& state)
+{
+  unsigned nbMuons = state.range(0);
+  unsigned nbBx = state.range(1);
+
+  // Generate about 64 MB of data, it should stay in the page cache
+  char fileName[] = "/tmp/scdaq-microbench-XXXXXX";
+  int fd = mkstemp( fileName );
+  if (fd < 0) {
+    state.SkipWithError("Cannot create temporary file");
+    return;
+  }
+
+  Slice *slice = Slice::allocate( packet_buffer_size );
+  uint32_t orbit = 1;
+  uint32_t seed = 12345;
+  for (size_t written = 0; written < 64*1024*1024; ) {
+    size_t size = generator::fill_packet( slice->begin(), packet_buffer_size, orbit, nbBx, nbMuons, seed );
+    if (write( fd, slice->begin(), size ) != (ssize_t)size) {
+      state.SkipWithError("Cannot write temporary file");
+      break;
+    }
+    written += size;
+  }
+  slice->free();
+  close( fd );
+
+  ctrl control;
+  control.running = false;
+  control.packets_per_report = 0;
+  control.overload_policy = OverloadPolicy::BLOCK;
+  control.overload_spill_buffers = 0;
+
+  {
+    FileDmaInputFilter input( fileName, packet_buffer_size, nb_packet_buffers, control );
+    tbb::filter& filter = input;
+    uint64_t bytesRead = 0;
+
+    for (auto _ : state) {
+      Slice *packet = static_cast<Slice *>( filter(NULL) );
+      bytesRead += packet->size();
+      Slice::giveAllocated( packet );
+    }
+
+    state.SetBytesProcessed( bytesRead );
+    set_bx_counter( state, nbBx );
+  }
+
+  unlink( fileName );
+}
+BENCHMARK(BM_FileDmaRead)->ArgsProduct({ { 1, 8, 16 }, { 16, 128, 1024, 3564 } });
+
+
+BENCHMARK_MAIN();
@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <bzlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "log.h"
+#include "mover.h"
+#include "output.h"
+#include "tools.h"
+
+// Files which are not closed yet
+static const std::string working_dir { "in_progress" };
+
+static constexpr size_t buffer_size = 1 << 20;
+
+// Copies of a file written before giving up when they do not match the metadata
+static constexpr unsigned max_attempts = 3;
+
+static std::string directory_of( const std::string& path )
+{
+  size_t slash = path.rfind( '/' );
+  return slash == std::string::npos ? "." : path.substr( 0, slash );
+}
+
+static bool ends_with( const std::string& s, const std::string& end )
+{
+  return s.size() >= end.size() && s.compare( s.size() - end.size(), end.size(), end ) == 0;
+}
+
+// The path below the directory, empty if it is not inside
+static std::string relative_to( const std::string& path, const std::string& directory )
+{
+  if (path.compare( 0, directory.size() + 1, directory + "/" ) != 0) {
+    return "";
+  }
+  return path.substr( directory.size() + 1 );
+}
+
+// Size and CRC32C of a file
+static bool checksum_file( const std::string& fileName, uint64_t& size, uint32_t& crc, std::string& error )
+{
+  FILE *file = fopen( fileName.c_str(), "r" );
+  if (file == NULL) {
+    error = tools::strerror( "Can't open '" + fileName + "'" );
+    return false;
+  }
+  std::vector<char> buffer( buffer_size );
+  size = 0;
+  crc = 0;
+  size_t n;
+  while ((n = fread( buffer.data(), 1, buffer.size(), file )) > 0) {
+    crc = checksum::crc32c( crc, buffer.data(), n );
+    size += n;
+  }
+  bool ok = !ferror( file );
+  fclose( file );
+  if (!ok) {
+    error = "Can't read '" + fileName + "'";
+  }
+  return ok;
+}
+
+// Size and CRC32C of the data of a bzip2 file
+static bool checksum_bzip2_file( const std::string& fileName, uint64_t& size, uint32_t& crc, std::string& error )
+{
+  FILE *file = fopen( fileName.c_str(), "r" );
+  if (file == NULL) {
+    error = tools::strerror( "Can't open '" + fileName + "'" );
+    return false;
+  }
+  int status;
+  BZFILE *bz = BZ2_bzReadOpen( &status, file, 0, 0, NULL, 0 );
+  std::vector<char> buffer( buffer_size );
+  size = 0;
+  crc = 0;
+  while (status == BZ_OK) {
+    int n = BZ2_bzRead( &status, bz, buffer.data(), buffer.size() );
+    if (status == BZ_OK || status == BZ_STREAM_END) {
+      crc = checksum::crc32c( crc, buffer.data(), n );
+      size += n;
+    }
+  }
+  int closeStatus;
+  BZ2_bzReadClose( &closeStatus, bz );
+  fclose( file );
+  if (status != BZ_STREAM_END) {
+    error = "Can't decompress '" + fileName + "': bzip2 error " + std::to_string(status);
+    return false;
+  }
+  return true;
+}
+
+
+FileMover::FileMover( const std::string& name, const std::vector<std::string>& outputDirectories, const std::string& destination,
+                      unsigned nbThreads, Compression compression, ctrl& control ) :
+    name_(name),
+    destination_(destination),
+    compression_(compression),
+    control_(control),
+    queuedBytes_(0),
+    stop_(false)
+{
+  if (!tools::filesystem::create_directories( destination_ )) {
+    throw std::runtime_error( tools::strerror("ERROR when creating the mover destination '" + destination_ + "'") );
+  }
+
+  std::string directories;
+  for (std::string directory : outputDirectories) {
+    while (directory.size() > 1 && directory.back() == '/') {
+      directory.pop_back();
+    }
+    // Below the first directory the relative path already tells them apart
+    std::string subdirectory;
+    if (!outputDirectories_.empty()) {
+      if (!relative_to( directory, outputDirectories_.front().first ).empty() || directory == outputDirectories_.front().first) {
+        continue;
+      }
+      subdirectory = directory.substr( directory.rfind('/') + 1 );
+    }
+    outputDirectories_.emplace_back( directory, subdirectory );
+    directories += (directories.empty() ? "" : ", ") + directory;
+
+    // Files closed before a restart
+    scan( directory );
+  }
+  std::sort( queue_.begin(), queue_.end(), []( const File& a, const File& b ) { return a.name < b.name; } );
+  if (!queue_.empty()) {
+    LOG(INFO) << '[' << name_ << "] " << queue_.size() << " file(s) left in " << directories;
+  }
+
+  for (unsigned i = 0; i < std::max( nbThreads, 1u ); i++) {
+    threads_.emplace_back( &FileMover::work, this );
+  }
+  control_.set_file_mover( [this]( const std::string& fileName ) { add( fileName ); } );
+  control_.add_stats( name_, [this]() { return report(); } );
+  LOG(INFO) << '[' << name_ << "] Moving files from " << directories << " to " << destination_ << " with " << threads_.size() << " thread(s)"
+            << (compression_ == Compression::BZIP2 ? ", bzip2" : "");
+}
+
+FileMover::~FileMover()
+{
+  control_.set_file_mover( nullptr );
+  control_.remove_stats( name_ );
+  {
+    std::lock_guard<std::mutex> guard( lock_ );
+    stop_ = true;
+  }
+  wakeup_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+  LOG(INFO) << '[' << name_ << "] " << report();
+}
+
+
+void FileMover::add( const std::string& fileName )
+{
+  struct stat sb;
+  File file { fileName, stat( fileName.c_str(), &sb ) == 0 ? (uint64_t)sb.st_size : 0, tbb::tick_count::now() };
+  {
+    std::lock_guard<std::mutex> guard( lock_ );
+    queue_.push_back( file );
+    queuedBytes_ += file.size;
+  }
+  wakeup_.notify_one();
+}
+
+
+void FileMover::scan( const std::string& directory )
+{
+  DIR *dir = opendir( directory.c_str() );
+  if (dir == NULL) {
+    return;
+  }
+  while (struct dirent *entry = readdir( dir )) {
+    std::string name = entry->d_name;
+    std::string path = directory + "/" + name;
+    struct stat sb;
+    // Symbolic links are not followed, they could lead into a loop
+    if (name[0] == '.' || name == working_dir || lstat( path.c_str(), &sb ) != 0) {
+      continue;
+    }
+    if (S_ISDIR(sb.st_mode)) {
+      scan( path );
+    } else if (S_ISREG(sb.st_mode) && ends_with( name, ".dat" ) && access( metadata_file_name(path).c_str(), R_OK ) == 0) {
+      queue_.push_back( File { path, (uint64_t)sb.st_size, tbb::tick_count::now() } );
+      queuedBytes_ += sb.st_size;
+    }
+  }
+  closedir( dir );
+}
+
+
+void FileMover::work()
+{
+  for (;;) {
+    File file;
+    {
+      std::unique_lock<std::mutex> guard( lock_ );
+      wakeup_.wait( guard, [this]() { return stop_ || !queue_.empty(); } );
+      if (stop_) {
+        return;
+      }
+      file = queue_.front();
+      queue_.pop_front();
+      stats.nbActive++;
+    }
+
+    std::string error;
+    bool moved = move( file, error );
+    double latency = (tbb::tick_count::now() - file.closed).seconds();
+
+    {
+      std::lock_guard<std::mutex> guard( lock_ );
+      queuedBytes_ -= file.size;
+      stats.nbActive--;
+      if (moved) {
+        stats.lastLatency = latency;
+        stats.maxLatency = std::max( stats.maxLatency, latency );
+        stats.sumLatency += latency;
+      }
+    }
+    if (moved) {
+      stats.nbMoved++;
+      LOG(DEBUG) << '[' << name_ << "] Moved " << file.name << " after " << latency << " s";
+    } else {
+      stats.nbFailed++;
+      LOG(ERROR) << '[' << name_ << "] Can't move " << file.name << ": " << error;
+    }
+  }
+}
+
+
+bool FileMover::move( const File& file, std::string& error )
+{
+  uint64_t size;
+  uint32_t crc;
+  if (!read_file_metadata( file.name, size, crc, error )) {
+    return false;
+  }
+
+  std::string path = destinationPath( file.name );
+  std::string target = path + (compression_ == Compression::BZIP2 ? ".bz2" : "");
+  std::string targetDirectory = directory_of( target );
+  if (!tools::filesystem::create_directories( targetDirectory )) {
+    error = tools::strerror( "Can't create '" + targetDirectory + "'" );
+    return false;
+  }
+
+  // Written under a temporary name and checked. A bad copy is written again, unless the
+  // file itself does not match the metadata, then it is corrupted and stays on the ramdisk.
+  std::string part = target + ".part";
+  for (unsigned attempt = 1; ; attempt++) {
+    bool written;
+    uint64_t dataSize = 0;
+    uint32_t dataCrc = 0;
+    if (compression_ == Compression::BZIP2) {
+      written = compress( file.name, part, error ) && checksum_bzip2_file( part, dataSize, dataCrc, error );
+    } else {
+      written = copy( file.name, part, error ) && checksum_file( part, dataSize, dataCrc, error );
+    }
+    if (!written) {
+      unlink( part.c_str() );
+      return false;
+    }
+    if (dataSize == size && dataCrc == crc) {
+      break;
+    }
+    unlink( part.c_str() );
+
+    uint64_t sourceSize = 0;
+    uint32_t sourceCrc = 0;
+    if (!checksum_file( file.name, sourceSize, sourceCrc, error )) {
+      return false;
+    }
+    std::ostringstream out;
+    if (sourceSize != size || sourceCrc != crc) {
+      out << "Size " << sourceSize << ", CRC32C " << std::hex << sourceCrc << " instead of " << std::dec << size << ", " << std::hex << crc;
+      error = out.str();
+      if (rename( file.name.c_str(), (file.name + ".corrupted").c_str() ) == 0) {
+        error += ", kept as " + file.name + ".corrupted";
+      }
+      return false;
+    }
+    out << "Copy has size " << dataSize << ", CRC32C " << std::hex << dataCrc << " instead of " << std::dec << size << ", " << std::hex << crc;
+    error = out.str();
+    if (attempt == max_attempts) {
+      error += ", giving up after " + std::to_string( max_attempts ) + " attempts";
+      return false;
+    }
+    stats.nbRetried++;
+    LOG(WARNING) << '[' << name_ << "] " << error << ", copying " << file.name << " again";
+  }
+  struct stat sb;
+  stats.nbBytesRead += size;
+  stats.nbBytesWritten += stat( part.c_str(), &sb ) == 0 ? sb.st_size : 0;
+
+  // The metadata are in place before the file, as in the output directory
+  std::string metadata = metadata_file_name( path );
+  if (!copy( metadata_file_name(file.name), metadata + ".part", error )) {
+    unlink( part.c_str() );
+    return false;
+  }
+  if (rename( (metadata + ".part").c_str(), metadata.c_str() ) != 0 || rename( part.c_str(), target.c_str() ) != 0) {
+    error = tools::strerror( "Can't rename to '" + target + "'" );
+    unlink( part.c_str() );
+    return false;
+  }
+
+  if (unlink( file.name.c_str() ) != 0 || unlink( metadata_file_name(file.name).c_str() ) != 0) {
+    LOG(WARNING) << '[' << name_ << "] " << tools::strerror( "Can't delete " + file.name );
+  }
+  return true;
+}
+
+
+std::string FileMover::destinationPath( const std::string& fileName ) const
+{
+  // Same path relative to the output directory
+  for (const auto& directory : outputDirectories_) {
+    std::string relative = relative_to( fileName, directory.first );
+    if (!relative.empty()) {
+      return destination_ + "/" + (directory.second.empty() ? "" : directory.second + "/") + relative;
+    }
+  }
+  return destination_ + "/" + fileName.substr( fileName.rfind('/') + 1 );
+}
+
+
+bool FileMover::copy( const std::string& source, const std::string& target, std::string& error )
+{
+  int in = open( source.c_str(), O_RDONLY );
+  if (in < 0) {
+    error = tools::strerror( "Can't open '" + source + "'" );
+    return false;
+  }
+  int out = open( target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+  if (out < 0) {
+    error = tools::strerror( "Can't create '" + target + "'" );
+    close( in );
+    return false;
+  }
+
+  // In the kernel, copy_file_range may not work across file systems then sendfile does
+  bool useSendfile = false;
+  bool ok = true;
+  for (;;) {
+    ssize_t n = useSendfile ? sendfile( out, in, NULL, buffer_size ) : copy_file_range( in, NULL, out, NULL, buffer_size, 0 );
+    if (n < 0 && !useSendfile && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      useSendfile = true;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      error = tools::strerror( "Can't copy '" + source + "' to '" + target + "'" );
+      ok = false;
+    }
+    if (n <= 0) {
+      break;
+    }
+  }
+  close( in );
+  if (close( out ) != 0 && ok) {
+    error = tools::strerror( "Can't write '" + target + "'" );
+    ok = false;
+  }
+  return ok;
+}
+
+
+bool FileMover::compress( const std::string& source, const std::string& target, std::string& error )
+{
+  FILE *in = fopen( source.c_str(), "r" );
+  if (in == NULL) {
+    error = tools::strerror( "Can't open '" + source + "'" );
+    return false;
+  }
+  FILE *out = fopen( target.c_str(), "w" );
+  if (out == NULL) {
+    error = tools::strerror( "Can't create '" + target + "'" );
+    fclose( in );
+    return false;
+  }
+
+  int status;
+  BZFILE *bz = BZ2_bzWriteOpen( &status, out, 9, 0, 0 );
+  std::vector<char> buffer( buffer_size );
+  size_t n;
+  while (status == BZ_OK && (n = fread( buffer.data(), 1, buffer.size(), in )) > 0) {
+    BZ2_bzWrite( &status, bz, buffer.data(), n );
+  }
+  bool ok = status == BZ_OK && !ferror( in );
+  BZ2_bzWriteClose64( &status, bz, 0, NULL, NULL, NULL, NULL );
+  ok = ok && status == BZ_OK;
+  fclose( in );
+  if (fclose( out ) != 0 || !ok) {
+    error = "Can't compress '" + source + "' to '" + target + "'";
+    return false;
+  }
+  return true;
+}
+
+
+std::string FileMover::report()
+{
+  std::lock_guard<std::mutex> guard( lock_ );
+  std::ostringstream out;
+  out << "moved " << stats.nbMoved << ", failed " << stats.nbFailed << ", copied again " << stats.nbRetried
+      << ", read " << stats.nbBytesRead / 1000000 << " MB, written " << stats.nbBytesWritten / 1000000 << " MB"
+      << "; backlog " << queue_.size() + stats.nbActive << " files, " << queuedBytes_ / 1000000 << " MB"
+      << "; time on ramdisk last " << stats.lastLatency << " s, mean " << (stats.nbMoved ? stats.sumLatency / stats.nbMoved : 0)
+      << " s, max " << stats.maxLatency << " s";
+  return out.str();
+}
@@ -0,0 +1,103 @@
+#ifndef MOVER_H
+#define MOVER_H
+
+/*
+ * Moves the closed output files from the ramdisk to the destination directory.
+ *
+ * The output streams pass each file when they close it (see ctrl::move_file), it is
+ * queued for a pool of threads. A thread checks the file against its metadata
+ * (<file>.json), copies it with copy_file_range (or sendfile across file systems)
+ * or compresses it with bzip2 to <file>.bz2, checks the copy, or the decompressed
+ * data, against the metadata again and then moves the metadata and deletes both
+ * originals. A copy failing the check is written again, up to three times, unless
+ * the file itself does not match its metadata, then it is renamed to <file>.corrupted
+ * and left in place.
+ *
+ * The files keep their path relative to the output directory they are written to.
+ * Those of the first one go to the destination itself, those of the others, like the
+ * reduced stream, to a subdirectory named after their last path component, unless
+ * they are inside the first one.
+ *
+ * At startup the files left in the output directories and all their subdirectories are
+ * queued. When the process ends the queued files which are not being moved stay
+ * in place for the next start. The statistics report the backlog and the time
+ * each file spent on the ramdisk after it was closed.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "tbb/tick_count.h"
+
+#include "controls.h"
+
+class FileMover {
+public:
+  enum class Compression { NONE, BZIP2 };
+
+  // Throws std::runtime_error if the destination cannot be created
+  FileMover( const std::string& name, const std::vector<std::string>& outputDirectories, const std::string& destination,
+             unsigned nbThreads, Compression compression, ctrl& control );
+  ~FileMover();
+
+  // Queue a closed output file
+  void add( const std::string& fileName );
+
+private:
+  struct File {
+    std::string name;
+    uint64_t size;
+    tbb::tick_count closed;
+  };
+
+  void work();
+  // Move one file, returns false with the reason in error if it failed
+  bool move( const File& file, std::string& error );
+  bool copy( const std::string& source, const std::string& target, std::string& error );
+  bool compress( const std::string& source, const std::string& target, std::string& error );
+
+  // Files left from a previous run
+  void scan( const std::string& directory );
+
+  // Path of the file in the destination, without the compression suffix
+  std::string destinationPath( const std::string& fileName ) const;
+
+  std::string report();
+
+private:
+  std::string name_;
+  // Output directories and their subdirectory in the destination
+  std::vector< std::pair<std::string, std::string> > outputDirectories_;
+  std::string destination_;
+  Compression compression_;
+  ctrl& control_;
+
+  std::mutex lock_;
+  std::condition_variable wakeup_;
+  std::deque<File> queue_;
+  uint64_t queuedBytes_;
+  bool stop_;
+  std::vector<std::thread> threads_;
+
+  struct Statistics {
+    std::atomic<uint64_t> nbMoved{0};
+    std::atomic<uint64_t> nbFailed{0};
+    std::atomic<uint64_t> nbRetried{0};
+    std::atomic<uint64_t> nbBytesRead{0};
+    std::atomic<uint64_t> nbBytesWritten{0};
+    std::atomic<unsigned> nbActive{0};
+    // Time on the ramdisk, under lock_
+    double lastLatency = 0;
+    double maxLatency = 0;
+    double sumLatency = 0;
+  } stats;
+};
+
+#endif // MOVER_H
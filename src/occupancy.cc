@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+
+#include "occupancy.h"
+#include "format.h"
+#include "slice.h"
+#include "log.h"
+
+// A larger step back of the orbit number is a new run or a reset
+static constexpr uint64_t restart_distance = 1 << 20;
+
+// The histograms of a thread are added to the ring at least this often
+static constexpr double flush_seconds = 1;
+
+// Size of the header of a reformatted record (header, bx, orbit)
+static constexpr size_t record_header_size = 3 * sizeof(uint32_t);
+
+// Bound to a reference by the log stream in the constructor
+constexpr unsigned OccupancyMonitor::nb_segments;
+
+
+OccupancyMonitor::OccupancyMonitor( const std::string& name, uint32_t windowOrbits, ctrl& control ) :
+    tbb::filter(parallel),
+    name_(name),
+    segmentOrbits_( std::max<uint32_t>(windowOrbits / nb_segments, 1) ),
+    control_(control),
+    ring_(nb_segments),
+    anySegment_(false),
+    latestSegment_(0)
+{
+  control_.add_stats( name_, [this]() { return report(); } );
+  control_.add_occupancy( name_, [this]() { return snapshot(); } );
+  LOG(TRACE) << "Created occupancy monitor " << name_ << " with " << nb_segments << " segments of " << segmentOrbits_ << " orbits";
+}
+
+OccupancyMonitor::~OccupancyMonitor()
+{
+  control_.remove_occupancy( name_ );
+  control_.remove_stats( name_ );
+
+  // The pipeline is done, the histograms of all threads can be merged
+  for (Accumulator& acc : local_) {
+    if (acc.used) {
+      flush( acc );
+    }
+  }
+  LOG(INFO) << '[' << name_ << "] " << report();
+}
+
+
+void OccupancyMonitor::fill( const char *p, const char *end, Accumulator& acc )
+{
+  while (end - p >= (ptrdiff_t)record_header_size) {
+    const uint32_t *words = reinterpret_cast<const uint32_t *>( p );
+    uint32_t mAcount = (words[0] & header_masks::mAcount) >> header_shifts::mAcount;
+    uint32_t mBcount = (words[0] & header_masks::mBcount) >> header_shifts::mBcount;
+    uint32_t bx = (words[1] >> shifts::bx) & masks::bx;
+    uint32_t orbit = words[2];
+    const muon *mu = reinterpret_cast<const muon *>( p + record_header_size );
+    p += record_header_size + (mAcount + mBcount) * sizeof(muon);
+    if (p > end) {
+      break;
+    }
+
+    // The histograms of a thread hold one segment of orbits
+    uint64_t segment = orbit / segmentOrbits_;
+    if (acc.used && segment != acc.segment) {
+      flush( acc );
+    }
+    if (!acc.used) {
+      acc.used = true;
+      acc.segment = segment;
+      acc.since = tbb::tick_count::now();
+    }
+    acc.lastOrbit = std::max( acc.lastOrbit, orbit );
+
+    if (bx >= nb_bx) {
+      acc.nbOutOfRange++;
+      continue;
+    }
+    for (uint32_t i = 0; i < mAcount + mBcount; i++) {
+      uint32_t pt = (mu[i].f >> shifts::pt) & masks::pt;
+      uint32_t qual = (mu[i].f >> shifts::qual) & masks::qual;
+      // Without zero suppression the empty muons are in the data
+      if (pt == 0) {
+        continue;
+      }
+      acc.histograms.muons[bx]++;
+      acc.histograms.sumPt[bx] += pt;
+      acc.histograms.sumQual[bx] += qual;
+      acc.histograms.highQual[bx] += qual >= high_quality;
+      acc.nbMuons++;
+    }
+  }
+}
+
+
+void OccupancyMonitor::flush( Accumulator& acc )
+{
+  std::lock_guard<std::mutex> guard( lock_ );
+  stats.nbFlushes++;
+  stats.nbMuons += acc.nbMuons;
+  stats.nbOutOfRange += acc.nbOutOfRange;
+
+  bool keep = true;
+  if (!anySegment_ || acc.segment > latestSegment_) {
+    anySegment_ = true;
+    latestSegment_ = acc.segment;
+  } else if (latestSegment_ - acc.segment >= nb_segments) {
+    if ((latestSegment_ - acc.segment) * segmentOrbits_ > restart_distance) {
+      // The orbit counter restarted, the window starts again
+      for (Segment& s : ring_) {
+        s.used = false;
+      }
+      latestSegment_ = acc.segment;
+      stats.nbRestarts++;
+    } else {
+      // Out of the window already
+      stats.nbLate++;
+      keep = false;
+    }
+  }
+
+  if (keep) {
+    Segment& s = ring_[acc.segment % nb_segments];
+    if (!s.used || s.segment != acc.segment) {
+      s.used = true;
+      s.segment = acc.segment;
+      s.lastOrbit = 0;
+      s.histograms.clear();
+    }
+    s.lastOrbit = std::max( s.lastOrbit, acc.lastOrbit );
+    for (unsigned bx = 0; bx < nb_bx; bx++) {
+      s.histograms.muons[bx] += acc.histograms.muons[bx];
+      s.histograms.sumPt[bx] += acc.histograms.sumPt[bx];
+      s.histograms.sumQual[bx] += acc.histograms.sumQual[bx];
+      s.histograms.highQual[bx] += acc.histograms.highQual[bx];
+    }
+  }
+
+  acc.used = false;
+  acc.lastOrbit = 0;
+  acc.nbMuons = 0;
+  acc.nbOutOfRange = 0;
+  acc.histograms.clear();
+}
+
+
+void* OccupancyMonitor::operator()( void* item )
+{
+  Slice *slice = static_cast<Slice*>( item );
+  Accumulator& acc = local_.local();
+
+  fill( slice->begin(), slice->end(), acc );
+
+  if (acc.used && (tbb::tick_count::now() - acc.since).seconds() >= flush_seconds) {
+    flush( acc );
+  }
+  return slice;
+}
+
+
+std::string OccupancyMonitor::snapshot()
+{
+  std::unique_ptr< Histograms<uint64_t> > sum( new Histograms<uint64_t>() );
+  uint32_t firstOrbit = 0;
+  uint32_t lastOrbit = 0;
+  unsigned nbSegments = 0;
+  {
+    std::lock_guard<std::mutex> guard( lock_ );
+    for (const Segment& s : ring_) {
+      if (!s.used || s.segment > latestSegment_ || latestSegment_ - s.segment >= nb_segments) {
+        continue;
+      }
+      uint32_t first = s.segment * segmentOrbits_;
+      firstOrbit = nbSegments ? std::min( firstOrbit, first ) : first;
+      lastOrbit = std::max( lastOrbit, s.lastOrbit );
+      nbSegments++;
+      for (unsigned bx = 0; bx < nb_bx; bx++) {
+        sum->muons[bx] += s.histograms.muons[bx];
+        sum->sumPt[bx] += s.histograms.sumPt[bx];
+        sum->sumQual[bx] += s.histograms.sumQual[bx];
+        sum->highQual[bx] += s.histograms.highQual[bx];
+      }
+    }
+  }
+
+  uint64_t nbMuons = 0;
+  unsigned nbFilled = 0;
+  for (unsigned bx = 0; bx < nb_bx; bx++) {
+    nbMuons += sum->muons[bx];
+    nbFilled += sum->muons[bx] != 0;
+  }
+  uint64_t nbOrbits = nbSegments ? lastOrbit - firstOrbit + 1 : 0;
+
+  std::ostringstream out;
+  out << "orbits " << firstOrbit << '-' << lastOrbit << " (" << nbOrbits << "), muons " << nbMuons
+      << std::fixed << std::setprecision(1)
+      << " (" << (nbOrbits ? nbMuons * constants::orbit_frequency / nbOrbits : 0.) << " Hz)"
+      << ", filled bx " << nbFilled << "; bx muons mean_pt mean_qual high_qual";
+
+  // Only the filled bx, mean pt in GeV
+  for (unsigned bx = 0; bx < nb_bx; bx++) {
+    uint64_t n = sum->muons[bx];
+    if (n) {
+      out << '\n' << bx << ' ' << n << ' '
+          << std::setprecision(2) << ((double)sum->sumPt[bx] / n - 1) * gmt_scales::pt_scale << ' '
+          << (double)sum->sumQual[bx] / n << ' ' << sum->highQual[bx];
+    }
+  }
+  return out.str();
+}
+
+
+std::string OccupancyMonitor::report()
+{
+  std::lock_guard<std::mutex> guard( lock_ );
+  std::ostringstream out;
+  out << "segments of " << segmentOrbits_ << " orbits, latest " << latestSegment_
+      << "; muons " << stats.nbMuons << ", bx out of range " << stats.nbOutOfRange
+      << ", merges " << stats.nbFlushes << ", late " << stats.nbLate << ", restarts " << stats.nbRestarts;
+  return out.str();
+}
@@ -0,0 +1,100 @@
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+/*
+ * Per bunch crossing occupancy of the reformatted data over a sliding window of orbits.
+ *
+ * The window is divided into segments of consecutive orbit numbers. Each thread fills
+ * its own histograms for the segment of the packets it processes and adds them to a ring
+ * of segments when the orbits move to the next segment, or at least once per second.
+ * The run control command "occupancy" returns the sum of the segments in the window:
+ * the number of muons, their mean pt and quality and the number of high quality muons
+ * for each non-empty bx. The histograms of a thread are merged only when it processes
+ * the next packet, so the snapshot can miss the last second of an idle thread.
+ */
+
+#include <cstring>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/pipeline.h"
+#include "tbb/tick_count.h"
+
+#include "controls.h"
+
+class OccupancyMonitor: public tbb::filter {
+public:
+  OccupancyMonitor( const std::string& name, uint32_t windowOrbits, ctrl& control );
+  ~OccupancyMonitor();
+
+  void* operator()( void* item ) /*override*/;
+
+  static constexpr unsigned nb_bx = 3564;
+  static constexpr unsigned nb_segments = 16;
+  // Muons with at least this quality are counted as high quality
+  static constexpr uint32_t high_quality = 12;
+
+private:
+  // Histograms of one segment of the window
+  template<typename T>
+  struct Histograms {
+    T muons[nb_bx] = {};
+    T sumPt[nb_bx] = {};
+    T sumQual[nb_bx] = {};
+    T highQual[nb_bx] = {};
+
+    void clear() { memset( this, 0, sizeof(*this) ); }
+  };
+
+  // Filled by one thread
+  struct Accumulator {
+    bool used = false;
+    uint64_t segment = 0;
+    uint32_t lastOrbit = 0;
+    uint64_t nbMuons = 0;
+    uint64_t nbOutOfRange = 0;
+    tbb::tick_count since;
+    Histograms<uint32_t> histograms;
+  };
+
+  // Segment of the ring
+  struct Segment {
+    bool used = false;
+    uint64_t segment = 0;
+    uint32_t lastOrbit = 0;
+    Histograms<uint64_t> histograms;
+  };
+
+  void fill( const char *p, const char *end, Accumulator& acc );
+
+  // Add the histograms of a thread to the ring and clear them
+  void flush( Accumulator& acc );
+
+  std::string snapshot();
+  std::string report();
+
+private:
+  std::string name_;
+  uint32_t segmentOrbits_;
+  ctrl& control_;
+
+  tbb::enumerable_thread_specific<Accumulator> local_;
+
+  std::mutex lock_;
+  std::vector<Segment> ring_;
+  bool anySegment_;
+  uint64_t latestSegment_;
+
+  struct Statistics {
+    uint64_t nbFlushes = 0;
+    uint64_t nbMuons = 0;
+    uint64_t nbOutOfRange = 0;
+    uint64_t nbLate = 0;
+    uint64_t nbRestarts = 0;
+  } stats;
+};
+
+#endif // OCCUPANCY_H
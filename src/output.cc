@@ -1,6 +1,14 @@
+#include <algorithm>
 #include <system_error>
 #include <fstream>
+#include <sstream>
+#include <vector>
 
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "checksum.h"
+#include "compact.h"
 #include "output.h"
 #include "slice.h"
 #include "log.h"
@@ -36,16 +44,34 @@ static void create_output_directory(std::string& output_directory)
   LOG(TRACE) << "Created output directory: " << output_directory << "'.";    
 }
 
-OutputStream::OutputStream( const char* output_file_base, ctrl& c) : 
+file_header make_file_header( uint16_t format, bool zs, uint32_t source_id, bool trailer )
+{
+  file_header header;
+  memset( &header, 0, sizeof(header) );
+  header.magic = file_header::magic_number;
+  header.version = file_header::current_version;
+  header.header_size = sizeof(header);
+  header.data_version = file_header::current_data_version;
+  header.format = format;
+  header.flags = (zs ? file_header::flag_zs : 0) | (trailer ? file_header::flag_trailer : 0);
+  header.source_id = source_id;
+  return header;
+}
+
+OutputStream::OutputStream( const char* output_file_base, ctrl& c, const file_header& header, uint64_t max_file_size, uint32_t columnar_orbits) : 
     tbb::filter(serial_in_order),
     my_output_file_base(output_file_base),
     totcounts(0),
     current_file_size(0),
+    my_max_file_size(max_file_size),
     file_count(-1),
     control(c),
     current_file(0),
     current_run_number(0),
-    journal_name(my_output_file_base + "/" + journal_file)
+    journal_name(my_output_file_base + "/" + journal_file),
+    columnar(columnar_orbits ? new ColumnarEncoder(columnar_orbits) : NULL),
+    current_header(header),
+    current_checksum(0)
 {
   LOG(TRACE) << "Created output filter at " << static_cast<void*>(this);
 
@@ -54,7 +80,14 @@ OutputStream::OutputStream( const char* output_file_base, ctrl& c) :
   create_output_directory(output_directory);
 }
 
-static void update_journal(std::string journal_name, uint32_t run_number, uint32_t index)
+OutputStream::~OutputStream()
+{
+  // Do not leave the last file in the working directory when the pipeline ends
+  close_and_move_current_file();
+}
+
+// The journal has the run number, the next index and the name, size and checksum of the last file
+static void update_journal(std::string journal_name, uint32_t run_number, uint32_t index, const std::string& last_file)
 {
   std::string new_journal_name = journal_name + ".new";
 
@@ -62,6 +95,9 @@ static void update_journal(std::string journal_name, uint32_t run_number, uint32
   std::ofstream journal (new_journal_name);
   if (journal.is_open()) {
     journal << run_number << "\n" << index << "\n";
+    if (!last_file.empty()) {
+      journal << last_file << "\n";
+    }
     journal.close();
   } else {
     LOG(ERROR) << "WARNING: Unable to open journal file";
@@ -90,14 +126,21 @@ void* OutputStream::operator()( void* item )
     totcounts += out.get_counts();
 
     if ( control.running.load(std::memory_order_acquire) || control.output_force_write ) {
-      if (current_file == NULL || current_file_size > control.max_file_size || current_run_number != control.run_number) {
+      uint64_t max_file_size = my_max_file_size ? my_max_file_size : control.max_file_size;
+      if (current_file == NULL || current_file_size > max_file_size || current_run_number != control.run_number) {
         open_next_file();
       }
       
-      size_t n = fwrite( out.begin(), 1, out.size(), current_file );
-      current_file_size += n;      
-      if ( n != out.size() ) {
-        LOG(ERROR) << "Can't write into output file: Have to write " << out.size() << ", but write returned " << n;
+      count_records( out.begin(), out.end() );
+      if ( columnar ) {
+        // The blocks are written when they have all their orbits, or when the file is closed
+        const char* p = out.begin();
+        while ( (p = columnar->add(p, out.end())) != out.end() ) {
+          columnar->encode( columnar_block );
+          write_data( columnar_block.data(), columnar_block.size() );
+        }
+      } else {
+        write_data( out.begin(), out.size() );
       }
     }
 
@@ -111,6 +154,66 @@ void* OutputStream::operator()( void* item )
     return NULL;
 }
 
+void OutputStream::write_data( const char* data, size_t size )
+{
+  size_t n = fwrite( data, 1, size, current_file );
+  current_file_size += n;
+  current_header.data_size += n;
+  current_checksum = checksum::crc32c( current_checksum, data, n );
+  if ( n != size ) {
+    LOG(ERROR) << "Can't write into output file: Have to write " << size << ", but write returned " << n;
+  }
+}
+
+// Size of the header of a reformatted record (header, bx, orbit)
+static constexpr size_t record_header_size = 3 * sizeof(uint32_t);
+
+void OutputStream::count_records( const char* p, const char* end )
+{
+  file_header& h = current_header;
+  uint32_t first_orbit = 0, last_orbit = 0;
+  uint64_t nb_records = 0, nb_muons = 0;
+
+  if ( h.format == file_header::format_row || h.format == file_header::format_columnar ) {
+    while ( end - p >= (ptrdiff_t)record_header_size ) {
+      const uint32_t *words = reinterpret_cast<const uint32_t *>( p );
+      uint32_t mAcount = (words[0] & header_masks::mAcount) >> header_shifts::mAcount;
+      uint32_t mBcount = (words[0] & header_masks::mBcount) >> header_shifts::mBcount;
+      p += record_header_size + (mAcount + mBcount) * sizeof(muon);
+      if ( p > end ) {
+        break;
+      }
+      first_orbit = nb_records ? first_orbit : words[2];
+      last_orbit = words[2];
+      nb_records++;
+      nb_muons += mAcount + mBcount;
+    }
+  } else if ( h.format == file_header::format_compact ) {
+    while ( end - p >= (ptrdiff_t)sizeof(compact_header) ) {
+      compact_header block;
+      memcpy( &block, p, sizeof(block) );
+      if ( block.block_size < sizeof(block) ) {
+        break;
+      }
+      p += block.block_size;
+      if ( block.nb_records ) {
+        first_orbit = nb_records ? first_orbit : block.first_orbit;
+        last_orbit = block.last_orbit;
+        nb_records += block.nb_records;
+        nb_muons += block.nb_muons;
+      }
+    }
+  }
+
+  // The raw data are not counted
+  if ( nb_records ) {
+    h.first_orbit = h.nb_records ? h.first_orbit : first_orbit;
+    h.last_orbit = last_orbit;
+    h.nb_records += nb_records;
+    h.nb_muons += nb_muons;
+  }
+}
+
 /*
  * Create a properly formated file name
  * TODO: Change to C++
@@ -122,20 +225,159 @@ static std::string format_run_file_stem(uint32_t run_number, int32_t file_count)
   return std::string(run_order_stem);
 }
 
+static std::string checksum_string(uint32_t checksum)
+{
+  char text[9];
+  snprintf(text, sizeof(text), "%08x", checksum);
+  return text;
+}
+
+std::string metadata_file_name(const std::string& file_name)
+{
+  return file_name + ".json";
+}
+
+/*
+ * Write the metadata of a file (header fields, size and CRC32C of the whole file) as one JSON line,
+ * in the working directory first and then moved next to the file
+ */
+static void write_metadata(const std::string& working_directory, const std::string& target_directory, const std::string& run_file,
+                           const file_header& header, uint64_t file_size, uint32_t file_checksum)
+{
+  std::string working_name = metadata_file_name(working_directory + "/" + run_file);
+  std::string target_name = metadata_file_name(target_directory + "/" + run_file);
+
+  std::ofstream metadata (working_name);
+  metadata << "{\"file\":\"" << run_file << "\",\"run\":" << header.run_number << ",\"index\":" << header.file_index
+           << ",\"source\":" << header.source_id << ",\"format\":" << header.format
+           << ",\"zs\":" << ((header.flags & file_header::flag_zs) ? "true" : "false")
+           << ",\"first_orbit\":" << header.first_orbit << ",\"last_orbit\":" << header.last_orbit
+           << ",\"records\":" << header.nb_records << ",\"muons\":" << header.nb_muons
+           << ",\"size\":" << file_size << ",\"crc32c\":\"" << checksum_string(file_checksum) << "\"}\n";
+  metadata.close();
+  if (!metadata) {
+    LOG(ERROR) << "Can't write the metadata file '" << working_name << "'";
+    return;
+  }
+  if ( rename(working_name.c_str(), target_name.c_str()) < 0 ) {
+    LOG(ERROR) << tools::strerror("Metadata file rename failed");
+  }
+}
+
+bool read_file_metadata(const std::string& file_name, uint64_t& size, uint32_t& checksum, std::string& error)
+{
+  try {
+    boost::property_tree::ptree metadata;
+    boost::property_tree::read_json(metadata_file_name(file_name), metadata);
+    size = metadata.get<uint64_t>("size");
+    checksum = std::stoul(metadata.get<std::string>("crc32c"), NULL, 16);
+  } catch (std::exception& e) {
+    error = std::string("Can't read the metadata: ") + e.what();
+    return false;
+  }
+  return true;
+}
+
+bool verify_output_file(const std::string& file_name, std::string& error)
+{
+  uint64_t expected_size;
+  uint32_t expected_checksum;
+  if (!read_file_metadata(file_name, expected_size, expected_checksum, error)) {
+    return false;
+  }
+
+  FILE *file = fopen(file_name.c_str(), "r");
+  if (file == NULL) {
+    error = tools::strerror("Can't open the file");
+    return false;
+  }
+  std::vector<char> buffer(1 << 20);
+  uint64_t size = 0;
+  uint32_t crc = 0;
+  file_header header;
+  memset(&header, 0, sizeof(header));
+  size_t n;
+  while ((n = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+    if (size == 0) {
+      memcpy(&header, buffer.data(), std::min(n, sizeof(header)));
+    }
+    crc = checksum::crc32c(crc, buffer.data(), n);
+    size += n;
+  }
+  bool read_error = ferror(file);
+  fclose(file);
+
+  std::ostringstream out;
+  if (read_error) {
+    out << "Read error";
+  } else if (size != expected_size) {
+    out << "Size " << size << " instead of " << expected_size;
+  } else if (crc != expected_checksum) {
+    out << "CRC32C " << checksum_string(crc) << " instead of " << checksum_string(expected_checksum);
+  } else if (header.magic != file_header::magic_number || !(header.flags & file_header::flag_complete)) {
+    out << "No complete file header";
+  }
+  error = out.str();
+  return error.empty();
+}
+
 void OutputStream::close_and_move_current_file()
 {
   // Close and move current file
   if (current_file) {
-    fclose(current_file);
+    // The last block of the file
+    if (columnar && !columnar->empty()) {
+      columnar->encode( columnar_block );
+      write_data( columnar_block.data(), columnar_block.size() );
+    }
+
+    // The checksum after the data, and the header again with the orbits and the counts
+    file_trailer trailer;
+    memset( &trailer, 0, sizeof(trailer) );
+    if (current_header.flags & file_header::flag_trailer) {
+      trailer.magic = file_trailer::magic_number;
+      trailer.version = file_trailer::current_version;
+      trailer.trailer_size = sizeof(trailer);
+      trailer.checksum = current_checksum;
+      trailer.data_size = current_header.data_size;
+      if ( fwrite(&trailer, 1, sizeof(trailer), current_file) != sizeof(trailer) ) {
+        LOG(ERROR) << tools::strerror("Can't write the file trailer");
+      }
+    }
+    current_header.flags |= file_header::flag_complete;
+    if ( fseek(current_file, 0, SEEK_SET) != 0 || fwrite(&current_header, 1, sizeof(current_header), current_file) != sizeof(current_header) ) {
+      LOG(ERROR) << tools::strerror("Can't write the file header");
+    }
+    if ( fclose(current_file) != 0 ) {
+      LOG(ERROR) << tools::strerror("Can't close the output file");
+    }
     current_file = NULL;
 
     std::string run_file          = format_run_file_stem(current_run_number, file_count);
     std::string current_file_name = my_output_file_base + "/" + working_dir + "/" + run_file;
     std::string target_file_name  = my_output_file_base + "/" + run_file;
 
+    // Checksum of the whole file from the one of the data, without reading it again
+    uint64_t file_size = sizeof(current_header) + current_header.data_size;
+    uint32_t file_checksum = checksum::crc32c_combine( checksum::crc32c(0, &current_header, sizeof(current_header)),
+                                                       current_checksum, current_header.data_size );
+    if (current_header.flags & file_header::flag_trailer) {
+      file_size += sizeof(trailer);
+      file_checksum = checksum::crc32c_combine( file_checksum, checksum::crc32c(0, &trailer, sizeof(trailer)), sizeof(trailer) );
+    }
+
+    // The metadata are in place before the file, a mover finds both
+    write_metadata( my_output_file_base + "/" + working_dir, my_output_file_base, run_file, current_header, file_size, file_checksum );
+    std::ostringstream record;
+    record << run_file << ' ' << file_size << ' ' << checksum_string(file_checksum);
+    last_file = record.str();
+    update_journal(journal_name, current_run_number, file_count+1, last_file);
+
     LOG(INFO) << "rename: " << current_file_name << " to " << target_file_name;
     if ( rename(current_file_name.c_str(), target_file_name.c_str()) < 0 ) {
       LOG(ERROR) << tools::strerror("File rename failed");
+    } else {
+      control.move_file(target_file_name);
     }
 
     current_file_size = 0; 
@@ -189,6 +431,38 @@ void OutputStream::open_next_file()
     throw std::runtime_error(err);
   }
 
+  // The header is complete when the file is closed
+  current_header.flags &= ~file_header::flag_complete;
+  current_header.run_number = current_run_number;
+  current_header.file_index = file_count;
+  current_header.first_orbit = current_header.last_orbit = 0;
+  current_header.nb_records = current_header.nb_muons = current_header.data_size = 0;
+  current_checksum = 0;
+  if ( fwrite(&current_header, 1, sizeof(current_header), current_file) != sizeof(current_header) ) {
+    LOG(ERROR) << tools::strerror("Can't write the file header");
+  }
+  current_file_size = sizeof(current_header);
+
   // Update journal file (with the next index file)
-  update_journal(journal_name, current_run_number, file_count+1);
+  update_journal(journal_name, current_run_number, file_count+1, last_file);
+}
+
+
+CompactEncoder::CompactEncoder() :
+    tbb::filter(parallel)
+{
+  LOG(TRACE) << "Created compact encoder at " << static_cast<void*>(this);
+}
+
+void* CompactEncoder::operator()( void* item )
+{
+  Slice& input = *static_cast<Slice*>(item);
+
+  // The deltas start again in each block, packets are encoded independently
+  Slice& out = *Slice::allocate( compact::max_encoded_size(input.size()) );
+  out.set_end( out.begin() + compact::encode(input.begin(), input.end(), out.begin()) );
+  out.set_counts( input.get_counts() );
+
+  input.free();
+  return &out;
 }
@@ -2,33 +2,70 @@
 #define OUTPUT_H
 
 #include <cstdio>
+#include <memory>
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include "tbb/pipeline.h"
 
+#include "columnar.h"
 #include "controls.h"
+#include "format.h"
+
+// Header of the files of a stream, the output fills in the run, the orbits and the counts
+file_header make_file_header( uint16_t format, bool zs, uint32_t source_id, bool trailer );
+
+// Metadata (JSON) written next to each output file, with its size and the CRC32C of the whole file
+std::string metadata_file_name( const std::string& file_name );
+
+// Size and CRC32C of a closed output file from its metadata, sets error if they can't be read
+bool read_file_metadata( const std::string& file_name, uint64_t& size, uint32_t& checksum, std::string& error );
+
+// Check a closed output file against its metadata, sets error if it does not match
+bool verify_output_file( const std::string& file_name, std::string& error );
 
 //! Filter that writes each buffer to a file.
 class OutputStream: public tbb::filter {
 
 
 public:
-  OutputStream( const char* output_file_base, ctrl& c );
+  // Files start with the given header and are rotated at max_file_size, or at the size in the run control if 0.
+  // The records are written as they are, or as columnar blocks of columnar_orbits orbits if not 0.
+  OutputStream( const char* output_file_base, ctrl& c, const file_header& header, uint64_t max_file_size = 0, uint32_t columnar_orbits = 0 );
+  ~OutputStream();
   void* operator()( void* item ) /*override*/;
 
 private:
   void open_next_file();
   void close_and_move_current_file();
 
+  // Write data into the current file and add them to the checksum
+  void write_data( const char* data, size_t size );
+  // Add the orbits and the records of a buffer to the file header
+  void count_records( const char* p, const char* end );
+
 private:
   std::string my_output_file_base;
   uint32_t totcounts;
   uint64_t current_file_size;
+  uint64_t my_max_file_size;
   int32_t file_count;
   ctrl& control;
   FILE *current_file;
   uint32_t current_run_number;
   std::string journal_name;
+  std::unique_ptr<ColumnarEncoder> columnar;
+  std::vector<char> columnar_block;
+  file_header current_header;
+  uint32_t current_checksum;
+  std::string last_file;
+};
+
+//! Filter that encodes each buffer of records as a compact block (see compact.h), in parallel.
+class CompactEncoder: public tbb::filter {
+public:
+  CompactEncoder();
+  void* operator()( void* item ) /*override*/;
 };
 
 #endif
@@ -0,0 +1,318 @@
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tbb/pipeline.h"
+#include "tbb/tick_count.h"
+
+#include "InputFilter.h"
+#include "FileDmaInputFilter.h"
+#include "FileInputFilter.h"
+#include "MemoryInputFilter.h"
+#include "WZDmaInputFilter.h"
+#include "DmaInputFilter.h"
+#include "processor.h"
+#include "elastico.h"
+#include "output.h"
+#include "eventbuilder.h"
+#include "trailermonitor.h"
+#include "continuity.h"
+#include "occupancy.h"
+#include "bxmask.h"
+#include "selection.h"
+#include "dimuon.h"
+#include "mover.h"
+#include "bench.h"
+#include "pipeline.h"
+#include "log.h"
+
+
+bool silent = false;
+
+namespace {
+
+// Stages reading and storing one data source
+struct SourcePipeline {
+  std::shared_ptr<InputFilter> input_filter;
+  std::unique_ptr<TrailerMonitor> trailer_monitor;
+  std::unique_ptr<ContinuityChecker> continuity_checker;
+  std::unique_ptr<StreamProcessor> stream_processor;
+  std::unique_ptr<OccupancyMonitor> occupancy_monitor;
+  std::unique_ptr<Selection> selection;
+  std::unique_ptr<DimuonHistograms> dimuon_histograms;
+  std::unique_ptr<ElasticProcessor> elastic_processor;
+  std::unique_ptr<CompactEncoder> compact_encoder;
+  std::unique_ptr<OutputStream> output_stream;
+  bench::NullOutputStream null_output;
+  tbb::pipeline pipeline;
+};
+
+}
+
+static std::shared_ptr<InputFilter> make_input_filter( const std::string& source, ctrl& control, config& conf )
+{
+  config::InputType input = conf.getInput();
+  size_t packetBufferSize = conf.getDmaPacketBufferSize();
+  size_t nbPacketBuffers = conf.getNumberOfDmaPacketBuffers();
+
+  if (input == config::InputType::DMA) {
+      // Create DMA reader
+      return std::make_shared<DmaInputFilter>( source, packetBufferSize, nbPacketBuffers, control );
+
+  } else if (input == config::InputType::FILEDMA) {
+      // Create FILE DMA reader
+      ReplayConfig replay;
+      std::string pacing = conf.getFileDmaReplay();
+      if (pacing == "orbit") {
+        replay.pacing = ReplayConfig::Pacing::ORBIT;
+      } else if (pacing == "timestamps") {
+        replay.pacing = ReplayConfig::Pacing::TIMESTAMPS;
+      } else if (pacing != "none") {
+        throw std::invalid_argument("Configuration error: Wrong filedma replay pacing '" + pacing + "'");
+      }
+      replay.timestampFile = conf.getFileDmaReplayTimestamps();
+      replay.speedup = conf.getFileDmaReplaySpeedup();
+      replay.spinSeconds = conf.getFileDmaReplaySpin();
+      return std::make_shared<FileDmaInputFilter>( source, packetBufferSize, nbPacketBuffers, control, replay );
+
+  } else if (input == config::InputType::FILE) {
+      // Create raw stream reader
+      return std::make_shared<FileInputFilter>( source, conf.getNumInputBuffers(), conf.getBlocksPerInputBuffer(),
+                                                packetBufferSize, nbPacketBuffers, control );
+
+  } else if (input == config::InputType::WZDMA ) {
+      // Create WZ DMA reader
+      unsigned board = boost::lexical_cast<unsigned>( source );
+      if ( conf.getWzDmaEmulator() ) {
+        struct wz_emu_config emulator;
+        emulator.nof_bufs = conf.getWzDmaEmuBuffers();
+        emulator.rate = conf.getWzDmaEmuRate() * 1024 * 1024;
+        emulator.bx_per_packet = conf.getWzDmaEmuBxPerPacket();
+        emulator.eio_every = conf.getWzDmaEmuEioEvery();
+        emulator.oversized_every = conf.getWzDmaEmuOversizedEvery();
+        emulator.wrap = conf.getWzDmaEmuWrap();
+        return std::make_shared<WZDmaInputFilter>( packetBufferSize, nbPacketBuffers, control, board, conf.getWzDmaPrefaultThreads(),
+                                                   conf.getWzDmaConfirmBatch(), &emulator );
+      }
+      return std::make_shared<WZDmaInputFilter>( packetBufferSize, nbPacketBuffers, control, board, conf.getWzDmaPrefaultThreads(),
+                                                 conf.getWzDmaConfirmBatch() );
+
+  } else if (input == config::InputType::MEMORY ) {
+      // Create replay reader from memory mapped file
+      return std::make_shared<MemoryInputFilter>( source, packetBufferSize, nbPacketBuffers, control );
+  }
+
+  throw std::invalid_argument("Configuration error: Unknown input type was specified");
+}
+
+int run_pipeline( size_t nbTokens, ctrl& control, config& conf, bench::Monitor *monitor )
+{
+  size_t packetBufferSize = conf.getDmaPacketBufferSize();
+  std::vector<std::string> sources = conf.getInputSources();
+  bool multiSource = sources.size() > 1;
+
+  // One filling scheme for all sources, it has to outlive the pipelines
+  std::unique_ptr<BxMask> bxMask;
+  if ( !conf.getBxMaskFile().empty() ) {
+    bxMask.reset( new BxMask("bxmask", conf.getBxMaskFile(), conf.getBxMaskNeighbours(), control) );
+  }
+
+  // Closed files are moved off the ramdisk in the background, the mover has to outlive the output streams
+  std::unique_ptr<FileMover> mover;
+  if ( !conf.getMoverDestination().empty() && !(monitor && monitor->nullOutput()) ) {
+    std::vector<std::string> output_directories { conf.getOutputFilenameBase() };
+    if ( !conf.getSelection().empty() ) {
+      output_directories.push_back( conf.getSelectionOutputFilenameBase() );
+    }
+    mover.reset( new FileMover("mover", output_directories, conf.getMoverDestination(), conf.getMoverThreads(),
+                               conf.getMoverBzip2() ? FileMover::Compression::BZIP2 : FileMover::Compression::NONE, control) );
+  }
+
+  // Each source has its own pipeline, all of them share the threads and the slice pool
+  std::vector< std::unique_ptr<SourcePipeline> > pipelines;
+
+  // The event builder merges the reformatted sources into one output
+  std::unique_ptr<EventBuilder> builder;
+  SourcePipeline builder_pipeline;
+  if ( multiSource && conf.getEventBuilder() ) {
+    if ( !conf.getEnableStreamProcessor() ) {
+      throw std::invalid_argument("Configuration error: The event builder needs the stream processor");
+    }
+    if ( conf.getOutputFormat() != config::OutputFormat::ROW ) {
+      throw std::invalid_argument("Configuration error: The event builder writes only the row format");
+    }
+    builder.reset( new EventBuilder( sources.size(), conf.getEventBuilderMaxOrbits(), conf.getEventBuilderTimeout(), control ) );
+
+    builder_pipeline.pipeline.add_filter( monitor ? monitor->wrap("builder", *builder) : *builder );
+    if ( monitor && monitor->nullOutput() ) {
+      builder_pipeline.pipeline.add_filter( monitor->wrap("output", builder_pipeline.null_output) );
+    } else {
+      file_header header = make_file_header( file_header::format_row, conf.getDoZS(), conf.getSourceId(), conf.getOutputFileTrailer() );
+      builder_pipeline.output_stream.reset( new OutputStream( conf.getOutputFilenameBase().c_str(), control, header ) );
+      builder_pipeline.pipeline.add_filter( monitor ? monitor->wrap("output", *builder_pipeline.output_stream) : *builder_pipeline.output_stream );
+    }
+  }
+
+  for (size_t i = 0; i < sources.size(); i++) {
+    pipelines.emplace_back( new SourcePipeline );
+    SourcePipeline& p = *pipelines.back();
+
+    // With several sources, stages and output directories are numbered
+    std::string suffix = multiSource ? std::to_string(i) : "";
+
+    // Benchmarks measure time spent in each stage
+    auto add_stage = [&p, &suffix, monitor]( const std::string& name, tbb::filter& stage ) {
+      p.pipeline.add_filter( monitor ? monitor->wrap(name + suffix, stage) : stage );
+    };
+
+    // Add input reader to a pipeline
+    p.input_filter = make_input_filter( sources[i], control, conf );
+    if (multiSource) {
+      p.input_filter->setSourceName( "source" + suffix + " " + sources[i] );
+    }
+    add_stage( "input", *p.input_filter );
+
+    // Decode the firmware counters from the orbit trailers
+    if ( conf.getTrailerMonitor() ) {
+      p.trailer_monitor.reset( new TrailerMonitor("trailer" + suffix, control) );
+      add_stage( "trailer", *p.trailer_monitor );
+    }
+
+    // Validate the raw data before the reformatter modifies them
+    if ( conf.getContinuityChecker() ) {
+      p.continuity_checker.reset( new ContinuityChecker("checker" + suffix, control) );
+      add_stage( "check", p.continuity_checker->scan() );
+      add_stage( "check-merge", p.continuity_checker->merge() );
+    }
+
+    // Create reformatter and add it to the pipeline
+    p.stream_processor.reset( new StreamProcessor(packetBufferSize, conf.getDoZS(), bxMask.get()) );
+    if ( conf.getEnableStreamProcessor() ) {
+      add_stage( "processor", *p.stream_processor );
+    }
+
+    // Histogram the reformatted data per bx
+    if ( conf.getEnableStreamProcessor() && conf.getOccupancyMonitor() ) {
+      p.occupancy_monitor.reset( new OccupancyMonitor("occupancy" + suffix, conf.getOccupancyWindowOrbits(), control) );
+      add_stage( "occupancy", *p.occupancy_monitor );
+    }
+
+    // Quick-look dimuon mass spectrum
+    if ( conf.getEnableStreamProcessor() && conf.getDimuonHistograms() ) {
+      std::string dimuon_directory = conf.getDimuonOutputDirectory();
+      if (multiSource) {
+        dimuon_directory += "/source" + suffix;
+      }
+      p.dimuon_histograms.reset( new DimuonHistograms("dimuon" + suffix, dimuon_directory, conf.getDimuonBins(),
+                                 conf.getDimuonMinMass(), conf.getDimuonMaxMass(), conf.getDimuonQualCut(), control) );
+      add_stage( "dimuon", *p.dimuon_histograms );
+    }
+
+    // Write the selected records to the reduced stream
+    if ( conf.getEnableStreamProcessor() && !conf.getSelection().empty() && !(monitor && monitor->nullOutput()) ) {
+      std::string selection_base = conf.getSelectionOutputFilenameBase();
+      if (multiSource) {
+        selection_base += "/source" + suffix;
+      }
+      file_header header = make_file_header( file_header::format_row, conf.getDoZS(), conf.getSourceId() + i, conf.getOutputFileTrailer() );
+      p.selection.reset( new Selection("selection" + suffix, conf.getSelection(), selection_base, header, conf.getSelectionMaxFileSize(), control) );
+      add_stage( "select", p.selection->select() );
+      add_stage( "select-write", p.selection->write() );
+    }
+
+    // Create elastic populator (if requested)
+    p.elastic_processor.reset( new ElasticProcessor(packetBufferSize,
+                &control,
+                conf.getElasticUrl(),
+                conf.getPtCut(),
+                conf.getQualCut()) );
+    if ( conf.getEnableElasticProcessor() ) {
+      add_stage( "elastic", *p.elastic_processor );
+    }
+
+    // Encode the records for the compact output format, after all stages reading them
+    if ( !builder && conf.getOutputFormat() == config::OutputFormat::COMPACT ) {
+      if ( !conf.getEnableStreamProcessor() ) {
+        throw std::invalid_argument("Configuration error: The compact output format needs the stream processor");
+      }
+      p.compact_encoder.reset( new CompactEncoder );
+      add_stage( "compact", *p.compact_encoder );
+    }
+
+    // The columnar output transposes reformatted records, it cannot split the raw data
+    if ( !builder && conf.getOutputFormat() == config::OutputFormat::COLUMNAR && !conf.getEnableStreamProcessor() ) {
+      throw std::invalid_argument("Configuration error: The columnar output format needs the stream processor");
+    }
+
+    // Create file-writing stage and add it to the pipeline
+    if ( builder ) {
+      add_stage( "port", builder->port(i) );
+    } else if ( monitor && monitor->nullOutput() ) {
+      add_stage( "output", p.null_output );
+    } else {
+      std::string output_file_base = conf.getOutputFilenameBase();
+      if (multiSource) {
+        output_file_base += "/source" + suffix;
+      }
+      // Without the stream processor the files hold the raw data
+      file_header header = conf.getEnableStreamProcessor()
+                         ? make_file_header( conf.getFileFormat(), conf.getDoZS(), conf.getSourceId() + i, conf.getOutputFileTrailer() )
+                         : make_file_header( file_header::format_raw, false, conf.getSourceId() + i, conf.getOutputFileTrailer() );
+      p.output_stream.reset( new OutputStream( output_file_base.c_str(), control, header, 0, conf.getColumnarOrbits() ) );
+      add_stage( "output", *p.output_stream );
+    }
+  }
+
+  // Run the pipelines, each one from its own thread, the first one from this thread
+  std::vector<std::thread> threads;
+  std::vector<std::exception_ptr> errors( pipelines.size() + 1 );
+
+  auto run = [&]( SourcePipeline& p, const std::string& name, std::exception_ptr& error ) {
+    try {
+      tbb::tick_count t0 = tbb::tick_count::now();
+      p.pipeline.run( nbTokens );
+      tbb::tick_count t1 = tbb::tick_count::now();
+
+      if ( !silent ) {
+        LOG(INFO) << (multiSource ? name + ": " : "") << "time = " << (t1-t0).seconds();
+      }
+    } catch (...) {
+      // Stop the other sources
+      error = std::current_exception();
+      control.shutdown = true;
+      control.notify();
+      if ( builder && &p == &builder_pipeline ) {
+        builder->abort();
+      }
+    }
+  };
+
+  std::thread builder_thread;
+  if ( builder ) {
+    builder_thread = std::thread( run, std::ref(builder_pipeline), "builder", std::ref(errors.back()) );
+  }
+  for (size_t i = 1; i < pipelines.size(); i++) {
+    threads.emplace_back( run, std::ref(*pipelines[i]), "source" + std::to_string(i), std::ref(errors[i]) );
+  }
+  run( *pipelines[0], "source0", errors[0] );
+  for (std::thread& t : threads) {
+    t.join();
+  }
+
+  // Build what is left when all sources ended
+  if ( builder ) {
+    builder->finish();
+    builder_thread.join();
+  }
+
+  for (std::exception_ptr& error : errors) {
+    if (error) {
+      std::rethrow_exception( error );
+    }
+  }
+
+  return 1;
+}
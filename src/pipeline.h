@@ -0,0 +1,19 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <cstddef>
+
+#include "controls.h"
+#include "config.h"
+
+namespace bench {
+class Monitor;
+}
+
+/*
+ * Build the processing pipeline from the configuration and run it until the input ends.
+ * If a benchmark monitor is given, the stages are timed and the output may be discarded.
+ */
+int run_pipeline( size_t nbTokens, ctrl& control, config& conf, bench::Monitor *monitor = NULL );
+
+#endif // PIPELINE_H
@@ -2,13 +2,15 @@
 #include "format.h"
 #include "slice.h"
 #include "log.h"
+#include "trailer.h"
 #include <iomanip>
 
-StreamProcessor::StreamProcessor(size_t max_size_, bool doZS_) : 
+StreamProcessor::StreamProcessor(size_t max_size_, bool doZS_, BxMask* bxMask_) : 
 	tbb::filter(parallel),
 	max_size(max_size_),
 	nbPackets(0),
-	doZS(doZS_)
+	doZS(doZS_),
+	bxMask(bxMask_)
 { 
 	LOG(TRACE) << "Created transform filter at " << static_cast<void*>(this);
 	myfile.open ("example.txt");
@@ -18,6 +20,10 @@ StreamProcessor::StreamProcessor(size_t max_size_, bool doZS_) :
 StreamProcessor::~StreamProcessor(){
 	//  fprintf(stderr,"Wrote %d muons \n",totcount);
 	myfile.close();
+	if(stats.nbCorruptedPackets){
+		LOG(INFO) << "Reformatter resynchronized " << stats.nbCorruptedPackets << " corrupted packets, salvaged "
+			<< stats.nbSalvagedOrbits << " orbits, skipped " << stats.nbSkippedBytes << " bytes";
+	}
 }
 
 Slice* StreamProcessor::process(Slice& input, Slice& out)
@@ -25,21 +31,95 @@ Slice* StreamProcessor::process(Slice& input, Slice& out)
 	//std::cout << "debug 1" << std::endl;
 	nbPackets++;
 	int bsize = sizeof(block1);
-	if((input.size()-constants::orbit_trailer_size)%bsize!=0){
-		LOG(WARNING)
-			<< "Frame size not a multiple of block size. Will be skipped. Size="
-			<< input.size() << " - block size=" << bsize;
+	// Empty packets only carry the run state through the pipeline
+	if(input.size()==0){
+		out.set_end(out.begin());
+		out.set_counts(0);
 		return &out;
 	}
-	char* p = input.begin();
 	char* q = out.begin();
 	uint32_t counts = 0;
 
+	// The mask is part of the zero suppression, a reload takes effect with the next packet
+	std::shared_ptr<const BxMask::Bits> mask;
+	if(bxMask && doZS){
+		mask = bxMask->bits();
+	}
+	Masked masked;
+
+	if(input.size()<constants::orbit_trailer_size || (input.size()-constants::orbit_trailer_size)%bsize!=0){
+		// Frame size not a multiple of block size, resynchronize on the orbit trailers
+		q = salvage(input.begin(), input.end(), q, counts, mask.get(), masked);
+	} else {
+		q = processOrbits(input.begin(), input.end(), q, counts, mask.get(), masked);
+	}
+	if(masked.nbRecords){
+		bxMask->count(masked.nbRecords, masked.nbMuons);
+	}
 
-	while(p!=input.end()){
+	out.set_end(q);
+	out.set_counts(counts);
+	return &out;  
+}
+
+char* StreamProcessor::salvage(char* p, char* end, char* q, uint32_t& counts, const BxMask::Bits* mask, Masked& masked)
+{
+	uint64_t salvaged = 0;
+	uint64_t skipped = 0;
+	size_t size = end - p;
+
+	while(p!=end){
+		char* t = trailer::find(p, end);
+		char* next = (t==end) ? end : t + constants::orbit_trailer_size;
+		// An orbit is intact if the trailer follows a whole number of blocks
+		if(t!=end && (t-p)%sizeof(block1)==0){
+			q = processOrbits(p, next, q, counts, mask, masked);
+			salvaged++;
+		} else {
+			skipped += next - p;
+		}
+		p = next;
+	}
+
+	stats.nbCorruptedPackets++;
+	stats.nbSalvagedOrbits += salvaged;
+	stats.nbSkippedBytes += skipped;
+	LOG(WARNING) << '#' << nbPackets << ": Frame size " << size << " not a multiple of block size " << sizeof(block1)
+		<< ". Salvaged " << salvaged << " orbit(s), skipped " << skipped << " bytes"
+		<< " (total " << stats.nbCorruptedPackets << " corrupted packets, " << stats.nbSalvagedOrbits
+		<< " salvaged orbits, " << stats.nbSkippedBytes << " skipped bytes)";
+	return q;
+}
+
+// Number of muons with non-zero pt in a block
+static inline uint32_t count_muons(const block1* bl)
+{
+	uint32_t n = 0;
+	for(unsigned int i = 0; i < 8; i++){
+		n += ((bl->mu1f[i] >> shifts::pt) & masks::pt) != 0;
+		n += ((bl->mu2f[i] >> shifts::pt) & masks::pt) != 0;
+	}
+	return n;
+}
+
+char* StreamProcessor::processOrbits(char* p, char* end, char* q, uint32_t& counts, const BxMask::Bits* mask, Masked& masked)
+{
+	int bsize = sizeof(block1);
+
+	while(p<end){
 		bool brill_word = false;
 		bool endoforbit = false;
 		block1 *bl = (block1*)p;
+		if(mask && bl->orbit[0]!=constants::deadbeef){
+			// Drop the bx outside the filling scheme
+			uint32_t bx = (bl->bx[0] >> shifts::bx) & masks::bx;
+			if(bx<BxMask::nb_bx && !mask->test(bx)){
+				masked.nbRecords++;
+				masked.nbMuons += count_muons(bl);
+				p+=bsize;
+				continue;
+			}
+		}
 		int mAcount = 0;
 		int mBcount = 0;
 		uint32_t bxmatch=0;
@@ -137,10 +217,7 @@ Slice* StreamProcessor::process(Slice& input, Slice& out)
 
 	}
 
-
-	out.set_end(q);
-	out.set_counts(counts);
-	return &out;  
+	return q;
 }
 
 void* StreamProcessor::operator()( void* item ){
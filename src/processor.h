@@ -3,26 +3,52 @@
 
 #include "tbb/pipeline.h"
     
+#include <atomic>
+#include <stdint.h>
 #include <iostream>
 #include <fstream>
+
+#include "bxmask.h"
 //reformatter
 
 class Slice;
 
 class StreamProcessor: public tbb::filter {
 public:
-  StreamProcessor(size_t, bool);
+  // With zero suppression the records of the bx outside bxMask are dropped, if given
+  StreamProcessor(size_t, bool, BxMask* bxMask = NULL);
   void* operator()( void* item )/*override*/;
   ~StreamProcessor();
 
-private:
+  // Reformat one input packet into out, public for the benchmarks
   Slice* process(Slice& input, Slice& out);
-  
+
+private:
+  // Records dropped by the bx mask in one packet
+  struct Masked {
+    uint64_t nbRecords = 0;
+    uint64_t nbMuons = 0;
+  };
+
+  // Reformat the blocks of whole orbits in [p, end) into q, returns the new end of the output
+  char* processOrbits(char* p, char* end, char* q, uint32_t& counts, const BxMask::Bits* mask, Masked& masked);
+
+  // Reformat only the intact orbits of a corrupted packet, skipping the data up to the next trailer
+  char* salvage(char* p, char* end, char* q, uint32_t& counts, const BxMask::Bits* mask, Masked& masked);
+
   std::ofstream myfile;
 private:
   size_t max_size;
   uint64_t nbPackets;
   bool doZS;
+  BxMask* bxMask;
+
+  // Packets are processed in parallel
+  struct Statistics {
+    std::atomic<uint64_t> nbCorruptedPackets{0};
+    std::atomic<uint64_t> nbSalvagedOrbits{0};
+    std::atomic<uint64_t> nbSkippedBytes{0};
+  } stats;
 };
 
 #endif
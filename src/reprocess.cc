@@ -0,0 +1,64 @@
+#include "tbb/pipeline.h"
+#include "tbb/task_scheduler_init.h"
+#include "tbb/tick_count.h"
+
+#include "ReprocessInputFilter.h"
+#include "bxmask.h"
+#include "processor.h"
+#include "output.h"
+#include "reprocess.h"
+#include "log.h"
+
+namespace reprocess {
+
+int run( ctrl& control, config& conf, const std::vector<std::string>& fileNames, uint32_t runNumber )
+{
+  size_t packetBufferSize = conf.getDmaPacketBufferSize();
+
+  // Nothing may be dropped, the input waits for free slices
+  control.overload_policy = OverloadPolicy::BLOCK;
+  control.run_number = runNumber;
+
+  // Use all cores, there is nothing else running
+  int nbThreads = tbb::task_scheduler_init::default_num_threads();
+  tbb::task_scheduler_init init( nbThreads );
+  size_t nbTokens = nbThreads * 4;
+
+  LOG(INFO) << "Reprocessing " << fileNames.size() << " file(s) as run " << runNumber << " with " << nbThreads << " threads";
+
+  tbb::tick_count t0 = tbb::tick_count::now();
+  uint64_t nbBytes = 0;
+  {
+    std::unique_ptr<BxMask> bxMask;
+    if ( !conf.getBxMaskFile().empty() ) {
+      bxMask.reset( new BxMask("bxmask", conf.getBxMaskFile(), conf.getBxMaskNeighbours(), control) );
+    }
+
+    ReprocessInputFilter input( fileNames, packetBufferSize, conf.getNumberOfDmaPacketBuffers(), control );
+    StreamProcessor processor( packetBufferSize, conf.getDoZS(), bxMask.get() );
+    CompactEncoder compact;
+    file_header header = make_file_header( conf.getFileFormat(), conf.getDoZS(), conf.getSourceId(), conf.getOutputFileTrailer() );
+    OutputStream output( conf.getOutputFilenameBase().c_str(), control, header, 0, conf.getColumnarOrbits() );
+
+    tbb::pipeline pipeline;
+    pipeline.add_filter( input );
+    pipeline.add_filter( processor );
+    if ( conf.getOutputFormat() == config::OutputFormat::COMPACT ) {
+      pipeline.add_filter( compact );
+    }
+    pipeline.add_filter( output );
+
+    // The output stage writes only when running
+    control.running = true;
+    pipeline.run( nbTokens );
+    control.running = false;
+
+    nbBytes = input.nbBytesRead();
+  }
+  double seconds = (tbb::tick_count::now() - t0).seconds();
+
+  LOG(INFO) << "Reprocessing done in " << seconds << " sec, " << nbBytes / seconds / 1e6 << " MB/s";
+  return 1;
+}
+
+} // namespace reprocess
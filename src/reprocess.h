@@ -0,0 +1,24 @@
+#ifndef REPROCESS_H
+#define REPROCESS_H
+
+/*
+ * Offline reprocessing of raw dumps (scdaq --reprocess [--run N] file...).
+ * The dumps are read once, in the given order, reformatted with all cores and
+ * written with the normal output file naming and rotation.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "controls.h"
+#include "config.h"
+
+namespace reprocess {
+
+// Reprocess the files, output files are named with the given run number
+int run( ctrl& control, config& conf, const std::vector<std::string>& fileNames, uint32_t runNumber );
+
+} // namespace reprocess
+
+#endif // REPROCESS_H
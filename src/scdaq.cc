@@ -1,4 +1,3 @@
-#include "tbb/pipeline.h"
 #include "tbb/tick_count.h"
 #include "tbb/task_scheduler_init.h"
 #include "tbb/tbb_allocator.h"
@@ -9,20 +8,18 @@
 #include <cctype>
 #include <string>
 #include <iostream>
+#include <vector>
 
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
 
 
-#include "InputFilter.h"
-#include "FileDmaInputFilter.h"
-#include "WZDmaInputFilter.h"
-#include "DmaInputFilter.h"
-#include "processor.h"
-#include "elastico.h"
-#include "output.h"
 #include "format.h"
+#include "output.h"
+#include "pipeline.h"
+#include "bench.h"
+#include "reprocess.h"
 #include "server.h"
 #include "controls.h"
 #include "config.h"
@@ -31,97 +28,67 @@
 using namespace std;
 
 
-bool silent = false;
-
-int run_pipeline( int nbThreads, ctrl& control, config& conf )
-{
-  config::InputType input = conf.getInput();
-  size_t packetBufferSize = conf.getDmaPacketBufferSize();
-  size_t nbPacketBuffers = conf.getNumberOfDmaPacketBuffers();
-
-  // Create empty input reader, will assign later when we know what is the data source
-  std::shared_ptr<InputFilter> input_filter;
-
-  // Create the pipeline
-  tbb::pipeline pipeline;
-
-  if (input == config::InputType::DMA) {
-      // Create DMA reader
-      input_filter = std::make_shared<DmaInputFilter>( conf.getDmaDevice(), packetBufferSize, nbPacketBuffers, control );
-
-  } else if (input == config::InputType::FILEDMA) {
-      // Create FILE DMA reader
-      input_filter = std::make_shared<FileDmaInputFilter>( conf.getInputFile(), packetBufferSize, nbPacketBuffers, control );
-
-  } else if (input == config::InputType::WZDMA ) {
-      // Create WZ DMA reader
-      input_filter = std::make_shared<WZDmaInputFilter>( packetBufferSize, nbPacketBuffers, control );
-
-  } else {
-    throw std::invalid_argument("Configuration error: Unknown input type was specified");
-  }
-
-  // Add input reader to a pipeline
-  pipeline.add_filter( *input_filter );
-
-  // Create reformatter and add it to the pipeline
-  // TODO: Created here so we are not subject of scoping, fix later...
-  StreamProcessor stream_processor(packetBufferSize, conf.getDoZS()); 
-  if ( conf.getEnableStreamProcessor() ) {
-    pipeline.add_filter( stream_processor );
-  }
-
-  // Create elastic populator (if requested)
-  std::string url = conf.getElasticUrl();
-  // TODO: Created here so we are not subject of scoping, fix later...
-  ElasticProcessor elastic_processor(packetBufferSize,
-              &control,
-              url,
-              conf.getPtCut(),
-              conf.getQualCut());
-  if ( conf.getEnableElasticProcessor() ) {
-    pipeline.add_filter(elastic_processor);
+int main( int argc, char* argv[] ) {
+  // Run throughput benchmarks instead of data taking
+  bool benchMode = (argc > 1 && std::string(argv[1]) == "--bench");
+
+  // Reformat raw dumps offline: --reprocess [--run N] file...
+  bool reprocessMode = (argc > 1 && std::string(argv[1]) == "--reprocess");
+  uint32_t reprocessRun = 0;
+  std::vector<std::string> reprocessFiles;
+  if (reprocessMode) {
+    int i = 2;
+    if (argc > 3 && std::string(argv[i]) == "--run") {
+      reprocessRun = std::strtoul( argv[i + 1], NULL, 10 );
+      i += 2;
+    }
+    reprocessFiles.assign( argv + i, argv + argc );
+    if (reprocessFiles.empty()) {
+      LOG(ERROR) << "Usage: " << argv[0] << " --reprocess [--run N] file...";
+      return 1;
+    }
   }
 
-  std::string output_file_base = conf.getOutputFilenameBase();
-
-  // Create file-writing stage and add it to the pipeline
-  OutputStream output_stream( output_file_base.c_str(), control);
-  pipeline.add_filter( output_stream );
-
-  // Run the pipeline
-  tbb::tick_count t0 = tbb::tick_count::now();
-  // Need more than one token in flight per thread to keep all threads 
-  // busy; 2-4 works
-  pipeline.run( nbThreads * 4 );
-  tbb::tick_count t1 = tbb::tick_count::now();
-
-  if ( !silent ) {
-    LOG(INFO) << "time = " << (t1-t0).seconds();
+  // Check closed output files against their metadata: --verify file...
+  if (argc > 1 && std::string(argv[1]) == "--verify") {
+    if (argc < 3) {
+      LOG(ERROR) << "Usage: " << argv[0] << " --verify file...";
+      return 1;
+    }
+    int nbBad = 0;
+    for (int i = 2; i < argc; i++) {
+      std::string error;
+      if (verify_output_file(argv[i], error)) {
+        LOG(INFO) << argv[i] << ": OK";
+      } else {
+        LOG(ERROR) << argv[i] << ": " << error;
+        nbBad++;
+      }
+    }
+    return nbBad ? 2 : 0;
   }
-
-  return 1;
-}
-
-
-int main( int argc, char* argv[] ) {
-  (void)(argc);
-  (void)(argv);
   LOG(DEBUG) << "here 0";
 
+  tbb::tick_count mainStartTime = tbb::tick_count::now();
+
   try {
     config conf("scdaq.conf");
     conf.print();
+    LOG(INFO) << "Startup: configuration loaded in " << (tbb::tick_count::now() - mainStartTime).seconds() << " sec";
     LOG(DEBUG) << "here 1";
     ctrl control;
-    //    tbb::tick_count mainStartTime = tbb::tick_count::now();
+
+    control.start_time = mainStartTime;
 
 
     control.running = false;
+    control.shutdown = false;
     control.run_number = 0;
     control.max_file_size = conf.getOutputMaxFileSize();//in Bytes
     control.packets_per_report = conf.getPacketsPerReport();
     control.output_force_write = conf.getOutputForceWrite();
+    control.overload_policy = conf.getOverloadPolicy();
+    control.overload_spill_buffers = conf.getOverloadSpillBuffers();
 
     // Firmware needs at least 1MB buffer for DMA
     if (conf.getDmaPacketBufferSize() < 1024*1024) {
@@ -129,6 +96,14 @@ int main( int argc, char* argv[] ) {
       return 1;
     }
 
+    if (benchMode) {
+      return bench::run_bench(control, conf) ? 0 : 1;
+    }
+
+    if (reprocessMode) {
+      return reprocess::run(control, conf, reprocessFiles, reprocessRun) ? 0 : 1;
+    }
+
     boost::asio::io_service io_service;
     server s(io_service, conf.getPortNumber(), control);
     boost::thread t(boost::bind(&boost::asio::io_service::run, &io_service));
@@ -136,7 +111,9 @@ int main( int argc, char* argv[] ) {
     int nbThreads = conf.getNumThreads();
 
     tbb::task_scheduler_init init( nbThreads );
-    if (!run_pipeline (nbThreads, control, conf))
+    // Need more than one token in flight per thread to keep all threads 
+    // busy; 2-4 works
+    if (!run_pipeline (nbThreads * 4, control, conf))
       return 1;
 
     //    utility::report_elapsed_time((tbb::tick_count::now() - mainStartTime).seconds());
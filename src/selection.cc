@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "selection.h"
+#include "format.h"
+#include "slice.h"
+#include "log.h"
+
+// Size of the header of a reformatted record (header, bx, orbit)
+static constexpr size_t record_header_size = 3 * sizeof(uint32_t);
+
+
+static const struct {
+  const char *name;
+  Selection::Variable variable;
+} variables[] = {
+  { "pt", Selection::Variable::PT },
+  { "qual", Selection::Variable::QUAL },
+  { "eta", Selection::Variable::ETA },
+  { "abseta", Selection::Variable::ABSETA },
+  { "phi", Selection::Variable::PHI },
+  { "charge", Selection::Variable::CHARGE },
+  { "nmu", Selection::Variable::NMU },
+  { "angle", Selection::Variable::ANGLE },
+  { "qq", Selection::Variable::QQ },
+};
+
+static const struct {
+  const char *name;
+  Selection::Op op;
+} operators[] = {
+  // Two character operators first
+  { "<=", Selection::Op::LE },
+  { ">=", Selection::Op::GE },
+  { "==", Selection::Op::EQ },
+  { "!=", Selection::Op::NE },
+  { "<", Selection::Op::LT },
+  { ">", Selection::Op::GT },
+};
+
+
+std::vector<Selection::Rule> Selection::parse( const std::string& rules )
+{
+  std::vector<Rule> parsed;
+  std::istringstream alternatives( rules );
+  std::string alternative;
+
+  while (std::getline( alternatives, alternative, ';' )) {
+    Rule rule;
+    std::istringstream tokens( alternative );
+    std::string token;
+    while (tokens >> token) {
+      size_t pos = token.find_first_of( "<>=!" );
+      if (pos == std::string::npos) {
+        throw std::invalid_argument( "Configuration error: Selection cut '" + token + "' has no comparison" );
+      }
+      std::string name = token.substr( 0, pos );
+
+      Cut cut;
+      bool found = false;
+      for (const auto& v : variables) {
+        if (name == v.name) {
+          cut.variable = v.variable;
+          found = true;
+        }
+      }
+      if (!found) {
+        throw std::invalid_argument( "Configuration error: Unknown selection variable '" + name + "'" );
+      }
+
+      found = false;
+      for (const auto& o : operators) {
+        if (token.compare( pos, strlen(o.name), o.name ) == 0) {
+          cut.op = o.op;
+          pos += strlen( o.name );
+          found = true;
+          break;
+        }
+      }
+      size_t end = 0;
+      try {
+        cut.value = found ? std::stof( token.substr(pos), &end ) : 0;
+      }
+      catch (std::exception&) {
+        found = false;
+      }
+      if (!found || pos + end != token.size()) {
+        throw std::invalid_argument( "Configuration error: Wrong selection cut '" + token + "'" );
+      }
+
+      if (cut.variable == Variable::NMU) {
+        rule.countCuts.push_back( cut );
+      } else if (cut.variable == Variable::ANGLE || cut.variable == Variable::QQ) {
+        rule.pairCuts.push_back( cut );
+      } else {
+        rule.muonCuts.push_back( cut );
+      }
+    }
+
+    if (!rule.muonCuts.empty() || !rule.countCuts.empty() || !rule.pairCuts.empty()) {
+      parsed.push_back( rule );
+    }
+  }
+
+  if (parsed.empty()) {
+    throw std::invalid_argument( "Configuration error: Empty selection '" + rules + "'" );
+  }
+  return parsed;
+}
+
+
+size_t Selection::decode( const char *p, const char *end, Muons& muons )
+{
+  for (auto& values : muons.values) {
+    values.clear();
+  }
+  muons.first.clear();
+  muons.offset.clear();
+
+  const char *begin = p;
+  while (end - p >= (ptrdiff_t)record_header_size) {
+    const uint32_t *words = reinterpret_cast<const uint32_t *>( p );
+    uint32_t mAcount = (words[0] & header_masks::mAcount) >> header_shifts::mAcount;
+    uint32_t mBcount = (words[0] & header_masks::mBcount) >> header_shifts::mBcount;
+    const muon *mu = reinterpret_cast<const muon *>( p + record_header_size );
+    const char *next = p + record_header_size + (mAcount + mBcount) * sizeof(muon);
+    if (next > end) {
+      break;
+    }
+
+    muons.first.push_back( muons.values[0].size() );
+    muons.offset.push_back( p - begin );
+    for (uint32_t i = 0; i < mAcount + mBcount; i++) {
+      uint32_t ipt = (mu[i].f >> shifts::pt) & masks::pt;
+      // Extrapolated to the vertex, eta is a 9 bit signed number
+      int32_t ieta = (mu[i].f >> shifts::etaext) & masks::etaext;
+      if (ieta & masks::etaexts) {
+        ieta -= 2 * masks::etaexts;
+      }
+      uint32_t iphi = (mu[i].f >> shifts::phiext) & masks::phiext;
+      uint32_t chrg = (mu[i].s >> shifts::chrg) & masks::chrg;
+
+      // Empty muons without zero suppression do not pass any pt cut
+      float eta = ieta * gmt_scales::eta_scale;
+      muons.values[(int)Variable::PT].push_back( ipt ? (ipt - 1) * gmt_scales::pt_scale : -1 );
+      muons.values[(int)Variable::QUAL].push_back( (mu[i].f >> shifts::qual) & masks::qual );
+      muons.values[(int)Variable::ETA].push_back( eta );
+      muons.values[(int)Variable::ABSETA].push_back( std::fabs(eta) );
+      muons.values[(int)Variable::PHI].push_back( iphi * gmt_scales::phi_scale );
+      muons.values[(int)Variable::CHARGE].push_back( chrg ? -1 : 1 );
+    }
+    p = next;
+  }
+  muons.first.push_back( muons.values[0].size() );
+
+  // Padding for the last group of 4
+  size_t nbMuons = muons.values[0].size();
+  for (auto& values : muons.values) {
+    values.resize( (nbMuons + 3) & ~size_t(3), 0 );
+  }
+  return muons.offset.size();
+}
+
+
+#ifdef __SSE2__
+template<Selection::Op op> static inline __m128 compare( __m128 a, __m128 b );
+template<> inline __m128 compare<Selection::Op::LT>( __m128 a, __m128 b ) { return _mm_cmplt_ps( a, b ); }
+template<> inline __m128 compare<Selection::Op::LE>( __m128 a, __m128 b ) { return _mm_cmple_ps( a, b ); }
+template<> inline __m128 compare<Selection::Op::GT>( __m128 a, __m128 b ) { return _mm_cmpgt_ps( a, b ); }
+template<> inline __m128 compare<Selection::Op::GE>( __m128 a, __m128 b ) { return _mm_cmpge_ps( a, b ); }
+template<> inline __m128 compare<Selection::Op::EQ>( __m128 a, __m128 b ) { return _mm_cmpeq_ps( a, b ); }
+template<> inline __m128 compare<Selection::Op::NE>( __m128 a, __m128 b ) { return _mm_cmpneq_ps( a, b ); }
+#endif
+
+static inline bool compare( Selection::Op op, float a, float b )
+{
+  switch (op) {
+    case Selection::Op::LT: return a < b;
+    case Selection::Op::LE: return a <= b;
+    case Selection::Op::GT: return a > b;
+    case Selection::Op::GE: return a >= b;
+    case Selection::Op::EQ: return a == b;
+    case Selection::Op::NE: return a != b;
+  }
+  return false;
+}
+
+// Clear pass[i] for the muons failing the cut, n is a multiple of 4
+template<Selection::Op op>
+static void apply_cut( const float *x, float value, int32_t *pass, size_t n )
+{
+#ifdef __SSE2__
+  const __m128 v = _mm_set1_ps( value );
+  for (size_t i = 0; i < n; i += 4) {
+    __m128i m = _mm_castps_si128( compare<op>( _mm_loadu_ps(x + i), v ) );
+    __m128i *q = reinterpret_cast<__m128i *>( pass + i );
+    _mm_storeu_si128( q, _mm_and_si128( _mm_loadu_si128(q), m ) );
+  }
+#else
+  for (size_t i = 0; i < n; i++) {
+    pass[i] &= -(int32_t)compare( op, x[i], value );
+  }
+#endif
+}
+
+
+// Opening angle of two massless particles
+static inline float opening_angle( float eta1, float phi1, float eta2, float phi2 )
+{
+  float c = (std::cos(phi1 - phi2) + std::sinh(eta1) * std::sinh(eta2)) / (std::cosh(eta1) * std::cosh(eta2));
+  return std::acos( std::max( -1.f, std::min( 1.f, c ) ) );
+}
+
+void Selection::apply( const Rule& rule, size_t nbRecords, Muons& muons )
+{
+  size_t n = muons.values[0].size();
+  muons.pass.assign( n, -1 );
+
+  for (const Cut& cut : rule.muonCuts) {
+    const float *x = muons.values[(int)cut.variable].data();
+    switch (cut.op) {
+      case Op::LT: apply_cut<Op::LT>( x, cut.value, muons.pass.data(), n ); break;
+      case Op::LE: apply_cut<Op::LE>( x, cut.value, muons.pass.data(), n ); break;
+      case Op::GT: apply_cut<Op::GT>( x, cut.value, muons.pass.data(), n ); break;
+      case Op::GE: apply_cut<Op::GE>( x, cut.value, muons.pass.data(), n ); break;
+      case Op::EQ: apply_cut<Op::EQ>( x, cut.value, muons.pass.data(), n ); break;
+      case Op::NE: apply_cut<Op::NE>( x, cut.value, muons.pass.data(), n ); break;
+    }
+  }
+
+  const float *pt = muons.values[(int)Variable::PT].data();
+  const float *eta = muons.values[(int)Variable::ETA].data();
+  const float *phi = muons.values[(int)Variable::PHI].data();
+  const float *charge = muons.values[(int)Variable::CHARGE].data();
+
+  for (size_t r = 0; r < nbRecords; r++) {
+    if (muons.selected[r]) {
+      continue;
+    }
+    uint32_t first = muons.first[r];
+    uint32_t last = muons.first[r + 1];
+
+    // Empty muons never count
+    uint32_t nmu = 0;
+    for (uint32_t i = first; i < last; i++) {
+      nmu += muons.pass[i] && pt[i] >= 0;
+    }
+    bool selected = rule.countCuts.empty() ? nmu >= 1 : true;
+    for (const Cut& cut : rule.countCuts) {
+      selected = selected && compare( cut.op, nmu, cut.value );
+    }
+
+    if (selected && !rule.pairCuts.empty()) {
+      bool pair = false;
+      for (uint32_t i = first; i < last && !pair; i++) {
+        if (!muons.pass[i] || pt[i] < 0) {
+          continue;
+        }
+        for (uint32_t j = i + 1; j < last && !pair; j++) {
+          if (!muons.pass[j] || pt[j] < 0) {
+            continue;
+          }
+          pair = true;
+          for (const Cut& cut : rule.pairCuts) {
+            float value = (cut.variable == Variable::ANGLE) ? opening_angle( eta[i], phi[i], eta[j], phi[j] ) : charge[i] * charge[j];
+            pair = pair && compare( cut.op, value, cut.value );
+          }
+        }
+      }
+      selected = pair;
+    }
+    muons.selected[r] = selected;
+  }
+}
+
+
+Slice* Selection::select( Slice& input )
+{
+  Muons& muons = local_.local();
+  size_t nbRecords = decode( input.begin(), input.end(), muons );
+
+  muons.selected.assign( nbRecords, 0 );
+  for (const Rule& rule : rules_) {
+    apply( rule, nbRecords, muons );
+  }
+
+  // Copy the selected records, they are not larger than the input
+  Slice *out = Slice::allocate( input.size() );
+  char *q = out->begin();
+  uint32_t counts = 0;
+  uint64_t nbSelected = 0;
+  for (size_t r = 0; r < nbRecords; r++) {
+    if (muons.selected[r]) {
+      const char *p = input.begin() + muons.offset[r];
+      size_t size = record_header_size + (muons.first[r + 1] - muons.first[r]) * sizeof(muon);
+      memcpy( q, p, size );
+      q += size;
+      counts += muons.first[r + 1] - muons.first[r];
+      nbSelected++;
+    }
+  }
+  out->set_end( q );
+  out->set_counts( counts );
+
+  stats.nbRecords += nbRecords;
+  stats.nbSelected += nbSelected;
+  stats.nbBytes += input.size();
+  stats.nbSelectedBytes += out->size();
+  return out;
+}
+
+
+void* Selection::Select::operator()( void* item )
+{
+  Slice *slice = static_cast<Slice*>( item );
+  Slice *selected = selection_.select( *slice );
+
+  std::lock_guard<std::mutex> guard( selection_.pendingLock_ );
+  selection_.pending_[slice] = selected;
+  return slice;
+}
+
+void* Selection::Write::operator()( void* item )
+{
+  Slice *slice = static_cast<Slice*>( item );
+  selection_.write( slice );
+  return slice;
+}
+
+void Selection::write( Slice *input )
+{
+  Slice *selected = NULL;
+  {
+    std::lock_guard<std::mutex> guard( pendingLock_ );
+    auto it = pending_.find( input );
+    if (it != pending_.end()) {
+      selected = it->second;
+      pending_.erase( it );
+    }
+  }
+
+  // Empty slices too, the output follows the run state with them
+  if (selected) {
+    output_( selected );
+  }
+}
+
+
+Selection::Selection( const std::string& name, const std::string& rules, const std::string& outputBase, const file_header& header,
+                      uint64_t maxFileSize, ctrl& control ) :
+    name_(name),
+    rules_( parse(rules) ),
+    control_(control),
+    select_(*this),
+    write_(*this),
+    output_( outputBase.c_str(), control, header, maxFileSize )
+{
+  control_.add_stats( name_, [this]() { return report(); } );
+  LOG(INFO) << '[' << name_ << "] " << rules_.size() << " selection rule(s) '" << rules << "', writing to " << outputBase;
+}
+
+Selection::~Selection()
+{
+  control_.remove_stats( name_ );
+  LOG(INFO) << '[' << name_ << "] " << report();
+}
+
+
+std::string Selection::report()
+{
+  std::ostringstream out;
+  uint64_t nbBytes = stats.nbBytes;
+  uint64_t nbSelectedBytes = stats.nbSelectedBytes;
+  out << "records " << stats.nbRecords << ", selected " << stats.nbSelected
+      << "; bytes " << nbBytes << ", selected " << nbSelectedBytes;
+  if (nbBytes) {
+    out << " (" << 100. * nbSelectedBytes / nbBytes << "%)";
+  }
+  return out.str();
+}
@@ -0,0 +1,128 @@
+#ifndef SELECTION_H
+#define SELECTION_H
+
+/*
+ * Online selection of the reformatted bx records, written to a second output stream.
+ *
+ * The rules are alternatives separated by ';', a record is selected if any of them
+ * matches. A rule is a list of cuts separated by spaces, all of them have to pass:
+ *   pt, qual, eta, abseta, phi, charge   cuts on each muon (pt in GeV, charge +-1)
+ *   nmu                                  number of muons passing the muon cuts (default nmu>=1)
+ *   angle, qq                            some pair of the passing muons has this opening
+ *                                        angle (rad) and product of charges
+ * with the comparisons <, <=, >, >=, ==, !=. For example:
+ *   selection:pt>=25 qual>=12; nmu>=2 qual>=8 angle>=2.5 qq==-1
+ *
+ * The select stage runs in parallel: it decodes the muons of a packet into arrays,
+ * applies the muon cuts four muons at a time (SSE) and copies the selected records
+ * into a new slice. The write stage passes it in order to its own OutputStream, which
+ * rotates the files independently of the full stream, and passes the full data on.
+ */
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/pipeline.h"
+
+#include "controls.h"
+#include "output.h"
+
+class Slice;
+
+class Selection {
+public:
+  // Throws std::invalid_argument if the rules cannot be parsed
+  // The files of the reduced stream start with header (see file_header in format.h)
+  Selection( const std::string& name, const std::string& rules, const std::string& outputBase, const file_header& header,
+             uint64_t maxFileSize, ctrl& control );
+  ~Selection();
+
+  // Parallel stage followed by the serial stage, both pass the full data on
+  tbb::filter& select() { return select_; }
+  tbb::filter& write() { return write_; }
+
+  enum class Op { LT, LE, GT, GE, EQ, NE };
+  enum class Variable { PT, QUAL, ETA, ABSETA, PHI, CHARGE, NMU, ANGLE, QQ };
+
+private:
+  struct Cut {
+    Variable variable;
+    Op op;
+    float value;
+  };
+
+  struct Rule {
+    std::vector<Cut> muonCuts;
+    std::vector<Cut> countCuts;
+    std::vector<Cut> pairCuts;
+  };
+
+  // Decoded muons of one packet, one array per variable, padded to a multiple of 4
+  struct Muons {
+    // Indexed by the muon variables, PT to CHARGE
+    std::vector<float> values[(int)Variable::CHARGE + 1];
+    std::vector<int32_t> pass;
+    // Index of the first muon of each record and the offset of the record in the packet
+    std::vector<uint32_t> first;
+    std::vector<uint32_t> offset;
+    std::vector<uint8_t> selected;
+  };
+
+  class Select: public tbb::filter {
+  public:
+    explicit Select( Selection& selection ) : tbb::filter(parallel), selection_(selection) {}
+    void* operator()( void* item ) /*override*/;
+  private:
+    Selection& selection_;
+  };
+
+  class Write: public tbb::filter {
+  public:
+    explicit Write( Selection& selection ) : tbb::filter(serial_in_order), selection_(selection) {}
+    void* operator()( void* item ) /*override*/;
+  private:
+    Selection& selection_;
+  };
+
+  static std::vector<Rule> parse( const std::string& rules );
+
+  // Decode the records of [p, end) into muons, returns the number of records
+  static size_t decode( const char *p, const char *end, Muons& muons );
+
+  // Mark the records matching the rule
+  static void apply( const Rule& rule, size_t nbRecords, Muons& muons );
+
+  Slice* select( Slice& input );
+  void write( Slice *input );
+
+  std::string report();
+
+private:
+  std::string name_;
+  std::vector<Rule> rules_;
+  ctrl& control_;
+  Select select_;
+  Write write_;
+  OutputStream output_;
+
+  tbb::enumerable_thread_specific<Muons> local_;
+
+  // Selected records waiting for the write stage
+  std::mutex pendingLock_;
+  std::unordered_map<Slice*, Slice*> pending_;
+
+  struct Statistics {
+    std::atomic<uint64_t> nbRecords{0};
+    std::atomic<uint64_t> nbSelected{0};
+    std::atomic<uint64_t> nbBytes{0};
+    std::atomic<uint64_t> nbSelectedBytes{0};
+  } stats;
+};
+
+#endif // SELECTION_H
@@ -1,5 +1,7 @@
 #ifndef SESSION_H
 #define SESSION_H
+#include <algorithm>
+#include <cctype>
 #include <cstdlib>
 #include <iostream>
 #include <boost/bind.hpp>
@@ -51,48 +53,71 @@ private:
 
 #define RCINFO(msg) msg ", run_number: %u, running: %s", control.run_number, (control.running ? "true" : "false")
 
-  int process_command(std::string_view input, char *output, size_t size)
+  // Format a short reply
+  template<typename... Args>
+  std::string reply(const char *format, Args... args)
+  {
+    char output[max_length];
+    int n = snprintf(output, sizeof(output), format, args...);
+    return std::string(output, std::min<size_t>(std::max(n, 0), sizeof(output) - 1));
+  }
+
+  std::string process_command(std::string_view input)
   {
     try {
       std::vector<std::string> items;
       boost::split(items, input, boost::is_any_of( " ," ), boost::token_compress_on);
 
       if ( items.size() < 1 || items.size() > 2 )  {
-        return snprintf(output, size, "ERROR: Wrong number of arguments (%ld).", items.size());
+        return reply("ERROR: Wrong number of arguments (%ld).", items.size());
       }
       const std::string& command = items[0];
 
       if ( command == "start" ) {
         if ( items.size() != 2) {
-          return snprintf(output, size, "ERROR: Wrong number of arguments (%ld), expecting 2.", items.size());
+          return reply("ERROR: Wrong number of arguments (%ld), expecting 2.", items.size());
         }
         uint32_t run_number = std::stoul( items[1] );
 
         if ( !control.running || control.run_number != run_number ) {
           control.run_number = run_number;
           control.running.store(true, std::memory_order_release);
-          return snprintf(output, size, RCINFO("ok"));
+          control.notify();
+          return reply(RCINFO("ok"));
 
         } else {
-          return snprintf(output, size, RCINFO("ignored"));
+          return reply(RCINFO("ignored"));
         }
 
       } else if ( command == "stop") {
         
         if ( control.running ) {
           control.running.store(false, std::memory_order_relaxed);
-          return snprintf(output, size, RCINFO("ok"));
+          control.notify();
+          return reply(RCINFO("ok"));
 
         } else {
-          return snprintf(output, size, RCINFO("ignored"));
+          return reply(RCINFO("ignored"));
         }
 
+      } else if ( command == "stats" ) {
+        // Counters of the monitoring stages, all or the given one
+        return control.stats( items.size() == 2 ? items[1] : "" );
+
+      } else if ( command == "occupancy" ) {
+        // Per bx snapshots of the occupancy monitors, all or the given one
+        return control.occupancy( items.size() == 2 ? items[1] : "" );
+
+      } else if ( command == "bxmask" ) {
+        // Reload the bx mask from the configured file or from the given one
+        return control.load_bxmask( items.size() == 2 ? items[1] : "" );
+
       } else {
-        return snprintf(output, size, "unknown command");
+        return reply("unknown command");
       }
     }
     catch (...) {
-      return snprintf(output, size, "ERROR: Cannot parse input.");
+      return reply("ERROR: Cannot parse input.");
     }
   }
 
@@ -104,13 +129,16 @@ private:
       std::string_view input(data_, bytes_transferred);
       LOG(DEBUG) << "Run control: Received: '" << input << '\'';
 
-      bytes_transferred = process_command(input, data_, max_length);
+      // Trailing newline and spaces are not a part of the command
+      while (!input.empty() && std::isspace(input.back())) {
+        input.remove_suffix(1);
+      }
 
-      std::string_view output(data_, bytes_transferred);
-      LOG(DEBUG) << "Run control: Sending:  '" << output << '\'';
+      reply_ = process_command(input);
+      LOG(DEBUG) << "Run control: Sending:  '" << reply_ << '\'';
 
       boost::asio::async_write(socket_,
-          boost::asio::buffer(data_, bytes_transferred),
+          boost::asio::buffer(reply_),
           boost::bind(&session::handle_write, this,
             boost::asio::placeholders::error));
       
@@ -141,6 +169,7 @@ private:
   tcp::socket socket_;
   enum { max_length = 1024 };
   char data_[max_length];
+  std::string reply_;
   ctrl& control;
   static const std::string reply_success;
   static const std::string reply_failure;
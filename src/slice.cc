@@ -1,13 +1,19 @@
+#include "tbb/parallel_for.h"
+
 #include "slice.h"
 
 tbb::concurrent_bounded_queue<Slice*> Slice::free_slices = tbb::concurrent_bounded_queue<Slice*>();
 
 Slice *Slice::preAllocate(size_t max_size, size_t nslices){
   if(Slice::free_slices.empty()){
-    for(unsigned int i = 0; i < nslices; i++){
+    // Allocate in parallel and touch every page, so the first packets don't pay for page faults
+    tbb::parallel_for(size_t(0), nslices, [max_size](size_t){
       Slice* t = Slice::allocate(max_size);
+      for(size_t offset = 0; offset < max_size; offset += 4096){
+        t->begin()[offset] = 0;
+      }
       Slice::free_slices.push(t);
-    }
+    });
   }
   Slice *t;
   Slice::free_slices.pop(t);
@@ -30,6 +36,22 @@ Slice *Slice::getAllocated(){
   return t;
 }
 
+// Return a free slice or NULL if the pool is exhausted
+Slice *Slice::tryGetAllocated(){
+  Slice *t;
+  if (Slice::free_slices.try_pop(t)) {
+    return t;
+  }
+  return NULL;
+}
+
+// Number of free slices in the pool
+size_t Slice::nbAvailable(){
+  // Negative when consumers are waiting
+  std::ptrdiff_t n = Slice::free_slices.size();
+  return n > 0 ? n : 0;
+}
+
 void Slice::giveAllocated(Slice *t){
   t->set_end(t->begin());
   Slice::free_slices.push(t);
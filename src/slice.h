@@ -23,7 +23,7 @@ public:
 
     // Replacing tbb::zero_allocator with aligned allocator.
     // Alignment to 32 bytes (256 bits) is required by MicronDMA.
-    Slice* t = (Slice*) scalable_aligned_malloc( sizeof(Slice)+max_size, 32);
+    Slice* t = (Slice*) scalable_aligned_malloc( header_size()+max_size, 32);
 
     t->logical_end = t->begin();
     t->physical_end = t->begin()+max_size;
@@ -34,7 +34,9 @@ public:
   static Slice *preAllocate(size_t, size_t);
   static void shutDown();
   static Slice *getAllocated();
+  static Slice *tryGetAllocated();
   static void giveAllocated(Slice *);
+  static size_t nbAvailable();
 
   //! Free a Slice object 
   void free() {
@@ -43,12 +45,12 @@ public:
 
     scalable_aligned_free( this );
   } 
-  //! Pointer to beginning of sequence
-  char* begin() {return (char*)(this+sizeof(Slice));}
+  //! Pointer to beginning of sequence, data follow the header and keep the 32 byte alignment
+  char* begin() {return (char*)this+header_size();}
   //! Pointer to one past last character in sequence
   char* end() {return logical_end;}
   //! Length of sequence
-  size_t size() const {return logical_end-(char*)(this+sizeof(Slice));}
+  size_t size() const {return logical_end-((const char*)this+header_size());}
   //! Maximum number of characters that can be appended to sequence
   size_t avail() const {return physical_end-logical_end;}
   //! Set end() to given value.
@@ -56,5 +58,9 @@ public:
   void set_output(bool o) {output=o;}
   void set_counts(uint32_t c){counts=c;}
   uint32_t get_counts() const {return counts;}
+
+private:
+  //! Size of the Slice object rounded up to the data alignment
+  static size_t header_size() {return (sizeof(Slice)+31) & ~size_t(31);}
 };
 #endif
@@ -0,0 +1,74 @@
+#ifndef TRAILER_H
+#define TRAILER_H
+
+/*
+ * Search for the orbit trailer, a 32 byte word starting with 0xdeadbeefdeadbeef.
+ *
+ * Used to resynchronize on corrupted or misaligned data, so the trailer is searched
+ * at every 32-bit word and not only at the 32 byte boundaries. The scan is done
+ * with SSE2 (always available on x86-64), four positions per iteration.
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "format.h"
+
+namespace trailer {
+
+inline bool is_trailer(const char *p)
+{
+  uint64_t word;
+  memcpy( &word, p, sizeof(word) );
+  return word == 0xdeadbeefdeadbeefULL;
+}
+
+/*
+ * Return the first trailer in [begin, end) with a complete 32 byte trailer word,
+ * searching at 4 byte steps. Returns end if there is none.
+ */
+inline const char* find(const char *begin, const char *end)
+{
+  if (end - begin < (ptrdiff_t)constants::orbit_trailer_size) {
+    return end;
+  }
+  // The last position where a whole trailer fits
+  const char *last = end - constants::orbit_trailer_size;
+  const char *p = begin;
+
+#ifdef __SSE2__
+  const __m128i deadbeef = _mm_set1_epi32( (int)constants::deadbeef );
+
+  // Lane k is set if the words k and k+1 are both 0xdeadbeef, 20 bytes are loaded
+  while (p + 3*sizeof(uint32_t) <= last) {
+    __m128i lo = _mm_cmpeq_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i *>(p) ), deadbeef );
+    __m128i hi = _mm_cmpeq_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i *>(p + sizeof(uint32_t)) ), deadbeef );
+    int mask = _mm_movemask_ps( _mm_castsi128_ps( _mm_and_si128(lo, hi) ) );
+    if (mask) {
+      return p + sizeof(uint32_t) * __builtin_ctz( mask );
+    }
+    p += 4*sizeof(uint32_t);
+  }
+#endif
+
+  for (; p <= last; p += sizeof(uint32_t)) {
+    if (is_trailer( p )) {
+      return p;
+    }
+  }
+  return end;
+}
+
+inline char* find(char *begin, char *end)
+{
+  return const_cast<char *>( find( const_cast<const char *>(begin), const_cast<const char *>(end) ) );
+}
+
+} // namespace trailer
+
+#endif // TRAILER_H
@@ -0,0 +1,190 @@
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#include "trailermonitor.h"
+#include "format.h"
+#include "slice.h"
+#include "log.h"
+
+// Length of one sample and of the time series
+static constexpr double sample_seconds = 1;
+static constexpr size_t history_length = 60;
+
+
+TrailerMonitor::TrailerMonitor( const std::string& name, ctrl& control ) :
+    tbb::filter(serial_in_order),
+    name_(name),
+    control_(control),
+    first_(true),
+    orbit_(0),
+    dropped_(0),
+    realigns_(0),
+    sampleStart_( tbb::tick_count::now() )
+{
+  dropping_.what = "Dropped orbits";
+  realigning_.what = "Autorealignment";
+  gaps_.what = "Orbit counter gaps";
+
+  control_.add_stats( name_, [this]() { return report( true ); } );
+  LOG(TRACE) << "Created trailer monitor " << name_;
+}
+
+TrailerMonitor::~TrailerMonitor()
+{
+  control_.remove_stats( name_ );
+  LOG(INFO) << '[' << name_ << "] " << report( false );
+}
+
+
+void TrailerMonitor::track( Episode& episode, uint64_t delta )
+{
+  if (!episode.active) {
+    episode.active = true;
+    episode.count = 0;
+    episode.nbEpisodes++;
+    LOG(WARNING) << '[' << name_ << "] " << episode.what << " started at orbit " << orbit_;
+  }
+  episode.count += delta;
+}
+
+void TrailerMonitor::endEpisode( Episode& episode, uint64_t delta )
+{
+  if (episode.active && delta == 0) {
+    episode.active = false;
+    LOG(INFO) << '[' << name_ << "] " << episode.what << " stopped at orbit " << orbit_ << ", " << episode.count << " in this episode";
+  }
+}
+
+
+void TrailerMonitor::decode( const char *trailer )
+{
+  uint64_t words[4];
+  memcpy( words, trailer, sizeof(words) );
+  if (words[0] != 0xdeadbeefdeadbeefULL) {
+    stats.nbBadTrailers++;
+    return;
+  }
+  uint64_t realigns = words[1];
+  uint64_t dropped = words[2];
+  uint64_t orbit = words[3];
+
+  current_.nbOrbits++;
+  if (first_) {
+    first_ = false;
+    orbit_ = orbit;
+    dropped_ = dropped;
+    realigns_ = realigns;
+    return;
+  }
+
+  if (orbit == orbit_) {
+    stats.nbDuplicates++;
+  } else if (orbit < orbit_) {
+    stats.nbBackwards++;
+  } else if (orbit - orbit_ > 1) {
+    uint64_t gap = orbit - orbit_ - 1;
+    stats.nbGaps++;
+    stats.nbGapOrbits += gap;
+    current_.nbGapOrbits += gap;
+    track( gaps_, gap );
+  }
+  orbit_ = orbit;
+
+  // The firmware counters restart with the board
+  if (dropped < dropped_ || realigns < realigns_) {
+    stats.nbCounterResets++;
+  } else {
+    if (dropped > dropped_) {
+      stats.nbDropped += dropped - dropped_;
+      current_.nbDropped += dropped - dropped_;
+      track( dropping_, dropped - dropped_ );
+    }
+    if (realigns > realigns_) {
+      stats.nbRealigns += realigns - realigns_;
+      current_.nbRealigns += realigns - realigns_;
+      track( realigning_, realigns - realigns_ );
+    }
+  }
+  dropped_ = dropped;
+  realigns_ = realigns;
+}
+
+
+void TrailerMonitor::closeSample( tbb::tick_count now )
+{
+  current_.seconds = (now - sampleStart_).seconds();
+  history_.push_back( current_ );
+  if (history_.size() > history_length) {
+    history_.pop_front();
+  }
+
+  endEpisode( dropping_, current_.nbDropped );
+  endEpisode( realigning_, current_.nbRealigns );
+  endEpisode( gaps_, current_.nbGapOrbits );
+
+  current_ = Sample();
+  sampleStart_ = now;
+}
+
+
+void* TrailerMonitor::operator()( void* item )
+{
+  Slice *slice = static_cast<Slice*>( item );
+  tbb::tick_count now = tbb::tick_count::now();
+  bool print = false;
+
+  {
+    std::lock_guard<std::mutex> guard( lock_ );
+
+    // Empty packets only carry the run state, they close the samples when there is no data
+    if (slice->size() >= constants::orbit_trailer_size) {
+      stats.nbPackets++;
+      decode( slice->end() - constants::orbit_trailer_size );
+      print = control_.packets_per_report && (stats.nbPackets % control_.packets_per_report == 0);
+    }
+
+    if ((now - sampleStart_).seconds() >= sample_seconds) {
+      closeSample( now );
+    }
+  }
+
+  if (print) {
+    LOG(INFO) << '[' << name_ << "] " << report( false );
+  }
+  return slice;
+}
+
+
+std::string TrailerMonitor::report( bool series )
+{
+  std::lock_guard<std::mutex> guard( lock_ );
+  std::ostringstream out;
+
+  out << "HW: orbit " << orbit_ << ", autorealign " << realigns_ << ", dropped " << dropped_
+      << "; packets " << stats.nbPackets << ", dropped " << stats.nbDropped << ", realigns " << stats.nbRealigns
+      << ", gaps " << stats.nbGaps << " (" << stats.nbGapOrbits << " orbits)"
+      << ", duplicates " << stats.nbDuplicates << ", backwards " << stats.nbBackwards
+      << ", counter resets " << stats.nbCounterResets << ", bad trailers " << stats.nbBadTrailers;
+
+  for (const Episode *episode : { &dropping_, &realigning_, &gaps_ }) {
+    out << "; " << episode->what << ' ' << episode->nbEpisodes << " episode(s)" << (episode->active ? " ACTIVE" : "");
+  }
+
+  if (!history_.empty()) {
+    // Rates of the last complete sample
+    const Sample& last = history_.back();
+    out << std::fixed << std::setprecision(1)
+        << "; per second: orbits " << last.nbOrbits / last.seconds << ", dropped " << last.nbDropped / last.seconds
+        << ", realigns " << last.nbRealigns / last.seconds << ", gap orbits " << last.nbGapOrbits / last.seconds;
+  }
+
+  if (series) {
+    // Time series, oldest sample first
+    out << "; last " << history_.size() << " samples dropped/realigns/gap orbits:";
+    for (const Sample& sample : history_) {
+      out << ' ' << sample.nbDropped << '/' << sample.nbRealigns << '/' << sample.nbGapOrbits;
+    }
+  }
+  return out.str();
+}
@@ -0,0 +1,97 @@
+#ifndef TRAILERMONITOR_H
+#define TRAILERMONITOR_H
+
+/*
+ * Monitoring of the orbit trailer inserted by the firmware at the end of each orbit:
+ *   uint64_t 0xdeadbeefdeadbeef
+ *   uint64_t autorealign counter
+ *   uint64_t dropped orbit counter
+ *   uint64_t orbit counter
+ *
+ * The trailer at the end of each packet is decoded, which is cheap (one cache line).
+ * The increments of the counters and the gaps in the orbit counter are kept as
+ * a time series of one second samples, a warning is logged when the firmware
+ * starts dropping or realigning, and the counters are published for the run
+ * control command "stats". Gaps are counted assuming one orbit per packet.
+ */
+
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+#include "tbb/pipeline.h"
+#include "tbb/tick_count.h"
+
+#include "controls.h"
+
+class TrailerMonitor: public tbb::filter {
+public:
+  TrailerMonitor( const std::string& name, ctrl& control );
+  ~TrailerMonitor();
+
+  void* operator()( void* item ) /*override*/;
+
+private:
+  // Increments within one sample of the time series
+  struct Sample {
+    double seconds = 0;
+    uint64_t nbOrbits = 0;
+    uint64_t nbDropped = 0;
+    uint64_t nbRealigns = 0;
+    uint64_t nbGapOrbits = 0;
+  };
+
+  // Consecutive samples with increments of one counter
+  struct Episode {
+    const char *what;
+    bool active = false;
+    uint64_t count = 0;
+    uint64_t nbEpisodes = 0;
+  };
+
+  void decode( const char *trailer );
+
+  // Count an increment, an episode starts with the first one
+  void track( Episode& episode, uint64_t delta );
+  // An episode ends with a sample without increments
+  void endEpisode( Episode& episode, uint64_t delta );
+
+  // Append the current sample to the time series, lock_ has to be held
+  void closeSample( tbb::tick_count now );
+
+  // Counters and rates, with the time series if requested
+  std::string report( bool series );
+
+private:
+  std::string name_;
+  ctrl& control_;
+
+  std::mutex lock_;
+  bool first_;
+  uint64_t orbit_;
+  uint64_t dropped_;
+  uint64_t realigns_;
+
+  tbb::tick_count sampleStart_;
+  Sample current_;
+  std::deque<Sample> history_;
+
+  Episode dropping_;
+  Episode realigning_;
+  Episode gaps_;
+
+  struct Statistics {
+    uint64_t nbPackets = 0;
+    uint64_t nbBadTrailers = 0;
+    uint64_t nbDropped = 0;
+    uint64_t nbRealigns = 0;
+    uint64_t nbGaps = 0;
+    uint64_t nbGapOrbits = 0;
+    uint64_t nbDuplicates = 0;
+    uint64_t nbBackwards = 0;
+    uint64_t nbCounterResets = 0;
+  } stats;
+};
+
+#endif // TRAILERMONITOR_H
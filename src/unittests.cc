@@ -0,0 +1,646 @@
+/*
+ * Unit tests of the encoders, the checksums and the scanning helpers.
+ *
+ * The SIMD paths are checked against simple scalar references, the encoders
+ * with round trips of generated reformatted records.
+ *
+ * Build and run (requires Google Test):
+ *   $ make test
+ *   $ ./scdaq-unittests
+ */
+
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "checksum.h"
+#include "columnar.h"
+#include "compact.h"
+#include "continuity.h"
+#include "FileDmaInputFilter.h"
+#include "format.h"
+#include "slice.h"
+#include "trailer.h"
+
+// Distance of the orbit numbers taken as a restart by the continuity checker
+static constexpr uint32_t restart_distance = 1 << 20;
+
+static uint32_t next_random( uint32_t& seed )
+{
+  seed = seed * 1664525 + 1013904223;
+  return seed;
+}
+
+// Bit by bit CRC32C, the reference of the table and SSE4.2 versions
+static uint32_t reference_crc32c( const char *data, size_t size )
+{
+  uint32_t crc = ~0u;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= (uint8_t)data[i];
+    for (int k = 0; k < 8; k++) {
+      crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static std::vector<char> random_bytes( size_t size, uint32_t seed )
+{
+  std::vector<char> data( size );
+  for (char& c : data) {
+    c = (char)(next_random( seed ) >> 24);
+  }
+  return data;
+}
+
+
+/*
+ * Reformatted records (see StreamProcessor): header, bx, orbit and the muons of both blocks
+ */
+struct Record {
+  uint32_t header;
+  uint32_t bx;
+  uint32_t orbit;
+  std::vector<muon> muons;
+};
+
+static void append_record( std::vector<char>& rows, const Record& r )
+{
+  uint32_t words[3] = { r.header, r.bx, r.orbit };
+  rows.insert( rows.end(), reinterpret_cast<const char *>(words), reinterpret_cast<const char *>(words + 3) );
+  rows.insert( rows.end(), reinterpret_cast<const char *>(r.muons.data()), reinterpret_cast<const char *>(r.muons.data() + r.muons.size()) );
+}
+
+// Records of nbOrbits orbits with increasing bx, including the cases the compact
+// encoding stores explicitly: match words, header bits outside the fields and extra
+// words which are not the bx word
+static std::vector<Record> make_records( uint32_t firstOrbit, unsigned nbOrbits, uint32_t seed )
+{
+  std::vector<Record> records;
+  for (uint32_t orbit = firstOrbit; orbit != firstOrbit + nbOrbits; orbit++) {
+    uint32_t bx = next_random( seed ) % 20;
+    while (bx < 3564) {
+      Record r;
+      uint32_t mAcount = next_random( seed ) % 9;
+      uint32_t mBcount = next_random( seed ) % 9;
+      uint32_t bxmatch = next_random( seed ) % 4 ? 0xff : next_random( seed ) & 0xff;
+      uint32_t orbitmatch = next_random( seed ) % 4 ? 0xff : next_random( seed ) & 0xff;
+      r.header = (bxmatch << header_shifts::bxmatch) + (mAcount << header_shifts::mAcount)
+               + (orbitmatch << header_shifts::orbitmatch) + (mBcount << header_shifts::mBcount);
+      if (next_random( seed ) % 16 == 0) {
+        r.header |= 1 << 20;
+      }
+      r.bx = bx;
+      r.orbit = orbit;
+      for (uint32_t i = 0; i < mAcount + mBcount; i++) {
+        muon mu;
+        mu.f = next_random( seed );
+        mu.s = next_random( seed );
+        mu.extra = i < mAcount ? (bx & ~1u) : (bx | 1);
+        if (next_random( seed ) % 8 == 0) {
+          mu.extra = next_random( seed );
+        }
+        r.muons.push_back( mu );
+      }
+      records.push_back( r );
+      bx += 1 + next_random( seed ) % 200;
+    }
+  }
+  return records;
+}
+
+static std::vector<char> make_rows( const std::vector<Record>& records )
+{
+  std::vector<char> rows;
+  for (const Record& r : records) {
+    append_record( rows, r );
+  }
+  return rows;
+}
+
+
+/*
+ * CRC32C
+ */
+TEST(Checksum, KnownValues)
+{
+  EXPECT_EQ( checksum::crc32c( 0, "", 0 ), 0u );
+  EXPECT_EQ( checksum::crc32c( 0, "123456789", 9 ), 0xe3069283u );
+
+  // RFC 3720 B.4: 32 bytes of zeros and of ones
+  std::vector<char> zeros( 32, 0 ), ones( 32, (char)0xff );
+  EXPECT_EQ( checksum::crc32c( 0, zeros.data(), zeros.size() ), 0x8a9136aau );
+  EXPECT_EQ( checksum::crc32c( 0, ones.data(), ones.size() ), 0x62a8ab43u );
+}
+
+TEST(Checksum, MatchesReferenceAtAnyAlignmentAndSize)
+{
+  std::vector<char> data = random_bytes( 4096 + 64, 1 );
+  for (size_t offset = 0; offset < 16; offset++) {
+    for (size_t size : { 0, 1, 3, 7, 8, 9, 15, 16, 17, 63, 64, 65, 255, 1000, 4096 }) {
+      EXPECT_EQ( checksum::crc32c( 0, data.data() + offset, size ), reference_crc32c( data.data() + offset, size ) )
+          << "offset " << offset << " size " << size;
+    }
+  }
+}
+
+TEST(Checksum, Incremental)
+{
+  std::vector<char> data = random_bytes( 10000, 2 );
+  uint32_t whole = checksum::crc32c( 0, data.data(), data.size() );
+  for (size_t split : { 0, 1, 5, 8, 4095, 9999, 10000 }) {
+    uint32_t crc = checksum::crc32c( 0, data.data(), split );
+    EXPECT_EQ( checksum::crc32c( crc, data.data() + split, data.size() - split ), whole ) << "split " << split;
+  }
+}
+
+TEST(Checksum, Combine)
+{
+  std::vector<char> data = random_bytes( 100000, 3 );
+  uint32_t whole = checksum::crc32c( 0, data.data(), data.size() );
+  for (size_t split : { 0, 1, 7, 64, 4096, 65535, 99999, 100000 }) {
+    uint32_t crc1 = checksum::crc32c( 0, data.data(), split );
+    uint32_t crc2 = checksum::crc32c( 0, data.data() + split, data.size() - split );
+    EXPECT_EQ( checksum::crc32c_combine( crc1, crc2, data.size() - split ), whole ) << "split " << split;
+  }
+
+  // Combining is associative, as done for the header, data and trailer of a file
+  uint32_t a = checksum::crc32c( 0, data.data(), 64 );
+  uint32_t b = checksum::crc32c( 0, data.data() + 64, 1000 );
+  uint32_t c = checksum::crc32c( 0, data.data() + 1064, 32 );
+  EXPECT_EQ( checksum::crc32c_combine( checksum::crc32c_combine( a, b, 1000 ), c, 32 ),
+             checksum::crc32c( 0, data.data(), 1096 ) );
+  EXPECT_EQ( checksum::crc32c_combine( a, checksum::crc32c_combine( b, c, 32 ), 1032 ),
+             checksum::crc32c( 0, data.data(), 1096 ) );
+}
+
+
+/*
+ * Compact encoding
+ */
+static std::vector<char> compact_encode( const std::vector<char>& rows )
+{
+  std::vector<char> block( compact::max_encoded_size( rows.size() ) );
+  size_t size = compact::encode( rows.data(), rows.data() + rows.size(), block.data() );
+  EXPECT_LE( size, block.size() );
+  block.resize( size );
+  return block;
+}
+
+TEST(Compact, RoundTripRows)
+{
+  std::vector<Record> records = make_records( 1000, 3, 4 );
+  std::vector<char> rows = make_rows( records );
+  std::vector<char> block = compact_encode( rows );
+
+  compact_header header;
+  memcpy( &header, block.data(), sizeof(header) );
+  EXPECT_EQ( header.magic, uint32_t(compact_header::magic_number) );
+  EXPECT_EQ( header.block_size, block.size() );
+  EXPECT_EQ( header.nb_records, records.size() );
+  EXPECT_EQ( header.first_orbit, 1000u );
+  EXPECT_EQ( header.last_orbit, 1002u );
+  EXPECT_LT( block.size(), rows.size() );
+
+  ASSERT_EQ( compact::decoded_size( block.data(), block.size() ), rows.size() );
+  std::vector<char> decoded( rows.size() );
+  ASSERT_EQ( compact::decode_rows( block.data(), block.size(), decoded.data() ), rows.size() );
+  EXPECT_TRUE( decoded == rows );
+}
+
+TEST(Compact, RoundTripColumns)
+{
+  std::vector<Record> records = make_records( 0xfffffffe, 3, 5 );
+  std::vector<char> block = compact_encode( make_rows( records ) );
+
+  compact::Columns columns;
+  ASSERT_TRUE( compact::decode_columns( block.data(), block.size(), columns ) );
+  ASSERT_EQ( columns.orbit.size(), records.size() );
+  ASSERT_EQ( columns.first.size(), records.size() + 1 );
+  for (size_t i = 0; i < records.size(); i++) {
+    const Record& r = records[i];
+    EXPECT_EQ( columns.orbit[i], r.orbit );
+    EXPECT_EQ( columns.bx[i], r.bx );
+    EXPECT_EQ( columns.header[i], r.header );
+    ASSERT_EQ( columns.first[i+1] - columns.first[i], r.muons.size() );
+    for (size_t k = 0; k < r.muons.size(); k++) {
+      EXPECT_EQ( columns.muF[columns.first[i] + k], r.muons[k].f );
+      EXPECT_EQ( columns.muS[columns.first[i] + k], r.muons[k].s );
+      EXPECT_EQ( columns.muExtra[columns.first[i] + k], r.muons[k].extra );
+    }
+  }
+}
+
+TEST(Compact, StopsAtIncompleteRecord)
+{
+  std::vector<Record> records = make_records( 1, 1, 6 );
+  std::vector<char> rows = make_rows( records );
+  size_t complete = rows.size();
+  Record last = records.back();
+  last.muons.resize( 2 );
+  last.header = (2u << header_shifts::mAcount) + (0xffu << header_shifts::bxmatch) + (0xffu << header_shifts::orbitmatch);
+  append_record( rows, last );
+  rows.resize( rows.size() - 4 );
+
+  std::vector<char> block = compact_encode( rows );
+  EXPECT_EQ( compact::decoded_size( block.data(), block.size() ), complete );
+}
+
+TEST(Compact, RejectsCorruptedBlock)
+{
+  std::vector<char> block = compact_encode( make_rows( make_records( 1, 1, 7 ) ) );
+  EXPECT_EQ( compact::decoded_size( block.data(), block.size() - 1 ), 0u );
+
+  std::vector<char> bad = block;
+  bad[0] ^= 1;
+  EXPECT_EQ( compact::decoded_size( bad.data(), bad.size() ), 0u );
+
+  // The records have to fill the block exactly
+  compact_header header;
+  memcpy( &header, block.data(), sizeof(header) );
+  header.nb_records--;
+  memcpy( block.data(), &header, sizeof(header) );
+  compact::Columns columns;
+  EXPECT_FALSE( compact::decode_columns( block.data(), block.size(), columns ) );
+}
+
+
+/*
+ * Columnar encoding
+ */
+TEST(Columnar, BlockLayout)
+{
+  std::vector<Record> records = make_records( 500, 4, 8 );
+  std::vector<char> rows = make_rows( records );
+
+  // Two orbits per block, the first block ends at the start of the third orbit
+  ColumnarEncoder encoder( 2 );
+  const char *end = rows.data() + rows.size();
+  const char *stop = encoder.add( rows.data(), end );
+  ASSERT_NE( stop, end );
+  EXPECT_EQ( reinterpret_cast<const uint32_t *>( stop )[2], 502u );
+
+  std::vector<char> block;
+  encoder.encode( block );
+  EXPECT_TRUE( encoder.empty() );
+
+  columnar_header header;
+  ASSERT_GE( block.size(), sizeof(header) );
+  memcpy( &header, block.data(), sizeof(header) );
+  EXPECT_EQ( header.magic, uint32_t(columnar_header::magic_number) );
+  EXPECT_EQ( header.header_size, sizeof(header) );
+  EXPECT_EQ( header.block_size, block.size() );
+  EXPECT_EQ( header.nb_orbits, 2u );
+  EXPECT_EQ( header.first_orbit, 500u );
+  EXPECT_EQ( header.last_orbit, 501u );
+
+  std::vector<const Record*> blockRecords;
+  uint32_t nbMuons = 0;
+  for (const Record& r : records) {
+    if (r.orbit < 502) {
+      blockRecords.push_back( &r );
+      nbMuons += r.muons.size();
+    }
+  }
+  ASSERT_EQ( header.nb_records, blockRecords.size() );
+  ASSERT_EQ( header.nb_muons, nbMuons );
+
+  // Columns in order, 32 byte aligned, each one large enough and inside the block
+  const uint32_t offsets[columnar_header::nb_columns] = { header.orbit_offset, header.bx_offset, header.header_offset, header.first_offset,
+                                                          header.mu_f_offset, header.mu_s_offset, header.mu_extra_offset };
+  const uint32_t lengths[columnar_header::nb_columns] = { header.nb_records, header.nb_records, header.nb_records, header.nb_records + 1,
+                                                          header.nb_muons, header.nb_muons, header.nb_muons };
+  uint32_t previousEnd = sizeof(header);
+  for (unsigned c = 0; c < columnar_header::nb_columns; c++) {
+    EXPECT_EQ( offsets[c] % 32, 0u ) << "column " << c;
+    EXPECT_GE( offsets[c], previousEnd ) << "column " << c;
+    EXPECT_LT( offsets[c] - previousEnd, 32u ) << "column " << c;
+    previousEnd = offsets[c] + lengths[c] * sizeof(uint32_t);
+  }
+  EXPECT_LE( previousEnd, header.block_size );
+  EXPECT_EQ( header.block_size % 32, 0u );
+
+  auto column = [&block]( uint32_t offset ) { return reinterpret_cast<const uint32_t *>( block.data() + offset ); };
+  for (size_t i = 0; i < blockRecords.size(); i++) {
+    const Record& r = *blockRecords[i];
+    EXPECT_EQ( column(header.orbit_offset)[i], r.orbit );
+    EXPECT_EQ( column(header.bx_offset)[i], r.bx );
+    EXPECT_EQ( column(header.header_offset)[i], r.header );
+    uint32_t first = column(header.first_offset)[i];
+    ASSERT_EQ( column(header.first_offset)[i+1] - first, r.muons.size() );
+    for (size_t k = 0; k < r.muons.size(); k++) {
+      EXPECT_EQ( column(header.mu_f_offset)[first + k], r.muons[k].f );
+      EXPECT_EQ( column(header.mu_s_offset)[first + k], r.muons[k].s );
+      EXPECT_EQ( column(header.mu_extra_offset)[first + k], r.muons[k].extra );
+    }
+  }
+  EXPECT_EQ( column(header.first_offset)[header.nb_records], header.nb_muons );
+
+  // The rest goes to the next block
+  EXPECT_EQ( encoder.add( stop, end ), end );
+  encoder.encode( block );
+  memcpy( &header, block.data(), sizeof(header) );
+  EXPECT_EQ( header.first_orbit, 502u );
+  EXPECT_EQ( header.last_orbit, 503u );
+  EXPECT_EQ( header.nb_records, records.size() - blockRecords.size() );
+}
+
+
+/*
+ * Orbit trailer search
+ */
+static const char* reference_find( const char *begin, const char *end )
+{
+  for (const char *p = begin; end - p >= (ptrdiff_t)constants::orbit_trailer_size; p += sizeof(uint32_t)) {
+    if (trailer::is_trailer( p )) {
+      return p;
+    }
+  }
+  return end;
+}
+
+TEST(Trailer, FindMatchesReference)
+{
+  static constexpr size_t size = 256;
+  const uint32_t deadbeef = constants::deadbeef;
+
+  // Every start alignment, every trailer position and every buffer end around it
+  for (size_t offset = 0; offset < 16; offset++) {
+    for (size_t position = 0; position + constants::orbit_trailer_size <= size; position += sizeof(uint32_t)) {
+      std::vector<char> buffer = random_bytes( size + 16, position );
+      char *begin = buffer.data() + offset;
+      // A single 0xdeadbeef word before the trailer is not a trailer
+      if (position >= 2 * sizeof(uint32_t)) {
+        memcpy( begin + position - 2 * sizeof(uint32_t), &deadbeef, sizeof(deadbeef) );
+      }
+      memcpy( begin + position, &deadbeef, sizeof(deadbeef) );
+      memcpy( begin + position + sizeof(uint32_t), &deadbeef, sizeof(deadbeef) );
+
+      for (size_t length = 0; length <= size; length += sizeof(uint32_t)) {
+        const char *end = begin + length;
+        ASSERT_EQ( trailer::find( begin, end ), reference_find( begin, end ) )
+            << "offset " << offset << " position " << position << " length " << length;
+      }
+    }
+  }
+}
+
+TEST(Trailer, FindWithoutTrailer)
+{
+  std::vector<char> buffer( 1024, 0 );
+  const uint32_t deadbeef = constants::deadbeef;
+  // 0xdeadbeef words which are not followed by a second one
+  for (size_t i = 0; i < buffer.size(); i += 3 * sizeof(uint32_t)) {
+    memcpy( buffer.data() + i, &deadbeef, sizeof(deadbeef) );
+  }
+  for (size_t offset = 0; offset < 16; offset++) {
+    const char *begin = buffer.data() + offset;
+    const char *end = buffer.data() + buffer.size() - 16 + offset;
+    EXPECT_EQ( trailer::find( begin, end ), end );
+    EXPECT_EQ( reference_find( begin, end ), end );
+  }
+}
+
+
+/*
+ * Orbit sequence of the continuity checker
+ */
+typedef ContinuityChecker::Sequence Sequence;
+
+static Sequence make_sequence( std::initializer_list<uint32_t> orbits )
+{
+  Sequence s;
+  for (uint32_t orbit : orbits) {
+    s.add( orbit );
+  }
+  return s;
+}
+
+TEST(Continuity, ConsecutiveOrbits)
+{
+  Sequence s = make_sequence( { 10, 11, 12, 13 } );
+  EXPECT_EQ( s.first, 10u );
+  EXPECT_EQ( s.last, 13u );
+  EXPECT_EQ( s.nbOrbits, 4u );
+  EXPECT_EQ( s.nbGaps + s.nbDuplicates + s.nbReordered + s.nbRestarts, 0u );
+
+  // The orbit counter wraps around
+  s = make_sequence( { 0xfffffffe, 0xffffffff, 0, 1 } );
+  EXPECT_EQ( s.nbGaps + s.nbDuplicates + s.nbReordered + s.nbRestarts, 0u );
+
+  s = make_sequence( { 0xfffffffe, 1, 0 } );
+  EXPECT_EQ( s.nbGaps, 1u );
+  EXPECT_EQ( s.nbGapOrbits, 2u );
+  EXPECT_EQ( s.nbReordered, 1u );
+  EXPECT_EQ( s.nbRestarts, 0u );
+}
+
+TEST(Continuity, GapsAndDuplicates)
+{
+  Sequence s = make_sequence( { 10, 13, 13, 14, 20 } );
+  EXPECT_EQ( s.nbGaps, 2u );
+  EXPECT_EQ( s.nbGapOrbits, 2u + 5u );
+  EXPECT_EQ( s.nbDuplicates, 1u );
+  EXPECT_EQ( s.nbReordered + s.nbRestarts, 0u );
+}
+
+TEST(Continuity, ReorderedOrRestarted)
+{
+  // A step back is reordering up to the restart distance
+  Sequence s = make_sequence( { 5000000, 4999999 } );
+  EXPECT_EQ( s.nbReordered, 1u );
+  EXPECT_EQ( s.nbRestarts, 0u );
+
+  s = make_sequence( { 5000000, 5000000 - restart_distance } );
+  EXPECT_EQ( s.nbReordered, 1u );
+  EXPECT_EQ( s.nbRestarts, 0u );
+
+  s = make_sequence( { 5000000, 5000000 - restart_distance - 1 } );
+  EXPECT_EQ( s.nbReordered, 0u );
+  EXPECT_EQ( s.nbRestarts, 1u );
+
+  // A new run starting again at a low orbit number
+  s = make_sequence( { 5000000, 5000001, 1, 2 } );
+  EXPECT_EQ( s.nbRestarts, 1u );
+  EXPECT_EQ( s.nbReordered + s.nbGaps + s.nbDuplicates, 0u );
+  EXPECT_EQ( s.last, 2u );
+
+  // A jump forward is a gap up to the restart distance
+  s = make_sequence( { 100, 100 + restart_distance } );
+  EXPECT_EQ( s.nbGaps, 1u );
+  EXPECT_EQ( s.nbRestarts, 0u );
+
+  s = make_sequence( { 100, 100 + restart_distance + 1 } );
+  EXPECT_EQ( s.nbGaps, 0u );
+  EXPECT_EQ( s.nbRestarts, 1u );
+}
+
+TEST(Continuity, AppendPackets)
+{
+  // The step between the packets is classified like the ones inside them
+  Sequence total = make_sequence( { 10, 11 } );
+  total.append( make_sequence( { 13, 14, 14 } ) );
+  total.append( Sequence() );
+  total.append( make_sequence( { 12 } ) );
+  total.append( make_sequence( { 1, 2 } ) );
+
+  Sequence expected = make_sequence( { 10, 11, 13, 14, 14, 12, 1, 2 } );
+  EXPECT_EQ( total.first, expected.first );
+  EXPECT_EQ( total.last, expected.last );
+  EXPECT_EQ( total.nbOrbits, expected.nbOrbits );
+  EXPECT_EQ( total.nbGaps, expected.nbGaps );
+  EXPECT_EQ( total.nbGapOrbits, expected.nbGapOrbits );
+  EXPECT_EQ( total.nbDuplicates, expected.nbDuplicates );
+  EXPECT_EQ( total.nbReordered, expected.nbReordered );
+  EXPECT_EQ( total.nbRestarts, expected.nbRestarts );
+  EXPECT_EQ( total.nbReordered, 2u );
+  EXPECT_EQ( total.nbRestarts, 0u );
+}
+
+
+/*
+ * Packet reading of the filedma input
+ */
+static constexpr size_t file_packet_buffer_size = 4096;
+
+// Temporary input file, removed at the end of the test
+struct InputFile {
+  std::string name;
+
+  explicit InputFile( const std::vector<char>& data )
+  {
+    char fileName[] = "/tmp/scdaq-unittests-XXXXXX";
+    int fd = mkstemp( fileName );
+    if (fd >= 0) {
+      name = fileName;
+      EXPECT_EQ( write( fd, data.data(), data.size() ), (ssize_t)data.size() );
+      close( fd );
+    }
+  }
+  ~InputFile() { unlink( name.c_str() ); }
+};
+
+// Packet of 32 byte blocks, the last one is the orbit trailer
+static void append_packet( std::vector<char>& data, size_t nbBlocks )
+{
+  for (size_t i = 0; i + 1 < nbBlocks; i++) {
+    data.insert( data.end(), 32, char(i + 1) );
+  }
+  const uint32_t deadbeef = constants::deadbeef;
+  std::vector<char> trailer( constants::orbit_trailer_size, 0 );
+  memcpy( trailer.data(), &deadbeef, sizeof(deadbeef) );
+  memcpy( trailer.data() + sizeof(uint32_t), &deadbeef, sizeof(deadbeef) );
+  data.insert( data.end(), trailer.begin(), trailer.end() );
+}
+
+static void init_control( ctrl& control )
+{
+  control.running = false;
+  control.packets_per_report = 0;
+  control.overload_policy = OverloadPolicy::BLOCK;
+  control.overload_spill_buffers = 0;
+}
+
+// Size of the next packet read by the input
+static size_t read_packet( tbb::filter& input )
+{
+  Slice *packet = static_cast<Slice *>( input( NULL ) );
+  size_t size = packet->size();
+  Slice::giveAllocated( packet );
+  return size;
+}
+
+TEST(FileDmaInput, ReadsAgainFromTheStart)
+{
+  // Two packets followed by a packet cut by the end of the file
+  std::vector<char> data;
+  append_packet( data, 2 );
+  append_packet( data, 3 );
+  data.insert( data.end(), 40, 1 );
+  InputFile file( data );
+  ASSERT_FALSE( file.name.empty() );
+
+  ctrl control;
+  init_control( control );
+  FileDmaInputFilter input( file.name, file_packet_buffer_size, 4, control );
+  for (int pass = 0; pass < 3; pass++) {
+    EXPECT_EQ( read_packet( input ), 64u );
+    EXPECT_EQ( read_packet( input ), 96u );
+  }
+}
+
+TEST(FileDmaInput, ThrowsWithoutTrailer)
+{
+  // Larger than the buffer, the reading is resynchronized on a trailer that does not exist
+  InputFile file( std::vector<char>( 100 * 1024, 1 ) );
+  ASSERT_FALSE( file.name.empty() );
+
+  ctrl control;
+  init_control( control );
+  FileDmaInputFilter input( file.name, file_packet_buffer_size, 4, control );
+  EXPECT_THROW( read_packet( input ), std::runtime_error );
+}
+
+TEST(FileDmaInput, ThrowsOnTruncatedPacket)
+{
+  // A single packet cut by the end of the file
+  std::vector<char> data;
+  append_packet( data, 4 );
+  data.resize( data.size() - 16 );
+  InputFile file( data );
+  ASSERT_FALSE( file.name.empty() );
+
+  ctrl control;
+  init_control( control );
+  FileDmaInputFilter input( file.name, file_packet_buffer_size, 4, control );
+  EXPECT_THROW( read_packet( input ), std::runtime_error );
+}
+
+// Exposes the statistics printed by the input
+struct TestFileDmaInput: public FileDmaInputFilter {
+  using FileDmaInputFilter::FileDmaInputFilter;
+
+  std::string statistics() const
+  {
+    std::ostringstream out;
+    print( out );
+    return out.str();
+  }
+};
+
+TEST(FileDmaInput, TimestampsFollowSkippedPackets)
+{
+  // The oversized packet in the middle is skipped, its timestamp has to be skipped too
+  std::vector<char> data;
+  append_packet( data, 2 );
+  append_packet( data, 2 * file_packet_buffer_size / 32 );
+  append_packet( data, 3 );
+  InputFile file( data );
+  std::string times = "0\n70\n0.01\n";
+  InputFile timestamps( std::vector<char>( times.begin(), times.end() ) );
+  ASSERT_FALSE( file.name.empty() );
+  ASSERT_FALSE( timestamps.name.empty() );
+
+  ctrl control;
+  init_control( control );
+  ReplayConfig replay;
+  replay.pacing = ReplayConfig::Pacing::TIMESTAMPS;
+  replay.timestampFile = timestamps.name;
+  TestFileDmaInput input( file.name, file_packet_buffer_size, 4, control, replay );
+
+  // Taking 70 seconds for the last packet would restart the pacing
+  EXPECT_EQ( read_packet( input ), 64u );
+  EXPECT_EQ( read_packet( input ), 96u );
+  EXPECT_NE( input.statistics().find( "rebases 0" ), std::string::npos ) << input.statistics();
+
+  // The sidecar starts again with the file
+  EXPECT_EQ( read_packet( input ), 64u );
+  EXPECT_NE( input.statistics().find( "rebases 1" ), std::string::npos ) << input.statistics();
+}
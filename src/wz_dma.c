@@ -4,21 +4,183 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <errno.h>
 
 #include "wz_dma.h"
+#include "wz_emu.h"
 
 // perror may modify errno, we have to save it
 #define PERROR(msg) do { int err = errno; perror(msg); errno = err; } while (0)
 
+static const struct wz_backend wz_hardware_backend;
+
+/* Use the DMA board through the WZ XDMA driver */
+void wz_use_hardware(struct wz_private* wz, unsigned board)
+{
+	wz->backend = &wz_hardware_backend;
+	wz->board = board;
+	wz->emu = NULL;
+	wz->prefault_threads = 1;
+	wz->prefault_seconds = 0;
+	wz->wrap_buf = NULL;
+	wz->wrap_buf_len = 0;
+}
+
+/* Use the user-space emulator instead of the board */
+void wz_use_emulator(struct wz_private* wz, const struct wz_emu_config* config)
+{
+	wz->backend = &wz_emulator_backend;
+	wz->board = 0;
+	wz->emu_config = *config;
+	wz->emu = NULL;
+	wz->prefault_threads = 1;
+	wz->prefault_seconds = 0;
+	wz->wrap_buf = NULL;
+	wz->wrap_buf_len = 0;
+}
+
+
+int wz_map_ring(struct wz_private* wz, int fd, int64_t ring_len)
+{
+	// Reserve address space for both copies, then map the ring over it
+	char *base = (char *) mmap(NULL, 2 * ring_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		PERROR("Can't reserve address space for data buffer");
+		return -1;
+	}
+
+	if (mmap(base, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		PERROR("Can't mmap data buffer");
+		munmap(base, 2 * ring_len);
+		return -1;
+	}
+	wz->data_buf = base;
+	wz->ring_len = ring_len;
+
+	// Without the mirror, wrapped blocks have to be copied in wz_read_start
+	wz->mirrored = (mmap(base + ring_len, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED);
+	if (!wz->mirrored) {
+		PERROR("Can't mirror data buffer, wrapped blocks will be copied");
+	}
+
+	return 0;
+}
+
+void wz_unmap_ring(struct wz_private* wz)
+{
+	if (wz->data_buf) {
+		munmap((void *) wz->data_buf, 2 * wz->ring_len);
+		wz->data_buf = NULL;
+	}
+}
+
+
+/* Return the page size backing the mapping at addr (hugepages are reported in /proc/self/smaps) */
+static size_t mapping_page_size(const volatile void *addr)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	unsigned long start, end, kb;
+	int found = 0;
+	char line[256];
+
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	if (!smaps) {
+		return page_size;
+	}
+
+	while (fgets(line, sizeof(line), smaps)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			found = (start <= (unsigned long) addr && (unsigned long) addr < end);
+		} else if (found && sscanf(line, "KernelPageSize: %lu kB", &kb) == 1) {
+			page_size = kb * 1024;
+			break;
+		}
+	}
+
+	fclose(smaps);
+	return page_size;
+}
+
+struct prefault_range {
+	volatile char *buf;
+	size_t len;
+	size_t step;
+};
+
+static void *prefault_range(void *arg)
+{
+	struct prefault_range *range = (struct prefault_range *) arg;
+	size_t i;
+	for (i = 0; i < range->len; i += range->step) {
+		// Touch memory so it is really allocated
+		range->buf[i] = range->buf[i];
+	}
+	return NULL;
+}
+
+int wz_prefault(volatile char *buf, size_t len, unsigned nof_threads)
+{
+	enum { MAX_THREADS = 64 };
+	struct prefault_range ranges[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	unsigned i, nof_started;
+	size_t step = mapping_page_size(buf);
+
+	if (nof_threads < 1) {
+		nof_threads = 1;
+	}
+	if (nof_threads > MAX_THREADS) {
+		nof_threads = MAX_THREADS;
+	}
+
+	// Each thread gets a contiguous range, aligned to pages
+	size_t chunk = (len / nof_threads + step - 1) / step * step;
+	for (i = 0; i < nof_threads; i++) {
+		size_t offset = i * chunk < len ? i * chunk : len;
+		ranges[i].buf = buf + offset;
+		ranges[i].len = (offset + chunk < len ? chunk : len - offset);
+		ranges[i].step = step;
+	}
+
+	// The first range is touched by the calling thread
+	for (nof_started = 1; nof_started < nof_threads; nof_started++) {
+		if (pthread_create(&threads[nof_started], NULL, prefault_range, &ranges[nof_started]) != 0) {
+			break;
+		}
+	}
+	prefault_range(&ranges[0]);
+
+	for (i = 1; i < nof_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	// If a thread failed to start, touch the rest here
+	for (i = nof_started; i < nof_threads; i++) {
+		prefault_range(&ranges[i]);
+	}
+
+	return 0;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
 /* Open necessary devices and map DMAable memory */
-int wz_init(struct wz_private* wz) 
+static int hw_init(struct wz_private* wz) 
 {
 	int res;
+	char dev[64];
 
 	wz->fd_user = -1;
 	wz->fd_control = -1;
@@ -28,18 +190,24 @@ int wz_init(struct wz_private* wz)
 
 	//int err = 0;
 
-	if ( (wz->fd_user = open("/dev/wz-xdma0_user", O_RDWR)) < 0 ) {
-		PERROR("Can't open /dev/wz-xdma0_user");
+	snprintf(dev, sizeof(dev), "/dev/wz-xdma%u_user", wz->board);
+	if ( (wz->fd_user = open(dev, O_RDWR)) < 0 ) {
+		fprintf(stderr, "Can't open %s: ", dev);
+		PERROR("");
 		return -1;
 	};
 
-	if ( (wz->fd_control = open("/dev/wz-xdma0_control", O_RDWR)) < 0 ) {
-		PERROR("Can't open /dev/wz-xdma0_control");
+	snprintf(dev, sizeof(dev), "/dev/wz-xdma%u_control", wz->board);
+	if ( (wz->fd_control = open(dev, O_RDWR)) < 0 ) {
+		fprintf(stderr, "Can't open %s: ", dev);
+		PERROR("");
 		return -1;
 	};
 
-	if ( (wz->fd_memory = open("/dev/wz-xdma0_c2h_0", O_RDWR)) < 0 ) {
-		PERROR("Can't open /dev/wz-xdma0_c2h_0");
+	snprintf(dev, sizeof(dev), "/dev/wz-xdma%u_c2h_0", wz->board);
+	if ( (wz->fd_memory = open(dev, O_RDWR)) < 0 ) {
+		fprintf(stderr, "Can't open %s: ", dev);
+		PERROR("");
 		return -1;
 	};
 
@@ -55,27 +223,23 @@ int wz_init(struct wz_private* wz)
 		return -1;	
 	}
 
-	if ( (wz->data_buf = (volatile char *) mmap(NULL, TOT_BUF_LEN, PROT_READ|PROT_WRITE, MAP_SHARED, wz->fd_memory, 0)) == MAP_FAILED) { 
-		PERROR("Can't mmap data buffer");
+	if ( wz_map_ring(wz, wz->fd_memory, TOT_BUF_LEN) < 0 ) {
 		return -1;
 	}
 
-	// Ensure, that all pages are mapped (allocated)
-	// Assume page size is 4096. If it is larger, it will not hurt, just take long(er) time
-	int pagesize = 4096;
-	unsigned long i;
-	for (i = 0; i < TOT_BUF_LEN; i += pagesize) {
-		// Touch memory so it is really allocated
-        ((volatile char*) wz->data_buf)[i] = ((volatile char*) wz->data_buf)[i];
-	}
+	// Ensure, that all pages are mapped (allocated), this takes seconds for the whole buffer
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wz_prefault(wz->data_buf, TOT_BUF_LEN, wz->prefault_threads);
+	wz->prefault_seconds = seconds_since(&start);
 
 	return 0;
 }
 
-/* The opposite of wz_init */
-int wz_close(struct wz_private* wz) 
+/* The opposite of hw_init */
+static int hw_close(struct wz_private* wz) 
 {
-	munmap((void *)wz->data_buf, TOT_BUF_LEN);
+	wz_unmap_ring(wz);
 	munmap((void *)wz->usr_regs, 1024*1024);
 	ioctl(wz->fd_memory, IOCTL_XDMA_WZ_FREE_BUFFERS, 0L);
 	close(wz->fd_memory);
@@ -85,26 +249,82 @@ int wz_close(struct wz_private* wz)
 }
 
 /* Start the DMA engine */
-inline int wz_start_dma(struct wz_private* wz)
+static int hw_start_dma(struct wz_private* wz)
 {
 	return ioctl(wz->fd_memory, IOCTL_XDMA_WZ_START, 0L);
 }
 
 /* Stop the DMA engine */
-inline int wz_stop_dma(struct wz_private* wz)
+static int hw_stop_dma(struct wz_private* wz)
 {
 	return ioctl(wz->fd_memory, IOCTL_XDMA_WZ_STOP, 0L);
 }
 
+static int hw_get_buf(struct wz_private* wz) 
+{
+	return ioctl(wz->fd_memory, IOCTL_XDMA_WZ_GETBUF, (long) &wz->bdesc);
+}
+
+static int hw_confirm_buf(struct wz_private* wz)
+{		
+	return ioctl(wz->fd_memory, IOCTL_XDMA_WZ_CONFIRM, (long) &wz->bconf);
+}
+
+static int hw_get_free(struct wz_private* wz)
+{
+	return ioctl(wz->fd_memory, IOCTL_XDMA_WZ_GETFREE, 0L);
+}
+
+static const struct wz_backend wz_hardware_backend = {
+	.name = "hardware",
+	.init = hw_init,
+	.close = hw_close,
+	.start_dma = hw_start_dma,
+	.stop_dma = hw_stop_dma,
+	.get_buf = hw_get_buf,
+	.confirm_buf = hw_confirm_buf,
+	.get_free = hw_get_free,
+};
+
+
+/* Open the DMA backend and map its memory, the hardware is used if no backend was selected */
+int wz_init(struct wz_private* wz)
+{
+	if (!wz->backend) {
+		wz_use_hardware(wz, 0);
+	}
+	return wz->backend->init(wz);
+}
+
+/* The opposite of wz_init */
+int wz_close(struct wz_private* wz)
+{
+	free(wz->wrap_buf);
+	wz->wrap_buf = NULL;
+	wz->wrap_buf_len = 0;
+	return wz->backend->close(wz);
+}
+
+/* Start the DMA engine */
+inline int wz_start_dma(struct wz_private* wz)
+{
+	return wz->backend->start_dma(wz);
+}
+
+/* Stop the DMA engine */
+inline int wz_stop_dma(struct wz_private* wz)
+{
+	return wz->backend->stop_dma(wz);
+}
 
 static inline int wz_get_buf(struct wz_private* wz) 
 {
-	return ioctl(wz->fd_memory, IOCTL_XDMA_WZ_GETBUF, (long) &wz->bdesc);
+	return wz->backend->get_buf(wz);
 }
 
 static inline int wz_confirm_buf(struct wz_private* wz)
 {		
-	return ioctl(wz->fd_memory, IOCTL_XDMA_WZ_CONFIRM, (long) &wz->bconf);
+	return wz->backend->confirm_buf(wz);
 }
 
 
@@ -118,10 +338,32 @@ inline ssize_t wz_read_start(struct wz_private* wz, char **buffer)
 
 	int64_t start_offset = (int64_t)wz->bdesc.first_desc * (int64_t)WZ_DMA_BUFLEN;
 	int64_t end_offset   = (int64_t)wz->bdesc.last_desc * (int64_t)WZ_DMA_BUFLEN + (int64_t) wz->bdesc.last_len;
+
+	// The block wraps around the end of the ring, it continues in the mirror
+	if (wz->bdesc.last_desc < wz->bdesc.first_desc) {
+		end_offset += wz->ring_len;
+	}
 	int64_t bytes_read = end_offset - start_offset;
 
 	*buffer = (char *)(wz->data_buf + start_offset);
 
+	if (end_offset > wz->ring_len && !wz->mirrored) {
+		// Assemble the block in a separate buffer
+		if (wz->wrap_buf_len < (size_t) bytes_read) {
+			char *buf = realloc(wz->wrap_buf, bytes_read);
+			if (!buf) {
+				errno = ENOMEM;
+				return -1;
+			}
+			wz->wrap_buf = buf;
+			wz->wrap_buf_len = bytes_read;
+		}
+		size_t head_len = wz->ring_len - start_offset;
+		memcpy(wz->wrap_buf, (char *)(wz->data_buf + start_offset), head_len);
+		memcpy(wz->wrap_buf + head_len, (char *) wz->data_buf, bytes_read - head_len);
+		*buffer = wz->wrap_buf;
+	}
+
 	return bytes_read;
 }
 
@@ -135,6 +377,19 @@ inline int wz_read_complete(struct wz_private* wz)
 	return wz_confirm_buf( wz );
 }
 
+inline int wz_confirm(struct wz_private* wz, uint32_t first_desc, uint32_t last_desc)
+{
+	wz->bconf.first_desc = first_desc;
+	wz->bconf.last_desc = last_desc;
+
+	return wz_confirm_buf( wz );
+}
+
+inline int wz_get_free(struct wz_private* wz)
+{
+	return wz->backend->get_free(wz);
+}
+
 
 /* 
  * The user logic is driving custom FPGA logic. This is not necessary to use if not implemented in the FPGA.
@@ -1,10 +1,41 @@
 #ifndef WZ_XDMA_H
 #define WZ_XDMA_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "wzdma/xdma-ioctl.h"
 
 #define TOT_BUF_LEN ((int64_t) WZ_DMA_BUFLEN * (int64_t) WZ_DMA_NOFBUFS)
 
+struct wz_private;
+struct wz_emu;
+
+/* Settings of the user-space emulator of the WZ DMA board and driver */
+struct wz_emu_config {
+	uint32_t nof_bufs;         /* Number of ring buffers to use, power of 2 up to WZ_DMA_NOFBUFS */
+	double rate;               /* Data rate in bytes per second, 0 for as fast as possible */
+	uint32_t bx_per_packet;    /* Packet size in bunch crossings, one orbit per packet */
+	uint32_t eio_every;        /* Fail every N-th read with EIO, 0 to disable */
+	uint32_t oversized_every;  /* Make every N-th packet two DMA buffers long, 0 to disable */
+	int wrap;                  /* Allow packets to wrap around the end of the ring */
+};
+
+/* Operations implemented by a DMA backend (the hardware or the emulator) */
+struct wz_backend {
+	const char *name;
+	int (*init)(struct wz_private* wz);
+	int (*close)(struct wz_private* wz);
+	int (*start_dma)(struct wz_private* wz);
+	int (*stop_dma)(struct wz_private* wz);
+	/* Fill wz->bdesc with the next received block */
+	int (*get_buf)(struct wz_private* wz);
+	/* Release buffers given by wz->bconf */
+	int (*confirm_buf)(struct wz_private* wz);
+	/* Return the number of free buffers in the ring */
+	int (*get_free)(struct wz_private* wz);
+};
+
 struct wz_private {
 	struct wz_xdma_data_block_desc bdesc __attribute__ ((aligned (8) ));
 	struct wz_xdma_data_block_confirm bconf __attribute__ ((aligned (8) ));
@@ -13,19 +44,48 @@ struct wz_private {
 	int fd_memory;
 	volatile uint32_t *usr_regs;
 	volatile char *data_buf;
+	/* Board number in the device names, /dev/wz-xdma<board>_* */
+	unsigned board;
+	/* Length of the ring at data_buf, it is mapped a second time right after itself if mirrored */
+	int64_t ring_len;
+	int mirrored;
+	/* Copy of a wrapped block when the ring could not be mirrored */
+	char *wrap_buf;
+	size_t wrap_buf_len;
+	const struct wz_backend *backend;
+	struct wz_emu_config emu_config;
+	struct wz_emu *emu;
+	/* Number of threads touching the data buffer in wz_init, and the time it took */
+	unsigned prefault_threads;
+	double prefault_seconds;
 };
 
 #ifdef __cplusplus
 extern "C" {
 #endif
+    /* Select the backend, has to be called before wz_init */
+    void wz_use_hardware(struct wz_private* wz, unsigned board);
+    void wz_use_emulator(struct wz_private* wz, const struct wz_emu_config* config);
+
     int wz_init(struct wz_private* wz);
     int wz_close(struct wz_private* wz);
     int wz_start_dma(struct wz_private* wz);
     int wz_stop_dma(struct wz_private* wz);
     ssize_t wz_read_start(struct wz_private* wz, char **buffer);
     int wz_read_complete(struct wz_private* wz);
+    /* Release buffers from first_desc to last_desc, they may cover several blocks */
+    int wz_confirm(struct wz_private* wz, uint32_t first_desc, uint32_t last_desc);
+    /* Return the number of free buffers in the ring (IOCTL_XDMA_WZ_GETFREE) */
+    int wz_get_free(struct wz_private* wz);
 
 	int wz_reset_board();
+
+	/* Map ring_len bytes of fd at wz->data_buf twice back to back, so blocks wrapping around the end are contiguous */
+	int wz_map_ring(struct wz_private* wz, int fd, int64_t ring_len);
+	void wz_unmap_ring(struct wz_private* wz);
+
+	/* Touch all pages of a buffer using several threads, so they are really allocated */
+	int wz_prefault(volatile char *buf, size_t len, unsigned nof_threads);
 #ifdef __cplusplus
 } // extern "C"
 #endif
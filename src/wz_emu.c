@@ -0,0 +1,397 @@
+/*
+ * This file implements the user-space emulator of the WZ DMA board and driver.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "wz_emu.h"
+
+// perror may modify errno, we have to save it
+#define PERROR(msg) do { int err = errno; perror(msg); errno = err; } while (0)
+
+// Size of a block1 record and of the orbit trailer
+#define EMU_BX_SIZE 192
+#define EMU_TRAILER_SIZE 32
+
+struct wz_emu {
+	struct wz_emu_config config;
+	int fd_ring;
+
+	pthread_t producer;
+	int producer_started;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+
+	/* Protected by lock */
+	int running;
+	int shutdown;
+	/* Received blocks waiting for GETBUF */
+	struct wz_xdma_data_block_desc *blocks;
+	uint32_t blocks_head;
+	uint32_t blocks_count;
+	/* Next buffer written by the producer and the oldest unconfirmed buffer */
+	uint32_t head;
+	uint32_t tail;
+	uint32_t nof_used;
+
+	/* Counters, the dropped orbit counter is reported in the trailer */
+	uint64_t nof_reads;
+	uint64_t nof_packets;
+	uint64_t nof_dropped;
+
+	/* Staging buffer for the packet being written */
+	char *packet;
+	size_t packet_len;
+};
+
+
+/* Prepare one orbit of data with 8 muons in each bx, orbit numbers are patched per packet */
+static void emu_fill_template(struct wz_emu *emu)
+{
+	uint32_t i, bx;
+	uint32_t seed = 12345;
+
+	for (bx = 0; bx < emu->config.bx_per_packet; bx++) {
+		uint32_t *words = (uint32_t *)(emu->packet + bx * EMU_BX_SIZE);
+		for (i = 0; i < 8; i++) {
+			seed = seed * 1664525 + 1013904223;
+			words[i] = 0;                                    /* orbit */
+			words[8 + i] = (bx * 3564 / emu->config.bx_per_packet) & 0x1fff;  /* bx */
+			words[16 + i] = seed | (1 << 10);                /* mu1f, pt > 0 */
+			words[24 + i] = seed ^ 0x5a5a5a5a;               /* mu1s */
+			words[32 + i] = 0;                               /* mu2f */
+			words[40 + i] = 0;                               /* mu2s */
+		}
+	}
+}
+
+static void emu_set_orbit(struct wz_emu *emu, uint64_t orbit)
+{
+	uint32_t i, bx;
+	for (bx = 0; bx < emu->config.bx_per_packet; bx++) {
+		uint32_t *words = (uint32_t *)(emu->packet + bx * EMU_BX_SIZE);
+		for (i = 0; i < 8; i++) {
+			words[i] = (uint32_t) orbit;
+		}
+	}
+
+	uint64_t *trailer = (uint64_t *)(emu->packet + emu->packet_len - EMU_TRAILER_SIZE);
+	trailer[0] = 0xdeadbeefdeadbeefULL;
+	trailer[1] = 0;                  /* autorealign counter */
+	trailer[2] = emu->nof_dropped;   /* dropped orbit counter */
+	trailer[3] = orbit;              /* orbit counter */
+}
+
+/* Copy len bytes into the ring at the start of buffer first, wrapping around the end of the ring */
+static void emu_write_ring(struct wz_private *wz, uint32_t first, const char *src, size_t len)
+{
+	size_t ring_len = (size_t) wz->emu->config.nof_bufs * WZ_DMA_BUFLEN;
+	size_t offset = (size_t) first * WZ_DMA_BUFLEN;
+	size_t n = len < ring_len - offset ? len : ring_len - offset;
+
+	memcpy((char *) wz->data_buf + offset, src, n);
+	if (n < len) {
+		memcpy((char *) wz->data_buf, src + n, len - n);
+	}
+}
+
+/* Wait until the time when the given number of bytes should have been sent at the configured rate */
+static void emu_pace(struct wz_emu *emu, const struct timespec *start, uint64_t bytes)
+{
+	if (emu->config.rate <= 0) {
+		return;
+	}
+
+	double seconds = bytes / emu->config.rate;
+	struct timespec t = *start;
+	t.tv_sec += (time_t) seconds;
+	t.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+	if (t.tv_nsec >= 1000000000L) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000L;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR) {
+	}
+}
+
+/* Emulates the firmware: writes orbits into free buffers, drops them if the ring is full */
+static void *emu_producer(void *arg)
+{
+	struct wz_private *wz = (struct wz_private *) arg;
+	struct wz_emu *emu = wz->emu;
+	uint32_t nof_bufs = emu->config.nof_bufs;
+	uint64_t orbit = 1;
+	uint64_t bytes = 0;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (1) {
+		pthread_mutex_lock(&emu->lock);
+		while (!emu->running && !emu->shutdown) {
+			pthread_cond_wait(&emu->ready, &emu->lock);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			bytes = 0;
+		}
+		if (emu->shutdown) {
+			pthread_mutex_unlock(&emu->lock);
+			break;
+		}
+
+		/* Oversized packets are not filled, they are never read */
+		int oversized = emu->config.oversized_every && (emu->nof_packets + 1) % emu->config.oversized_every == 0;
+		size_t len = oversized ? 2 * (size_t) WZ_DMA_BUFLEN + EMU_TRAILER_SIZE : emu->packet_len;
+		uint32_t nof_packet_bufs = (len + WZ_DMA_BUFLEN - 1) / WZ_DMA_BUFLEN;
+
+		/* Without wrapping, the block starts again at the first buffer, the skipped buffers stay used until confirmed */
+		uint32_t first = emu->head;
+		uint32_t skipped = 0;
+		if (!emu->config.wrap && first + nof_packet_bufs > nof_bufs) {
+			skipped = nof_bufs - first;
+			first = 0;
+		}
+
+		if (emu->nof_used + skipped + nof_packet_bufs > nof_bufs) {
+			/* Ring is full, the firmware drops the orbit */
+			emu->nof_dropped++;
+			pthread_mutex_unlock(&emu->lock);
+			orbit++;
+			bytes += len;
+			emu_pace(emu, &start, bytes);
+			continue;
+		}
+		pthread_mutex_unlock(&emu->lock);
+
+		if (!oversized) {
+			emu_set_orbit(emu, orbit);
+			emu_write_ring(wz, first, emu->packet, len);
+		}
+
+		pthread_mutex_lock(&emu->lock);
+		struct wz_xdma_data_block_desc *desc = &emu->blocks[(emu->blocks_head + emu->blocks_count) % nof_bufs];
+		desc->first_desc = first;
+		desc->last_desc = (first + nof_packet_bufs - 1) % nof_bufs;
+		desc->last_len = len - (size_t) (nof_packet_bufs - 1) * WZ_DMA_BUFLEN;
+		emu->blocks_count++;
+		emu->head = (first + nof_packet_bufs) % nof_bufs;
+		emu->nof_used += skipped + nof_packet_bufs;
+		emu->nof_packets++;
+		pthread_cond_broadcast(&emu->ready);
+		pthread_mutex_unlock(&emu->lock);
+
+		orbit++;
+		bytes += len;
+		emu_pace(emu, &start, bytes);
+	}
+
+	return NULL;
+}
+
+
+static int emu_close(struct wz_private* wz);
+
+static int emu_init(struct wz_private* wz)
+{
+	struct wz_emu *emu;
+	uint32_t nof_bufs = wz->emu_config.nof_bufs;
+
+	wz->fd_user = -1;
+	wz->fd_control = -1;
+	wz->fd_memory = -1;
+	wz->usr_regs = NULL;
+	wz->data_buf = NULL;
+
+	if (nof_bufs == 0 || nof_bufs > WZ_DMA_NOFBUFS || (nof_bufs & (nof_bufs - 1)) != 0) {
+		fprintf(stderr, "Emulator: number of buffers must be a power of 2 up to %d\n", WZ_DMA_NOFBUFS);
+		errno = EINVAL;
+		return -1;
+	}
+	if (wz->emu_config.bx_per_packet == 0 ||
+	    (size_t) wz->emu_config.bx_per_packet * EMU_BX_SIZE + EMU_TRAILER_SIZE > (size_t) nof_bufs * WZ_DMA_BUFLEN) {
+		fprintf(stderr, "Emulator: packet size does not fit into the ring\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ( (emu = calloc(1, sizeof(struct wz_emu))) == NULL ) {
+		return -1;
+	}
+	wz->emu = emu;
+	emu->config = wz->emu_config;
+	emu->fd_ring = -1;
+	pthread_mutex_init(&emu->lock, NULL);
+	pthread_cond_init(&emu->ready, NULL);
+
+	emu->packet_len = (size_t) emu->config.bx_per_packet * EMU_BX_SIZE + EMU_TRAILER_SIZE;
+	emu->blocks = calloc(nof_bufs, sizeof(struct wz_xdma_data_block_desc));
+	emu->packet = malloc(emu->packet_len);
+	if (!emu->blocks || !emu->packet) {
+		emu_close(wz);
+		errno = ENOMEM;
+		return -1;
+	}
+	emu_fill_template(emu);
+
+	// The ring is in shared memory, the same way as the DMA buffers mapped from the driver
+	if ( (emu->fd_ring = memfd_create("wz-emu-ring", 0)) < 0 ) {
+		PERROR("Emulator: Can't create DMA ring");
+		emu_close(wz);
+		return -1;
+	}
+	if ( ftruncate(emu->fd_ring, (off_t) nof_bufs * WZ_DMA_BUFLEN) < 0 ) {
+		PERROR("Emulator: Can't allocate DMA ring");
+		emu_close(wz);
+		return -1;
+	}
+
+	if ( wz_map_ring(wz, emu->fd_ring, (int64_t) nof_bufs * WZ_DMA_BUFLEN) < 0 ) {
+		emu_close(wz);
+		return -1;
+	}
+
+	// Like the driver buffers, the ring is allocated before the DMA starts
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wz_prefault(wz->data_buf, (size_t) nof_bufs * WZ_DMA_BUFLEN, wz->prefault_threads);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	wz->prefault_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+	if ( pthread_create(&emu->producer, NULL, emu_producer, wz) != 0 ) {
+		emu_close(wz);
+		errno = EAGAIN;
+		return -1;
+	}
+	emu->producer_started = 1;
+
+	return 0;
+}
+
+static int emu_close(struct wz_private* wz)
+{
+	struct wz_emu *emu = wz->emu;
+	if (!emu) {
+		return 0;
+	}
+
+	if (emu->producer_started) {
+		pthread_mutex_lock(&emu->lock);
+		emu->shutdown = 1;
+		pthread_cond_broadcast(&emu->ready);
+		pthread_mutex_unlock(&emu->lock);
+		pthread_join(emu->producer, NULL);
+	}
+	wz_unmap_ring(wz);
+	if (emu->fd_ring >= 0) {
+		close(emu->fd_ring);
+	}
+
+	pthread_cond_destroy(&emu->ready);
+	pthread_mutex_destroy(&emu->lock);
+	free(emu->blocks);
+	free(emu->packet);
+	free(emu);
+	wz->emu = NULL;
+	return 0;
+}
+
+static int emu_start_dma(struct wz_private* wz)
+{
+	struct wz_emu *emu = wz->emu;
+	pthread_mutex_lock(&emu->lock);
+	emu->running = 1;
+	pthread_cond_broadcast(&emu->ready);
+	pthread_mutex_unlock(&emu->lock);
+	return 0;
+}
+
+static int emu_stop_dma(struct wz_private* wz)
+{
+	struct wz_emu *emu = wz->emu;
+	pthread_mutex_lock(&emu->lock);
+	emu->running = 0;
+	pthread_mutex_unlock(&emu->lock);
+	return 0;
+}
+
+/* Wait for the next block, like IOCTL_XDMA_WZ_GETBUF */
+static int emu_get_buf(struct wz_private* wz)
+{
+	struct wz_emu *emu = wz->emu;
+
+	pthread_mutex_lock(&emu->lock);
+	emu->nof_reads++;
+	if (emu->config.eio_every && emu->nof_reads % emu->config.eio_every == 0) {
+		pthread_mutex_unlock(&emu->lock);
+		errno = EIO;
+		return -1;
+	}
+
+	while (emu->blocks_count == 0 && !emu->shutdown) {
+		pthread_cond_wait(&emu->ready, &emu->lock);
+	}
+	if (emu->blocks_count == 0) {
+		pthread_mutex_unlock(&emu->lock);
+		errno = EIO;
+		return -1;
+	}
+
+	wz->bdesc = emu->blocks[emu->blocks_head];
+	emu->blocks_head = (emu->blocks_head + 1) % emu->config.nof_bufs;
+	emu->blocks_count--;
+	pthread_mutex_unlock(&emu->lock);
+	return 0;
+}
+
+/* Release buffers from the oldest one up to last_desc, like IOCTL_XDMA_WZ_CONFIRM */
+static int emu_confirm_buf(struct wz_private* wz)
+{
+	struct wz_emu *emu = wz->emu;
+	uint32_t nof_bufs = emu->config.nof_bufs;
+
+	pthread_mutex_lock(&emu->lock);
+	uint32_t nof_released = (wz->bconf.last_desc + 1 + nof_bufs - emu->tail) % nof_bufs;
+	if (nof_released == 0) {
+		nof_released = nof_bufs;
+	}
+	if (wz->bconf.first_desc >= nof_bufs || wz->bconf.last_desc >= nof_bufs || nof_released > emu->nof_used) {
+		pthread_mutex_unlock(&emu->lock);
+		errno = EINVAL;
+		return -1;
+	}
+	emu->tail = (wz->bconf.last_desc + 1) % nof_bufs;
+	emu->nof_used -= nof_released;
+	pthread_mutex_unlock(&emu->lock);
+	return 0;
+}
+
+/* Like IOCTL_XDMA_WZ_GETFREE */
+static int emu_get_free(struct wz_private* wz)
+{
+	struct wz_emu *emu = wz->emu;
+
+	pthread_mutex_lock(&emu->lock);
+	int nof_free = emu->config.nof_bufs - emu->nof_used;
+	pthread_mutex_unlock(&emu->lock);
+	return nof_free;
+}
+
+const struct wz_backend wz_emulator_backend = {
+	.name = "emulator",
+	.init = emu_init,
+	.close = emu_close,
+	.start_dma = emu_start_dma,
+	.stop_dma = emu_stop_dma,
+	.get_buf = emu_get_buf,
+	.confirm_buf = emu_confirm_buf,
+	.get_free = emu_get_free,
+};
@@ -0,0 +1,26 @@
+#ifndef WZ_EMU_H
+#define WZ_EMU_H
+
+/*
+ * User-space emulator of the WZ DMA board and driver.
+ *
+ * The DMA ring of wz_emu_config.nof_bufs x WZ_DMA_BUFLEN bytes lives in shared
+ * memory, a producer thread writes orbits into it at a configurable rate, like
+ * the firmware does, and drops them when there are no free buffers. Read errors,
+ * oversized packets and ring wrap-arounds can be injected, so the zero-copy
+ * path of WZDmaInputFilter can be tested and benchmarked without a board.
+ */
+
+#include "wz_dma.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const struct wz_backend wz_emulator_backend;
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif